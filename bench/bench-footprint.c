@@ -0,0 +1,136 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Reports the memory used per connection: the size of the structures
+ * embedded by the application and the bytes allocated when a connection is
+ * initialized, with and without a warm per-loop slab.
+ */
+
+#include <uvtls.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CONNECTIONS_COUNT 100000
+
+static size_t allocated_bytes;
+static size_t allocations_count;
+
+static void* counting_malloc(size_t size) {
+  allocated_bytes += size;
+  allocations_count++;
+  return malloc(size);
+}
+
+static void* counting_realloc(void* ptr, size_t size) {
+  allocated_bytes += size;
+  allocations_count++;
+  return realloc(ptr, size);
+}
+
+static void* counting_calloc(size_t count, size_t size) {
+  allocated_bytes += count * size;
+  allocations_count++;
+  return calloc(count, size);
+}
+
+static void init_close(uv_loop_t* loop,
+                       uvtls_loop_t* tls_loop,
+                       uvtls_context_t* context) {
+  uv_tcp_t tcp;
+  uvtls_t tls;
+
+  uv_tcp_init(loop, &tcp);
+
+  allocated_bytes = allocations_count = 0;
+  if (uvtls_init_ex(&tls, context, (uv_stream_t*) &tcp, tls_loop) != 0) {
+    fprintf(stderr, "Unable to initialize connection\n");
+    exit(1);
+  }
+
+  uvtls_close(&tls, NULL);
+  uv_run(loop, UV_RUN_DEFAULT);
+}
+
+static void report_init(const char* name) {
+  printf("%-32s %8lu bytes %4lu allocations\n",
+         name,
+         (unsigned long) allocated_bytes,
+         (unsigned long) allocations_count);
+}
+
+int main() {
+  uv_loop_t loop;
+  uvtls_loop_t tls_loop;
+  uvtls_context_t context;
+
+  printf("%-32s %8lu bytes\n",
+         "sizeof(uvtls_t)",
+         (unsigned long) sizeof(uvtls_t));
+  printf("%-32s %8lu bytes\n",
+         "  read/write fields",
+         (unsigned long) offsetof(uvtls_t, context));
+  printf("%-32s %8lu cache lines\n",
+         "  read/write fields",
+         (unsigned long) ((offsetof(uvtls_t, context) + 63) / 64));
+  printf("%-32s %8lu bytes\n",
+         "  offset of incoming",
+         (unsigned long) offsetof(uvtls_t, incoming));
+  printf("%-32s %8lu bytes\n",
+         "  offset of outgoing",
+         (unsigned long) offsetof(uvtls_t, outgoing));
+  printf("%-32s %8lu bytes\n",
+         "sizeof(uvtls_write_t)",
+         (unsigned long) sizeof(uvtls_write_t));
+  printf("%-32s %8lu bytes\n",
+         "sizeof(uvtls_loop_t)",
+         (unsigned long) sizeof(uvtls_loop_t));
+  printf("%-32s %8lu KB\n",
+         "uvtls_t for 100k connections",
+         (unsigned long) (sizeof(uvtls_t) * CONNECTIONS_COUNT / 1024));
+
+  uvtls_replace_allocator(
+      counting_malloc, counting_realloc, counting_calloc, free);
+  /* Count OpenSSL's allocations too (only possible before it allocates) */
+  uvtls_replace_tls_allocator();
+
+  uv_loop_init(&loop);
+  uvtls_loop_init(&tls_loop, &loop);
+  uvtls_context_init(&context, UVTLS_CONTEXT_LIB_INIT);
+
+  init_close(&loop, NULL, &context);
+  init_close(&loop, NULL, &context);
+  report_init("uvtls_init()");
+
+  init_close(&loop, &tls_loop, &context);
+  init_close(&loop, &tls_loop, &context);
+  report_init("uvtls_init_ex() (warm slab)");
+
+  uvtls_loop_close(&tls_loop, NULL);
+  uv_run(&loop, UV_RUN_DEFAULT);
+
+  uvtls_context_destroy(&context);
+  uv_loop_close(&loop);
+
+  return 0;
+}
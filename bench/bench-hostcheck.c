@@ -0,0 +1,130 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Measures matching a hostname against certificates with many subject
+ * alternative names (e.g. CDN certificates), where the hostname only matches
+ * the last name.
+ */
+
+#include "curl-hostcheck.h"
+
+#include <uvtls.h>
+
+#include <openssl/x509v3.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ITERATIONS 1000
+
+static size_t allocations_count;
+
+static void* counting_malloc(size_t size) {
+  allocations_count++;
+  return malloc(size);
+}
+
+static void* counting_realloc(void* ptr, size_t size) {
+  allocations_count++;
+  return realloc(ptr, size);
+}
+
+static void* counting_calloc(size_t count, size_t size) {
+  allocations_count++;
+  return calloc(count, size);
+}
+
+static GENERAL_NAMES* create_names(int count) {
+  GENERAL_NAMES* names = sk_GENERAL_NAME_new_null();
+  int i;
+  for (i = 0; i < count; ++i) {
+    char buf[64];
+    GENERAL_NAME* name = GENERAL_NAME_new();
+    ASN1_IA5STRING* str = ASN1_IA5STRING_new();
+    snprintf(buf, sizeof(buf), "*.host%d.example.com", i);
+    ASN1_STRING_set(str, buf, (int) strlen(buf));
+    GENERAL_NAME_set0_value(name, GEN_DNS, str);
+    sk_GENERAL_NAME_push(names, name);
+  }
+  return names;
+}
+
+static int match_names(GENERAL_NAMES* names,
+                       const char* hostname,
+                       size_t length) {
+  int i;
+  for (i = 0; i < sk_GENERAL_NAME_num(names); ++i) {
+    GENERAL_NAME* name = sk_GENERAL_NAME_value(names, i);
+    ASN1_STRING* str = name->d.dNSName;
+    if (Curl_cert_hostcheck((const char*) ASN1_STRING_get0_data(str),
+                            (size_t) ASN1_STRING_length(str),
+                            hostname,
+                            length,
+                            0)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void run(int count) {
+  char hostname[64];
+  size_t length;
+  GENERAL_NAMES* names = create_names(count);
+  uint64_t start;
+  double elapsed;
+  int i;
+
+  snprintf(hostname, sizeof(hostname), "www.host%d.example.com", count - 1);
+  length = strlen(hostname);
+
+  allocations_count = 0;
+  start = uv_hrtime();
+  for (i = 0; i < ITERATIONS; ++i) {
+    if (!match_names(names, hostname, length)) {
+      fprintf(stderr, "Hostname should match\n");
+      exit(1);
+    }
+  }
+  elapsed = (double) (uv_hrtime() - start);
+
+  printf("%5d names %10.0f ns/check %8.1f ns/name %4lu allocations\n",
+         count,
+         elapsed / ITERATIONS,
+         elapsed / ITERATIONS / count,
+         (unsigned long) allocations_count);
+
+  sk_GENERAL_NAME_pop_free(names, GENERAL_NAME_free);
+}
+
+int main() {
+  uvtls_replace_allocator(
+      counting_malloc, counting_realloc, counting_calloc, free);
+
+  run(1);
+  run(10);
+  run(100);
+  run(500);
+
+  return 0;
+}
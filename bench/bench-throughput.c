@@ -0,0 +1,601 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Measures bulk transfer over loopback between a client and a server that
+ * run on their own loops and threads. Sweeps cipher suites, write sizes and
+ * the number of buffers each write is split into, and prints the results
+ * as JSON: throughput, CPU time (of the whole process) per GB and syscalls
+ * per MB. Syscalls are the stream reads and writes of both ends, each of
+ * which libuv makes with one read() or writev() unless a write is partial.
+ * An MB is 2^20 bytes.
+ *
+ * Given a worker count, instead measures how a uvtls_server_t scales: for 1,
+ * 2, 4, ... up to that many workers, as many clients (each on its own thread)
+ * transfer at once, one to each worker, and the total throughput is printed.
+ *
+ * Usage: bench-throughput [MB per run, 64 by default] [workers]
+ */
+
+#include "certs.h"
+
+#include <uvtls.h>
+
+#include <openssl/crypto.h>
+#include <openssl/ssl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_WRITE_SIZE (1024 * 1024)
+#define MAX_WRITES_IN_FLIGHT 32
+#define MAX_BYTES_IN_FLIGHT (8 * 1024 * 1024)
+#define MAX_BUFS 16
+#define MAX_WRITES_PER_RUN 65536 /* Keeps runs of small writes short */
+
+typedef struct cipher_s cipher_t;
+typedef struct run_s run_t;
+typedef struct connection_s connection_t;
+
+struct cipher_s {
+  const char* name;
+  int version;
+};
+
+/* A single transfer, shared by the client and server threads */
+struct run_s {
+  const cipher_t* cipher;
+  size_t write_size;
+  unsigned int nbufs;
+  uint64_t total_bytes;
+  /* Client */
+  uv_tcp_t client_tcp;
+  uvtls_t client;
+  uv_connect_t connect_req;
+  uvtls_write_t write_reqs[MAX_WRITES_IN_FLIGHT];
+  unsigned int writes_in_flight;
+  unsigned int max_writes_in_flight;
+  uint64_t bytes_written;
+  uint64_t start_time;
+  uv_rusage_t start_usage;
+  uvtls_stats_t client_stats;
+  /* Server */
+  uv_sem_t server_ready;
+  int port;
+  uv_tcp_t listener_tcp;
+  uvtls_t listener;
+  uv_tcp_t server_tcp;
+  uvtls_t server;
+  uint64_t bytes_read;
+  uint64_t end_time;
+  uv_rusage_t end_usage;
+  uvtls_stats_t server_stats;
+};
+
+/* A connection accepted by a worker of the scaling server */
+struct connection_s {
+  uv_tcp_t tcp;
+  uvtls_t tls;
+  uint64_t total_bytes;
+  uint64_t bytes_read;
+  char read_buf[64 * 1024];
+};
+
+static const cipher_t ciphers[] = {
+    {"TLS_AES_128_GCM_SHA256", TLS1_3_VERSION},
+    {"TLS_AES_256_GCM_SHA384", TLS1_3_VERSION},
+    {"TLS_CHACHA20_POLY1305_SHA256", TLS1_3_VERSION},
+    {"ECDHE-RSA-AES128-GCM-SHA256", TLS1_2_VERSION}};
+
+static const size_t write_sizes[] = {
+    64, 1024, 16 * 1024, 64 * 1024, MAX_WRITE_SIZE};
+
+static const unsigned int bufs_counts[] = {1, 4, MAX_BUFS};
+
+static char payload[MAX_WRITE_SIZE];
+static char read_buf[64 * 1024];
+
+static void check(int rc, const char* what) {
+  if (rc != 0) {
+    fprintf(stderr, "%s failed (%s)\n", what, uvtls_strerror(rc));
+    exit(1);
+  }
+}
+
+static double cpu_seconds(const uv_rusage_t* usage) {
+  return (double) usage->ru_utime.tv_sec +
+         (double) usage->ru_utime.tv_usec / 1e6 +
+         (double) usage->ru_stime.tv_sec +
+         (double) usage->ru_stime.tv_usec / 1e6;
+}
+
+static void on_server_alloc(uvtls_t* tls,
+                            size_t suggested_size,
+                            uv_buf_t* buf) {
+  buf->base = read_buf;
+  buf->len = sizeof(read_buf);
+}
+
+static void on_server_read(uvtls_t* tls, ssize_t nread, const uv_buf_t* buf) {
+  run_t* run = (run_t*) tls->data;
+
+  if (nread < 0) {
+    fprintf(stderr, "Server read failed (%s)\n", uvtls_strerror((int) nread));
+    exit(1);
+  }
+
+  run->bytes_read += (uint64_t) nread;
+  if (run->bytes_read == run->total_bytes) {
+    run->end_time = uv_hrtime();
+    uv_getrusage(&run->end_usage);
+    uvtls_get_stats(tls, &run->server_stats);
+    uvtls_close(tls, NULL);
+    uvtls_close(&run->listener, NULL);
+  }
+}
+
+static void on_accept(uvtls_t* tls, int status) {
+  check(status, "Server handshake");
+  check(uvtls_read_start(tls, on_server_alloc, on_server_read),
+        "Server read");
+}
+
+static void on_connection(uvtls_t* listener, int status) {
+  run_t* run = (run_t*) listener->data;
+
+  check(status, "Listen");
+  uv_tcp_init(run->listener_tcp.loop, &run->server_tcp);
+  check(uvtls_init(&run->server,
+                   listener->context,
+                   (uv_stream_t*) &run->server_tcp),
+        "Server init");
+  run->server.data = run;
+  check(uv_accept(listener->stream, run->server.stream), "Accept");
+  check(uvtls_accept(&run->server, on_accept), "Server accept");
+}
+
+static void run_server(void* arg) {
+  run_t* run = (run_t*) arg;
+  uv_loop_t loop;
+  uvtls_context_t context;
+  struct sockaddr_in addr;
+  struct sockaddr_storage name;
+  int name_length = sizeof(name);
+
+  uv_loop_init(&loop);
+  uvtls_context_init(&context, UVTLS_CONTEXT_LIB_INIT);
+  uvtls_context_set_verify_flags(&context, UVTLS_VERIFY_NONE);
+  check(uvtls_context_set_cert(&context, server_cert, strlen(server_cert)),
+        "Set certificate");
+  check(uvtls_context_set_private_key(
+            &context, server_key, strlen(server_key)),
+        "Set private key");
+
+  uv_ip4_addr("127.0.0.1", 0, &addr);
+  uv_tcp_init(&loop, &run->listener_tcp);
+  check(uv_tcp_bind(&run->listener_tcp, (const struct sockaddr*) &addr, 0),
+        "Bind");
+  uv_tcp_getsockname(
+      &run->listener_tcp, (struct sockaddr*) &name, &name_length);
+  run->port = ntohs(((struct sockaddr_in*) &name)->sin_port);
+
+  check(uvtls_init(
+            &run->listener, &context, (uv_stream_t*) &run->listener_tcp),
+        "Listener init");
+  run->listener.data = run;
+  check(uvtls_listen(&run->listener, 1, on_connection), "Listen");
+  uv_sem_post(&run->server_ready);
+
+  uv_run(&loop, UV_RUN_DEFAULT);
+
+  uvtls_context_destroy(&context);
+  uv_loop_close(&loop);
+}
+
+static void write_next(run_t* run);
+
+static void on_client_write(uvtls_write_t* req, int status) {
+  run_t* run = (run_t*) req->data;
+  check(status, "Client write");
+  req->data = NULL;
+  run->writes_in_flight--;
+  write_next(run);
+}
+
+static void on_client_alloc(uvtls_t* tls,
+                            size_t suggested_size,
+                            uv_buf_t* buf) {
+  static char data[1024];
+  buf->base = data;
+  buf->len = sizeof(data);
+}
+
+static void on_client_read(uvtls_t* tls, ssize_t nread, const uv_buf_t* buf) {
+  run_t* run = (run_t*) tls->data;
+  if (nread < 0) {
+    /* The server closes the connection once it has read everything */
+    uvtls_get_stats(tls, &run->client_stats);
+    uvtls_close(tls, NULL);
+  }
+}
+
+static void write_next(run_t* run) {
+  uv_buf_t bufs[MAX_BUFS];
+  size_t buf_size = run->write_size / run->nbufs;
+  unsigned int i;
+
+  while (run->writes_in_flight < run->max_writes_in_flight &&
+         run->bytes_written < run->total_bytes) {
+    /* Each write req is reused once its previous write completes */
+    uvtls_write_t* req = NULL;
+    for (i = 0; i < MAX_WRITES_IN_FLIGHT; ++i) {
+      if (run->write_reqs[i].data == NULL) {
+        req = &run->write_reqs[i];
+        break;
+      }
+    }
+    for (i = 0; i < run->nbufs; ++i) {
+      bufs[i] = uv_buf_init(payload + i * buf_size, (unsigned int) buf_size);
+    }
+    req->data = run;
+    check(uvtls_write(req, &run->client, bufs, run->nbufs, on_client_write),
+          "Client write");
+    run->writes_in_flight++;
+    run->bytes_written += buf_size * run->nbufs;
+  }
+}
+
+static void on_client_connect(uvtls_t* tls, int status) {
+  run_t* run = (run_t*) tls->data;
+  check(status, "Client handshake");
+  check(uvtls_read_start(tls, on_client_alloc, on_client_read),
+        "Client read");
+  run->start_time = uv_hrtime();
+  uv_getrusage(&run->start_usage);
+  write_next(run);
+}
+
+static void on_tcp_connect(uv_connect_t* req, int status) {
+  run_t* run = (run_t*) req->data;
+  check(status, "Connect");
+  check(uvtls_connect(&run->client, on_client_connect), "Client connect");
+}
+
+static void client_context_init(uvtls_context_t* context,
+                                const cipher_t* cipher) {
+  SSL_CTX* ssl_ctx;
+  int rc;
+
+  uvtls_context_init(context, UVTLS_CONTEXT_LIB_INIT);
+  uvtls_context_set_verify_flags(context, UVTLS_VERIFY_NONE);
+
+  /* Only offer the cipher suite being measured */
+  ssl_ctx = (SSL_CTX*) context->impl;
+  SSL_CTX_set_min_proto_version(ssl_ctx, cipher->version);
+  SSL_CTX_set_max_proto_version(ssl_ctx, cipher->version);
+  if (cipher->version == TLS1_3_VERSION) {
+    rc = SSL_CTX_set_ciphersuites(ssl_ctx, cipher->name);
+  } else {
+    rc = SSL_CTX_set_cipher_list(ssl_ctx, cipher->name);
+  }
+  if (rc != 1) {
+    fprintf(stderr, "Cipher suite %s isn't supported\n", cipher->name);
+    exit(1);
+  }
+}
+
+static void run_plan(run_t* run, uint64_t target_bytes) {
+  uint64_t bytes_per_write = (run->write_size / run->nbufs) * run->nbufs;
+
+  if (target_bytes > bytes_per_write * MAX_WRITES_PER_RUN) {
+    target_bytes = bytes_per_write * MAX_WRITES_PER_RUN;
+  }
+  run->total_bytes = target_bytes - target_bytes % bytes_per_write;
+  if (run->total_bytes == 0) {
+    run->total_bytes = bytes_per_write;
+  }
+  run->max_writes_in_flight = MAX_BYTES_IN_FLIGHT / run->write_size;
+  if (run->max_writes_in_flight > MAX_WRITES_IN_FLIGHT) {
+    run->max_writes_in_flight = MAX_WRITES_IN_FLIGHT;
+  } else if (run->max_writes_in_flight == 0) {
+    run->max_writes_in_flight = 1;
+  }
+}
+
+/* Writes the run's bytes to the server listening on `run->port` */
+static void run_client(void* arg) {
+  run_t* run = (run_t*) arg;
+  uv_loop_t loop;
+  uvtls_context_t context;
+  struct sockaddr_in addr;
+
+  uv_loop_init(&loop);
+  client_context_init(&context, run->cipher);
+  uv_tcp_init(&loop, &run->client_tcp);
+  check(uvtls_init(&run->client, &context, (uv_stream_t*) &run->client_tcp),
+        "Client init");
+  run->client.data = run;
+
+  uv_ip4_addr("127.0.0.1", run->port, &addr);
+  run->connect_req.data = run;
+  check(uv_tcp_connect(&run->connect_req,
+                       &run->client_tcp,
+                       (const struct sockaddr*) &addr,
+                       on_tcp_connect),
+        "Connect");
+
+  uv_run(&loop, UV_RUN_DEFAULT);
+
+  uvtls_context_destroy(&context);
+  uv_loop_close(&loop);
+}
+
+static void run_transfer(run_t* run, uint64_t target_bytes) {
+  uv_thread_t server_thread;
+
+  run_plan(run, target_bytes);
+
+  uv_sem_init(&run->server_ready, 0);
+  uv_thread_create(&server_thread, run_server, run);
+  uv_sem_wait(&run->server_ready);
+
+  run_client(run);
+  uv_thread_join(&server_thread);
+
+  uv_sem_destroy(&run->server_ready);
+}
+
+static void on_connection_close(uvtls_t* tls) {
+  free(tls->data);
+}
+
+static void on_connection_alloc(uvtls_t* tls,
+                                size_t suggested_size,
+                                uv_buf_t* buf) {
+  connection_t* connection = (connection_t*) tls->data;
+  buf->base = connection->read_buf;
+  buf->len = sizeof(connection->read_buf);
+}
+
+static void on_connection_read(uvtls_t* tls,
+                               ssize_t nread,
+                               const uv_buf_t* buf) {
+  connection_t* connection = (connection_t*) tls->data;
+
+  if (nread < 0) {
+    fprintf(stderr, "Server read failed (%s)\n", uvtls_strerror((int) nread));
+    exit(1);
+  }
+
+  connection->bytes_read += (uint64_t) nread;
+  if (connection->bytes_read == connection->total_bytes) {
+    uvtls_close(tls, on_connection_close);
+  }
+}
+
+static void on_worker_accept(uvtls_t* tls, int status) {
+  check(status, "Server handshake");
+  check(uvtls_read_start(tls, on_connection_alloc, on_connection_read),
+        "Server read");
+}
+
+static void on_worker_connection(uvtls_worker_t* worker, int status) {
+  connection_t* connection = (connection_t*) calloc(1, sizeof(connection_t));
+
+  check(status, "Dispatch");
+  connection->total_bytes = *(uint64_t*) worker->server->data;
+  connection->tls.data = connection;
+  uv_tcp_init(&worker->loop, &connection->tcp);
+  check(uvtls_worker_accept(
+            worker, &connection->tls, (uv_stream_t*) &connection->tcp),
+        "Worker accept");
+  check(uvtls_accept(&connection->tls, on_worker_accept), "Server accept");
+}
+
+static void on_server_stop(uv_async_t* async) {
+  uvtls_server_close((uvtls_server_t*) async->data, NULL);
+  uv_close((uv_handle_t*) async, NULL);
+}
+
+static void run_server_loop(void* arg) {
+  uv_run((uv_loop_t*) arg, UV_RUN_DEFAULT);
+}
+
+/* Runs `workers_count` transfers at once, one to each of the server's
+ * workers, and returns their total throughput in `run` */
+static void run_scaling(run_t* run,
+                        unsigned int workers_count,
+                        uint64_t target_bytes) {
+  uv_loop_t loop;
+  uv_thread_t server_thread;
+  uv_async_t stop;
+  uvtls_context_t context;
+  uvtls_server_t server;
+  struct sockaddr_in addr;
+  struct sockaddr_storage name;
+  int name_length = sizeof(name);
+  run_t* clients = (run_t*) calloc(workers_count, sizeof(run_t));
+  uv_thread_t* client_threads =
+      (uv_thread_t*) calloc(workers_count, sizeof(uv_thread_t));
+  unsigned int i;
+
+  run_plan(run, target_bytes);
+
+  uv_loop_init(&loop);
+  uvtls_context_init(&context, UVTLS_CONTEXT_LIB_INIT);
+  uvtls_context_set_verify_flags(&context, UVTLS_VERIFY_NONE);
+  check(uvtls_context_set_cert(&context, server_cert, strlen(server_cert)),
+        "Set certificate");
+  check(uvtls_context_set_private_key(
+            &context, server_key, strlen(server_key)),
+        "Set private key");
+
+  check(uvtls_server_init(&server, &loop, &context, workers_count),
+        "Server init");
+  server.data = &run->total_bytes;
+  uv_ip4_addr("127.0.0.1", 0, &addr);
+  check(uvtls_server_listen(&server,
+                            (const struct sockaddr*) &addr,
+                            (int) workers_count,
+                            on_worker_connection,
+                            NULL),
+        "Listen");
+  uv_tcp_getsockname(&server.tcp, (struct sockaddr*) &name, &name_length);
+  uv_async_init(&loop, &stop, on_server_stop);
+  stop.data = &server;
+
+  uv_thread_create(&server_thread, run_server_loop, &loop);
+
+  uv_getrusage(&run->start_usage);
+  run->start_time = uv_hrtime();
+  for (i = 0; i < workers_count; ++i) {
+    clients[i] = *run;
+    clients[i].port = ntohs(((struct sockaddr_in*) &name)->sin_port);
+    uv_thread_create(&client_threads[i], run_client, &clients[i]);
+  }
+  for (i = 0; i < workers_count; ++i) {
+    uv_thread_join(&client_threads[i]);
+  }
+  run->end_time = uv_hrtime();
+  uv_getrusage(&run->end_usage);
+  run->client_stats = clients[0].client_stats;
+  run->total_bytes *= workers_count;
+
+  uv_async_send(&stop);
+  uv_thread_join(&server_thread);
+
+  uvtls_context_destroy(&context);
+  uv_loop_close(&loop);
+  free(client_threads);
+  free(clients);
+}
+
+static void print_result(const run_t* run, int is_first) {
+  double seconds = (double) (run->end_time - run->start_time) / 1e9;
+  double mb = (double) run->total_bytes / (1024.0 * 1024.0);
+  double cpu = cpu_seconds(&run->end_usage) - cpu_seconds(&run->start_usage);
+  uint64_t syscalls =
+      run->client_stats.read_calls + run->client_stats.write_calls +
+      run->server_stats.read_calls + run->server_stats.write_calls;
+
+  printf("%s\n    {\"cipher\": \"%s\", \"version\": \"%s\", "
+         "\"write_size\": %lu, \"bufs\": %u, \"bytes\": %llu, "
+         "\"seconds\": %.6f, \"mb_per_second\": %.2f, "
+         "\"cpu_seconds_per_gb\": %.4f, \"syscalls_per_mb\": %.2f}",
+         is_first ? "" : ",",
+         run->client_stats.cipher ? run->client_stats.cipher : "",
+         run->client_stats.version ? run->client_stats.version : "",
+         (unsigned long) run->write_size,
+         run->nbufs,
+         (unsigned long long) run->total_bytes,
+         seconds,
+         mb / seconds,
+         cpu / (mb / 1024.0),
+         (double) syscalls / mb);
+  fflush(stdout);
+}
+
+static void print_scaling_result(const run_t* run,
+                                 unsigned int workers_count,
+                                 int is_first) {
+  double seconds = (double) (run->end_time - run->start_time) / 1e9;
+  double mb = (double) run->total_bytes / (1024.0 * 1024.0);
+  double cpu = cpu_seconds(&run->end_usage) - cpu_seconds(&run->start_usage);
+
+  printf("%s\n    {\"workers\": %u, \"cipher\": \"%s\", "
+         "\"write_size\": %lu, \"bytes\": %llu, \"seconds\": %.6f, "
+         "\"mb_per_second\": %.2f, \"cpu_seconds_per_gb\": %.4f}",
+         is_first ? "" : ",",
+         workers_count,
+         run->client_stats.cipher ? run->client_stats.cipher : "",
+         (unsigned long) run->write_size,
+         (unsigned long long) run->total_bytes,
+         seconds,
+         mb / seconds,
+         cpu / (mb / 1024.0));
+  fflush(stdout);
+}
+
+static void sweep_workers(uint64_t target_bytes,
+                          unsigned int max_workers_count) {
+  unsigned int workers_count;
+  int is_first = 1;
+
+  for (workers_count = 1; workers_count <= max_workers_count;
+       workers_count *= 2) {
+    run_t* run = (run_t*) calloc(1, sizeof(run_t));
+    run->cipher = &ciphers[0];
+    run->write_size = 64 * 1024;
+    run->nbufs = 1;
+    run_scaling(run, workers_count, target_bytes);
+    print_scaling_result(run, workers_count, is_first);
+    is_first = 0;
+    free(run);
+  }
+}
+
+static void sweep_transfers(uint64_t target_bytes) {
+  size_t c, w, b;
+  int is_first = 1;
+
+  for (c = 0; c < sizeof(ciphers) / sizeof(ciphers[0]); ++c) {
+    for (w = 0; w < sizeof(write_sizes) / sizeof(write_sizes[0]); ++w) {
+      for (b = 0; b < sizeof(bufs_counts) / sizeof(bufs_counts[0]); ++b) {
+        run_t* run = (run_t*) calloc(1, sizeof(run_t));
+        run->cipher = &ciphers[c];
+        run->write_size = write_sizes[w];
+        run->nbufs = bufs_counts[b];
+        run_transfer(run, target_bytes);
+        print_result(run, is_first);
+        is_first = 0;
+        free(run);
+      }
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  uint64_t target_bytes;
+  unsigned int max_workers_count;
+
+  target_bytes = (uint64_t) (argc > 1 ? atoi(argv[1]) : 64) * 1024 * 1024;
+  max_workers_count = argc > 2 ? (unsigned int) atoi(argv[2]) : 0;
+  memset(payload, 'x', sizeof(payload));
+
+  printf("{\n  \"benchmark\": \"%s\",\n"
+         "  \"tls_library\": \"%s\",\n"
+         "  \"mb_per_run\": %llu,\n"
+         "  \"results\": [",
+         max_workers_count > 0 ? "throughput_workers" : "throughput",
+         OpenSSL_version(OPENSSL_VERSION),
+         (unsigned long long) (target_bytes / (1024 * 1024)));
+
+  if (max_workers_count > 0) {
+    sweep_workers(target_bytes, max_workers_count);
+  } else {
+    sweep_transfers(target_bytes);
+  }
+
+  printf("\n  ]\n}\n");
+
+  return 0;
+}
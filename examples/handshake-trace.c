@@ -0,0 +1,236 @@
+#include <uvtls.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Traces a sample of handshakes to a host. The trace callback only copies
+ * events into a ring owned by the calling thread, without locks; an exporter
+ * thread drains every thread's ring and writes the events as JSON lines.
+ */
+
+#define RING_SIZE 4096 /* A power of two */
+
+#if defined(_MSC_VER)
+#define LOAD_ACQUIRE(ptr) (*(volatile unsigned long*) (ptr))
+#define STORE_RELEASE(ptr, value) (*(volatile unsigned long*) (ptr) = (value))
+#else
+#define LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, value) \
+  __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#endif
+
+typedef struct trace_ring_s trace_ring_t;
+typedef struct connection_s connection_t;
+
+/* A single producer (the traced thread), single consumer (the exporter)
+ * ring. The producer only writes `tail` and the consumer only `head`. */
+struct trace_ring_s {
+  uvtls_trace_event_t events[RING_SIZE];
+  unsigned long head;
+  unsigned long tail;
+  unsigned long dropped; /* Events that didn't fit, only read at exit */
+  trace_ring_t* next;
+};
+
+struct connection_s {
+  uv_tcp_t tcp;
+  uvtls_t tls;
+  uv_connect_t connect_req;
+};
+
+static uv_key_t ring_key;
+static uv_mutex_t rings_mutex;
+static trace_ring_t* rings; /* Registered once per thread */
+
+static uv_mutex_t exporter_mutex;
+static uv_cond_t exporter_cond;
+static int is_exporter_stopping;
+
+static const char* host;
+static const char* event_types[] = {
+    "QUEUED", "START", "MESSAGE", "STATE", "ALERT", "VERIFY", "DONE"};
+static const char* directions[] = {"NONE", "IN", "OUT"};
+
+trace_ring_t* local_ring(void) {
+  trace_ring_t* ring = (trace_ring_t*) uv_key_get(&ring_key);
+  if (!ring) {
+    ring = (trace_ring_t*) calloc(1, sizeof(trace_ring_t));
+    uv_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    uv_mutex_unlock(&rings_mutex);
+    uv_key_set(&ring_key, ring);
+  }
+  return ring;
+}
+
+void on_trace(const uvtls_trace_event_t* event) {
+  trace_ring_t* ring = local_ring();
+  unsigned long tail = ring->tail;
+  if (tail - LOAD_ACQUIRE(&ring->head) == RING_SIZE) {
+    ring->dropped++;
+    return;
+  }
+  ring->events[tail & (RING_SIZE - 1)] = *event;
+  STORE_RELEASE(&ring->tail, tail + 1);
+}
+
+void export_ring(trace_ring_t* ring) {
+  unsigned long head = ring->head;
+  unsigned long tail = LOAD_ACQUIRE(&ring->tail);
+  while (head != tail) {
+    const uvtls_trace_event_t* event = &ring->events[head & (RING_SIZE - 1)];
+    printf("{\"tls\": \"%p\", \"time\": %llu, \"type\": \"%s\", "
+           "\"direction\": \"%s\", \"state\": \"%s\", \"message\": %d, "
+           "\"alert\": %d, \"status\": \"%s\"}\n",
+           (void*) event->tls,
+           (unsigned long long) event->time,
+           event_types[event->type],
+           directions[event->direction],
+           event->state,
+           event->message,
+           event->alert,
+           event->status ? uvtls_err_name(event->status) : "OK");
+    head++;
+  }
+  STORE_RELEASE(&ring->head, head);
+}
+
+void export_rings(void) {
+  trace_ring_t* ring;
+  uv_mutex_lock(&rings_mutex);
+  for (ring = rings; ring; ring = ring->next) {
+    export_ring(ring);
+  }
+  uv_mutex_unlock(&rings_mutex);
+}
+
+void run_exporter(void* arg) {
+  uv_mutex_lock(&exporter_mutex);
+  while (!is_exporter_stopping) {
+    uv_cond_timedwait(&exporter_cond, &exporter_mutex, 100 * 1000 * 1000);
+    export_rings();
+  }
+  uv_mutex_unlock(&exporter_mutex);
+}
+
+void on_close(uvtls_t* tls) {
+  free(tls->data);
+}
+
+void on_connect(uvtls_t* tls, int status) {
+  if (status != 0) {
+    fprintf(stderr, "Handshake failed (%s)\n", uvtls_strerror(status));
+  }
+  uvtls_close(tls, on_close);
+}
+
+void on_tcp_connect(uv_connect_t* req, int status) {
+  uvtls_t* tls = (uvtls_t*) req->data;
+
+  if (status != 0) {
+    fprintf(stderr, "Failed to connect (%s)\n", uv_strerror(status));
+    uvtls_close(tls, on_close);
+    return;
+  }
+
+  uvtls_connect(tls, on_connect);
+}
+
+void on_getaddrinfo(uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
+  uvtls_context_t* tls_context = (uvtls_context_t*) req->data;
+  int count = *(int*) req->loop->data;
+  int i;
+
+  if (status != 0 || !res) {
+    fprintf(stderr,
+            "Unable to resolve \"%s\" (%s)\n",
+            host,
+            uv_strerror(status));
+    return;
+  }
+
+  for (i = 0; i < count; ++i) {
+    connection_t* connection = (connection_t*) malloc(sizeof(connection_t));
+    uv_tcp_init(req->loop, &connection->tcp);
+    uvtls_init(
+        &connection->tls, tls_context, (uv_stream_t*) &connection->tcp);
+    uvtls_set_hostname(&connection->tls, host, strlen(host));
+    connection->tls.data = connection;
+    connection->connect_req.data = &connection->tls;
+    uv_tcp_connect(&connection->connect_req,
+                   &connection->tcp,
+                   res->ai_addr,
+                   on_tcp_connect);
+  }
+  uv_freeaddrinfo(res);
+}
+
+int main(int argc, char** argv) {
+  uvtls_context_t tls_context;
+  uv_getaddrinfo_t getaddrinfo_req;
+  uv_thread_t exporter;
+  struct addrinfo hints;
+  trace_ring_t* ring;
+  unsigned long dropped = 0;
+  int count;
+  unsigned int sample_rate;
+
+  if (argc <= 1) {
+    fprintf(stderr,
+            "Usage: %s <host> [connections] [sample rate]\n",
+            argv[0]);
+    return 1;
+  }
+
+  host = argv[1];
+  count = argc > 2 ? atoi(argv[2]) : 10;
+  sample_rate = argc > 3 ? (unsigned int) atoi(argv[3]) : 1;
+
+  uv_key_create(&ring_key);
+  uv_mutex_init(&rings_mutex);
+  uv_mutex_init(&exporter_mutex);
+  uv_cond_init(&exporter_cond);
+  uv_thread_create(&exporter, run_exporter, NULL);
+
+  uvtls_context_init(&tls_context, UVTLS_CONTEXT_LIB_INIT);
+  uvtls_context_set_verify_flags(&tls_context, UVTLS_VERIFY_PEER_IDENT);
+  uvtls_context_set_trace_cb(&tls_context, on_trace, NULL, sample_rate);
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  uv_default_loop()->data = &count;
+  getaddrinfo_req.data = &tls_context;
+  uv_getaddrinfo(uv_default_loop(),
+                 &getaddrinfo_req,
+                 on_getaddrinfo,
+                 host,
+                 "443",
+                 &hints);
+
+  uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+  uv_mutex_lock(&exporter_mutex);
+  is_exporter_stopping = 1;
+  uv_cond_signal(&exporter_cond);
+  uv_mutex_unlock(&exporter_mutex);
+  uv_thread_join(&exporter);
+  export_rings();
+
+  while (rings) {
+    ring = rings;
+    rings = ring->next;
+    dropped += ring->dropped;
+    free(ring);
+  }
+  if (dropped > 0) {
+    fprintf(stderr, "Dropped %lu events\n", dropped);
+  }
+
+  uv_loop_close(uv_default_loop());
+  uvtls_context_destroy(&tls_context);
+}
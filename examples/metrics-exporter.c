@@ -0,0 +1,199 @@
+#include <uvtls.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Serves uvtls_get_metrics() in the Prometheus text format over plain HTTP.
+ * The exporter's loop can run next to the application's loops, possibly on
+ * its own thread; every thread's counters are included in the snapshot.
+ */
+
+typedef struct exporter_client_s exporter_client_t;
+
+struct exporter_client_s {
+  uv_tcp_t tcp;
+  uv_write_t write_req;
+  int is_responding;
+  char read_buf[4096];
+  char body[8192];
+  char header[256];
+};
+
+void append(char* buf, size_t len, size_t* size, const char* format, ...) {
+  va_list args;
+  int rc;
+  if (*size >= len) {
+    return; /* Truncated */
+  }
+  va_start(args, format);
+  rc = vsnprintf(buf + *size, len - *size, format, args);
+  va_end(args);
+  if (rc > 0) {
+    *size += (size_t) rc;
+  }
+}
+
+#define METRIC(name, type, help, value)     \
+  append(buf,                               \
+         len,                               \
+         &size,                             \
+         "# HELP uvtls_" name " " help "\n" \
+         "# TYPE uvtls_" name " " type "\n" \
+         "uvtls_" name " %llu\n",           \
+         (unsigned long long) (value))
+
+size_t format_metrics(char* buf, size_t len) {
+  uvtls_metrics_t metrics;
+  size_t size = 0;
+  int i;
+
+  uvtls_get_metrics(&metrics);
+
+  METRIC("handshakes_started_total",
+         "counter",
+         "Handshakes started.",
+         metrics.handshakes_started);
+  METRIC("handshakes_completed_total",
+         "counter",
+         "Handshakes completed.",
+         metrics.handshakes_completed);
+  METRIC("handshakes_resumed_total",
+         "counter",
+         "Handshakes completed by resuming a session.",
+         metrics.handshakes_resumed);
+
+  append(buf,
+         len,
+         &size,
+         "# HELP uvtls_handshakes_failed_total Handshakes failed.\n"
+         "# TYPE uvtls_handshakes_failed_total counter\n");
+  for (i = 0; i < UVTLS_METRICS_ERRORS; ++i) {
+    append(buf,
+           len,
+           &size,
+           "uvtls_handshakes_failed_total{error=\"%s\"} %llu\n",
+           uvtls_err_name(uvtls_metrics_error(i)),
+           (unsigned long long) metrics.handshakes_failed[i]);
+  }
+
+  METRIC("connections_active",
+         "gauge",
+         "Connections with a completed handshake.",
+         metrics.connections_active);
+  METRIC("ring_buf_blocks",
+         "gauge",
+         "Ring buffer blocks allocated.",
+         metrics.ring_buf_blocks);
+  METRIC("slab_bytes",
+         "gauge",
+         "Bytes freed but cached by loops for reuse.",
+         metrics.slab_bytes);
+  METRIC("bytes_encrypted_total",
+         "counter",
+         "Application data bytes encrypted.",
+         metrics.bytes_encrypted);
+  METRIC("bytes_decrypted_total",
+         "counter",
+         "Application data bytes decrypted.",
+         metrics.bytes_decrypted);
+
+  return size < len ? size : len - 1;
+}
+
+#undef METRIC
+
+void on_close(uv_handle_t* handle) {
+  free(handle->data);
+}
+
+void on_write(uv_write_t* req, int status) {
+  exporter_client_t* client = (exporter_client_t*) req->data;
+  uv_close((uv_handle_t*) &client->tcp, on_close);
+}
+
+void on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  exporter_client_t* client = (exporter_client_t*) handle->data;
+  buf->base = client->read_buf;
+  buf->len = sizeof(client->read_buf);
+}
+
+void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  exporter_client_t* client = (exporter_client_t*) stream->data;
+  uv_buf_t bufs[2];
+  size_t size;
+
+  if (nread < 0) {
+    uv_close((uv_handle_t*) stream, on_close);
+    return;
+  }
+
+  /* Any request gets the metrics, it's assumed to fit in a single read */
+  if (nread == 0 || client->is_responding) {
+    return;
+  }
+  client->is_responding = 1;
+  uv_read_stop(stream);
+
+  size = format_metrics(client->body, sizeof(client->body));
+  snprintf(client->header,
+           sizeof(client->header),
+           "HTTP/1.0 200 OK\r\n"
+           "Content-Type: text/plain; version=0.0.4\r\n"
+           "Content-Length: %lu\r\n\r\n",
+           (unsigned long) size);
+
+  bufs[0] =
+      uv_buf_init(client->header, (unsigned int) strlen(client->header));
+  bufs[1] = uv_buf_init(client->body, (unsigned int) size);
+  client->write_req.data = client;
+  uv_write(&client->write_req, stream, bufs, 2, on_write);
+}
+
+void on_connection(uv_stream_t* server, int status) {
+  exporter_client_t* client;
+
+  if (status != 0) {
+    fprintf(stderr, "Connection error (%s)\n", uv_strerror(status));
+    return;
+  }
+
+  client = (exporter_client_t*) malloc(sizeof(exporter_client_t));
+  client->is_responding = 0;
+  uv_tcp_init(server->loop, &client->tcp);
+  client->tcp.data = client;
+
+  if (uv_accept(server, (uv_stream_t*) &client->tcp) != 0) {
+    uv_close((uv_handle_t*) &client->tcp, on_close);
+    return;
+  }
+
+  uv_read_start((uv_stream_t*) &client->tcp, on_alloc, on_read);
+}
+
+int main(int argc, char** argv) {
+  uv_tcp_t server;
+  struct sockaddr_in addr;
+  int port = argc > 1 ? atoi(argv[1]) : 9464;
+  int rc;
+
+  uv_ip4_addr("0.0.0.0", port, &addr);
+
+  uv_tcp_init(uv_default_loop(), &server);
+  rc = uv_tcp_bind(&server, (const struct sockaddr*) &addr, 0);
+  if (rc == 0) {
+    rc = uv_listen((uv_stream_t*) &server, 128, on_connection);
+  }
+  if (rc != 0) {
+    fprintf(stderr, "Unable to listen on %d (%s)\n", port, uv_strerror(rc));
+    return 1;
+  }
+
+  printf("Serving metrics on http://0.0.0.0:%d/metrics\n", port);
+
+  uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+  uv_loop_close(uv_default_loop());
+}
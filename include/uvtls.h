@@ -30,15 +30,29 @@
  * - Better error and OOM handling
  * - Provide a way to change supported ciphers
  * - Handle TLS renegotiation
- * - Server certificates chain support
- * - Replace allocator
  * - Support other TLS libraries (boringssl, SChannel, NSS)
  * - Move more core implementation into the shared code
  */
 
 typedef struct uvtls_context_s uvtls_context_t;
+typedef struct uvtls_loop_s uvtls_loop_t;
+typedef struct uvtls_handshake_stats_s uvtls_handshake_stats_t;
+typedef struct uvtls_verify_cache_stats_s uvtls_verify_cache_stats_t;
+typedef struct uvtls_trust_store_s uvtls_trust_store_t;
+typedef struct uvtls_stats_s uvtls_stats_t;
+typedef struct uvtls_metrics_s uvtls_metrics_t;
 typedef struct uvtls_s uvtls_t;
 typedef struct uvtls_write_s uvtls_write_t;
+typedef struct uvtls_verify_s uvtls_verify_t;
+typedef struct uvtls_trace_event_s uvtls_trace_event_t;
+typedef struct uvtls_error_s uvtls_error_t;
+typedef struct uvtls_server_s uvtls_server_t;
+typedef struct uvtls_worker_s uvtls_worker_t;
+
+typedef void* (*uvtls_malloc_func)(size_t size);
+typedef void* (*uvtls_realloc_func)(void* ptr, size_t size);
+typedef void* (*uvtls_calloc_func)(size_t count, size_t size);
+typedef void (*uvtls_free_func)(void* ptr);
 
 typedef void (*uvtls_alloc_cb)(uvtls_t* tls,
                                size_t suggested_size,
@@ -54,10 +68,25 @@ typedef void (*uvtls_connection_cb)(uvtls_t* server, int status);
 
 typedef void (*uvtls_close_cb)(uvtls_t* tls);
 typedef void (*uvtls_write_cb)(uvtls_write_t* req, int status);
+typedef int (*uvtls_verify_cb)(const uvtls_verify_t* req);
+typedef void (*uvtls_trace_cb)(const uvtls_trace_event_t* event);
+typedef void (*uvtls_error_log_cb)(const uvtls_t* tls,
+                                   const uvtls_error_t* error,
+                                   unsigned long suppressed,
+                                   void* data);
+
+typedef void (*uvtls_loop_close_cb)(uvtls_loop_t* tls_loop);
+
+typedef void (*uvtls_worker_connection_cb)(uvtls_worker_t* worker,
+                                           int status);
+typedef void (*uvtls_worker_stop_cb)(uvtls_worker_t* worker);
+typedef void (*uvtls_server_close_cb)(uvtls_server_t* server);
 
 
 #define UVTLS__ERR(x) (UV_ERRNO_MAX - (x))
 
+#define UVTLS__EREVOKED UVTLS__ERR(9)
+#define UVTLS__EQUEUETIMEOUT UVTLS__ERR(8)
 #define UVTLS__UNKNOWN UVTLS__ERR(7)
 #define UVTLS__EINVAL UVTLS__ERR(6)
 #define UVTLS__EHANDSHAKE UVTLS__ERR(5)
@@ -73,36 +102,154 @@ typedef void (*uvtls_write_cb)(uvtls_write_t* req, int status);
   XX(ENOPEERCERT, "no peer certificate")       \
   XX(EBADPEERCERT, "invalid peer certificate") \
   XX(EBADPEERIDENT, "invalid peer identity")   \
-  XX(EREAD, "Read error")
+  XX(EREAD, "Read error")                      \
+  XX(EQUEUETIMEOUT, "handshake queue timeout") \
+  XX(EREVOKED, "peer certificate revoked")
 
 typedef enum {
 #define XX(code, _) UVTLS_##code = UVTLS__##code,
   UVTLS_ERRNO_MAP(XX)
 #undef XX
-      UVTLS_ERRNO_MAX = UVTLS__UNKNOWN - 1
+      UVTLS_ERRNO_MAX = UVTLS__EREVOKED - 1
 } uvtls_errno_t;
 
 struct uvtls_context_s {
   void* data;
   void* impl;
-  int verify_flags;
+};
+
+struct uvtls_trust_store_s {
+  void* impl;
+  long is_published;
+};
+
+struct uvtls_handshake_stats_s {
+  unsigned int active;
+  unsigned int queued;
+  unsigned int max_queued;
+  uint64_t started;
+  uint64_t total_queued;
+  uint64_t shed;
+  uint64_t timed_out;
+  uint64_t total_wait_time;
+  uint64_t max_wait_time;
+};
+
+struct uvtls_verify_cache_stats_s {
+  size_t count;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+struct uvtls_stats_s {
+  uint64_t plaintext_bytes_in;   /* Passed to the read callback */
+  uint64_t plaintext_bytes_out;  /* Written with uvtls_write() */
+  uint64_t ciphertext_bytes_in;  /* Read from the stream */
+  uint64_t ciphertext_bytes_out; /* Written to the stream */
+  uint64_t records_in;
+  uint64_t records_out;
+  uint64_t read_calls;      /* Reads from the stream */
+  uint64_t write_calls;     /* Write requests to the stream */
+  uint64_t handshake_start; /* From uv_hrtime(), zero until it starts */
+  uint64_t handshake_end;   /* From uv_hrtime(), zero until it's done */
+  size_t max_incoming_size; /* Peak ciphertext waiting to be decrypted */
+  size_t max_outgoing_size; /* Peak ciphertext waiting to be written */
+  int is_session_reused;
+  const char* cipher;  /* NULL until the handshake is done */
+  const char* version; /* NULL until the handshake is done */
+};
+
+struct uvtls_error_s {
+  unsigned long code; /* The TLS library's error code, zero if none */
+  int library;        /* The TLS library's module that reported it */
+  int reason;
+  int ssl_error; /* The kind of failure, from SSL_get_error() */
+};
+
+/* Slots of uvtls_metrics_t's handshakes_failed, see uvtls_metrics_error() */
+#define UVTLS_METRICS_ERRORS 10
+
+struct uvtls_metrics_s {
+  uint64_t handshakes_started;
+  uint64_t handshakes_completed;
+  uint64_t handshakes_resumed; /* Completed by resuming a session */
+  uint64_t handshakes_failed[UVTLS_METRICS_ERRORS];
+  uint64_t connections_active; /* Completed handshakes not yet closed */
+  uint64_t ring_buf_blocks;    /* Held by all ring buffers */
+  uint64_t slab_bytes;         /* Freed but cached by loops for reuse */
+  uint64_t bytes_encrypted;    /* Written with uvtls_write() */
+  uint64_t bytes_decrypted;    /* Passed to read callbacks */
+};
+
+struct uvtls_loop_s {
+  uv_loop_t* loop;
+  void* data;
+  unsigned int max_handshakes;
+  uint64_t handshake_queue_timeout;
+  uint64_t handshake_timeout;
+  void* handshake_queue[2];
+  uv_timer_t timer;
+  uvtls_timer_wheel_t timer_wheel;
+  uvtls_handshake_stats_t handshake_stats;
+  uvtls_slab_t session_slab;
+  uvtls_slab_t block_slab;
+  uvtls_loop_close_cb close_cb;
 };
 
 struct uvtls_s {
+  /* Used when reading and writing: 192 bytes, or three 64-byte cache lines.
+   * The fields before the ring buffers fill the first line, so a read
+   * touches that line and `incoming`'s, and a write that line and
+   * `outgoing`'s (when the struct is 64-byte aligned) */
   uv_stream_t* stream;
   void* data;
   void* impl;
-  uvtls_context_t* context;
-  char hostname[256];
-  uvtls_ring_buf_t incoming;
-  uvtls_ring_buf_t outgoing;
+  unsigned int flags;
   uvtls_alloc_cb alloc_cb;
-  uv_buf_t alloc_buf;
   uvtls_read_cb read_cb;
+  uv_buf_t alloc_buf;
+  uvtls_ring_buf_t incoming;
+  uvtls_ring_buf_t outgoing;
+  /* Only used when connecting, handshaking or closing */
+  uvtls_context_t* context;
+  uvtls_loop_t* tls_loop;
+  char* hostname;
   uvtls_handshake_done_cb handshake_done_cb;
   uvtls_connection_cb connection_cb;
-  uvtls_ring_buf_pos_t commit_pos;
   uvtls_close_cb close_cb;
+  void* handshake_queue[2];
+  uint64_t handshake_queued_time;
+  uvtls_timer_wheel_entry_t handshake_timer;
+};
+
+struct uvtls_worker_s {
+  void* data;
+  uvtls_server_t* server;
+  uv_loop_t loop;
+  uvtls_loop_t tls_loop;
+  uv_pipe_t ipc;      /* Receives accepted sockets on the worker's loop */
+  uv_pipe_t dispatch; /* Sends accepted sockets from the server's loop */
+  uv_file dispatch_fd;
+  uv_thread_t thread;
+  int is_started;
+  char ipc_buf[16];
+};
+
+struct uvtls_server_s {
+  void* data;
+  uv_loop_t* loop;
+  uvtls_context_t* context;
+  uv_tcp_t tcp;
+  uv_async_t async;
+  uvtls_worker_t* workers;
+  unsigned int workers_count;
+  unsigned int next_worker;
+  long workers_stopped;
+  unsigned int pending_closes;
+  int is_closing;
+  uvtls_worker_connection_cb connection_cb;
+  uvtls_worker_stop_cb stop_cb;
+  uvtls_server_close_cb close_cb;
 };
 
 struct uvtls_write_s {
@@ -111,11 +258,60 @@ struct uvtls_write_s {
   uvtls_t* tls;
   uvtls_write_cb cb;
   uvtls_ring_buf_pos_t commit_pos;
+  void* queue[2];
+  uv_buf_t* bufs;
+  unsigned int nbufs;
+  uv_buf_t bufsml[4];
+};
+
+struct uvtls_verify_s {
+  void* data; /* From uvtls_context_set_verify_cb() */
+  uvtls_t* tls;
+  const char* hostname;  /* NULL if none was set */
+  const uv_buf_t* certs; /* The peer's DER encoded certificates, leaf first */
+  unsigned int ncerts;
+};
+
+typedef enum {
+  UVTLS_TRACE_QUEUED,  /* Waiting for a handshake slot of the loop */
+  UVTLS_TRACE_START,   /* The handshake started */
+  UVTLS_TRACE_MESSAGE, /* A handshake message was sent or received */
+  UVTLS_TRACE_STATE,   /* The handshake state changed */
+  UVTLS_TRACE_ALERT,   /* An alert was sent or received */
+  UVTLS_TRACE_VERIFY,  /* The verify callback started */
+  UVTLS_TRACE_DONE     /* The handshake finished */
+} uvtls_trace_type_t;
+
+typedef enum {
+  UVTLS_TRACE_NONE,
+  UVTLS_TRACE_IN, /* Received from the peer */
+  UVTLS_TRACE_OUT /* Sent to the peer */
+} uvtls_trace_direction_t;
+
+struct uvtls_trace_event_s {
+  void* data; /* From uvtls_context_set_trace_cb() */
+  uvtls_t* tls;
+  uint64_t time; /* From uv_hrtime() */
+  uvtls_trace_type_t type;
+  uvtls_trace_direction_t direction;
+  const char* state; /* The TLS library's short name of the handshake state */
+  int message;       /* UVTLS_TRACE_MESSAGE: the handshake message type */
+  int alert;         /* UVTLS_TRACE_ALERT: level << 8 | description */
+  int status;        /* UVTLS_TRACE_DONE: the handshake's status */
 };
 
 typedef enum {
   UVTLS_CONTEXT_LIB_INIT = 0x01,
-  UVTLS_CONTEXT_DEBUG = 0x02
+  /* Trace every handshake to stderr, see uvtls_context_set_trace_cb() */
+  UVTLS_CONTEXT_DEBUG = 0x02,
+  /* Enable TLS False Start for clients (only forward-secret AEAD cipher
+   * suites). uvtls_context_init() returns UV_ENOTSUP if the TLS library
+   * doesn't implement it, such as OpenSSL. */
+  UVTLS_CONTEXT_FALSE_START = 0x04,
+  /* Release the memory held by idle connections: OpenSSL's record buffers
+   * and the connection's ring buffers, which are reacquired when data is next
+   * read or written. */
+  UVTLS_CONTEXT_HIBERNATE = 0x08
 } uvtls_context_flags_t;
 
 typedef enum {
@@ -124,28 +320,363 @@ typedef enum {
   UVTLS_VERIFY_PEER_IDENT = 0x02
 } uvtls_verify_flags_t;
 
+/*
+ * Replace the functions used to allocate uvtls's memory, like
+ * uv_replace_allocator(). It must be called before any other uvtls function.
+ */
+int uvtls_replace_allocator(uvtls_malloc_func malloc_func,
+                            uvtls_realloc_func realloc_func,
+                            uvtls_calloc_func calloc_func,
+                            uvtls_free_func free_func);
+
+/*
+ * Also allocate the TLS library's (OpenSSL's) memory using the replaced
+ * allocator. It must be called after uvtls_replace_allocator() and before the
+ * TLS library has allocated anything, otherwise UV_EBUSY is returned.
+ */
+int uvtls_replace_tls_allocator(void);
+
+/*
+ * A context can be shared by connections on any number of loops and threads.
+ * Its configuration is frozen once the first connection using it starts a
+ * handshake (or it's added using uvtls_context_add_sni()). After that the
+ * setters return UV_EBUSY, except for uvtls_context_reload_cert() and the OCSP
+ * functions, which are safe to call at any time.
+ */
 int uvtls_context_init(uvtls_context_t* context, int init_flags);
+
+/*
+ * Release the context. Connections that were initialized with it hold a
+ * reference to its state and may continue to be used until they're closed.
+ */
 void uvtls_context_destroy(uvtls_context_t* context);
 
-void uvtls_context_set_verify_flags(uvtls_context_t* context,
-                                    int verify_flags);
+/*
+ * A set of trusted certificates that's loaded once and shared by any number
+ * of contexts (on any thread), e.g. the system's CA certificates. The TLS
+ * library must have been initialized, see UVTLS_CONTEXT_LIB_INIT.
+ */
+int uvtls_trust_store_init(uvtls_trust_store_t* store);
+
+/*
+ * Release the store. Contexts that it was set on keep a reference to it.
+ */
+void uvtls_trust_store_destroy(uvtls_trust_store_t* store);
+
+int uvtls_trust_store_add_certs(uvtls_trust_store_t* store,
+                                const char* cert,
+                                size_t length);
+
+/* See uvtls_context_add_trusted_dir() */
+int uvtls_trust_store_add_dir(uvtls_trust_store_t* store, const char* path);
+
+int uvtls_context_set_verify_flags(uvtls_context_t* context,
+                                   int verify_flags);
+int uvtls_context_get_verify_flags(const uvtls_context_t* context);
 
 int uvtls_context_add_trusted_certs(uvtls_context_t* context,
                                     const char* cert,
                                     size_t length);
+
+/*
+ * Trust the certificates of a hashed directory (as created by `openssl
+ * rehash`). Certificates are read from the directory when a chain being
+ * verified needs them instead of up front.
+ */
+int uvtls_context_add_trusted_dir(uvtls_context_t* context, const char* path);
+
+/*
+ * Replace the context's trusted certificates with a shared trust store. The
+ * store can't be changed after it's set on a context.
+ */
+int uvtls_context_set_trust_store(uvtls_context_t* context,
+                                  uvtls_trust_store_t* store);
+
+/*
+ * Run `cb` once the peer of a handshake passed the checks of the verify
+ * flags, e.g. to apply revocation or pinning policies. The handshake
+ * finishes with the status that `cb` returns, use UVTLS_EBADPEERCERT to
+ * reject the peer. If `offload` is non-zero `cb` runs on the threadpool
+ * (where `req->tls` may only be used to identify the connection) and the
+ * connection isn't closed until it returns.
+ */
+int uvtls_context_set_verify_cb(uvtls_context_t* context,
+                                uvtls_verify_cb cb,
+                                void* data,
+                                int offload);
+
+/*
+ * Remember up to `max_entries` peer certificate chains (with the hostname
+ * they were verified for) that passed verification, so that handshakes
+ * presenting the same chain skip verifying its signatures and the hostname.
+ * An entry is used until a certificate of the verified chain expires or until
+ * trusted certificates are added. Chains are identified by a SHA-256 digest
+ * of their certificates' fingerprints. A `max_entries` of zero disables the
+ * cache, which is the default. Returns UV_ENOTSUP with OpenSSL before 1.1.0.
+ */
+int uvtls_context_set_verify_cache(uvtls_context_t* context,
+                                   size_t max_entries);
+
+void uvtls_context_get_verify_cache_stats(const uvtls_context_t* context,
+                                          uvtls_verify_cache_stats_t* stats);
+
+/*
+ * Trace one in `sample_rate` handshakes: `cb` gets timestamped events from
+ * when the handshake is queued or started until it's done, and for alerts
+ * after that. Handshakes that aren't sampled cost nothing. `cb` runs on the
+ * loop's thread, or the threadpool's for writes offloaded with
+ * uvtls_set_write_offload(), and shouldn't block. A NULL `cb` or a
+ * `sample_rate` of zero disables tracing, which is the default.
+ */
+int uvtls_context_set_trace_cb(uvtls_context_t* context,
+                               uvtls_trace_cb cb,
+                               void* data,
+                               unsigned int sample_rate);
+
+/*
+ * Call `cb` when a connection records a TLS library error (see
+ * uvtls_get_error()), at most `max_per_second` times a second across all of
+ * the context's connections; zero doesn't limit it. `suppressed` is the
+ * number of errors dropped since the previous call. Errors are passed as
+ * codes, format them with uvtls_error_string() if needed. By default errors
+ * are only recorded.
+ */
+int uvtls_context_set_error_log_cb(uvtls_context_t* context,
+                                   uvtls_error_log_cb cb,
+                                   void* data,
+                                   unsigned int max_per_second);
+
+/*
+ * Set the certificate from PEM data that has the leaf certificate followed by
+ * any intermediate certificates, which are sent along with it.
+ */
 int uvtls_context_set_cert(uvtls_context_t* context,
                            const char* cert,
                            size_t length);
+
+/*
+ * Atomically replace the certificate chain (as uvtls_context_set_cert()) and
+ * private key used by new handshakes, e.g. to rotate certificates without
+ * restarting listeners. Running handshakes and established connections keep
+ * the previous certificate. Handshakes never block on a reload, which may
+ * be called from any thread. The reloaded certificate takes precedence over
+ * uvtls_context_set_cert().
+ */
+int uvtls_context_reload_cert(uvtls_context_t* context,
+                              const char* cert,
+                              size_t cert_length,
+                              const char* key,
+                              size_t key_length);
+
+/*
+ * Enable or disable TLS 1.3 certificate compression (RFC 8879). When enabled
+ * the certificate chain is compressed once, when it's set, with every
+ * available algorithm (zlib, brotli or zstd). Returns UV_ENOTSUP if the TLS
+ * library doesn't support it (OpenSSL before 3.2 or built without any of the
+ * algorithms).
+ */
+int uvtls_context_set_cert_compression(uvtls_context_t* context, int enable);
 int uvtls_context_set_private_key(uvtls_context_t* context,
                                   const char* key,
                                   size_t length);
 
+/*
+ * Staple a DER encoded OCSP response to server handshakes that request the
+ * certificate's status. The response is copied and replaced atomically
+ * without blocking running handshakes. A `length` of zero stops stapling.
+ */
+int uvtls_context_set_ocsp_response(uvtls_context_t* context,
+                                    const char* response,
+                                    size_t length);
+
+/*
+ * Like uvtls_context_set_ocsp_response(), but the response is loaded from a
+ * file. If `loop` isn't NULL the file is polled every `interval` milliseconds
+ * and reloaded in the threadpool when it changes. The watch ends when the
+ * response is replaced or the context is destroyed, which must then happen on
+ * the loop's thread.
+ */
+int uvtls_context_set_ocsp_response_file(uvtls_context_t* context,
+                                         uv_loop_t* loop,
+                                         const char* path,
+                                         unsigned int interval);
+
+/*
+ * Reject peers (with UVTLS_EREVOKED) whose certificate, or a certificate of
+ * the chain they sent, is revoked by one of the PEM encoded CRLs. Checked
+ * when verifying peer certificates (UVTLS_VERIFY_PEER_CERT). Revoked serial
+ * numbers are kept in a sorted index, so a check is a binary search. The CRLs
+ * are trusted as given: their signatures and update times aren't checked.
+ * They're replaced atomically and may be set from any thread. A `length` of
+ * zero disables the check.
+ */
+int uvtls_context_set_crl(uvtls_context_t* context,
+                          const char* crl,
+                          size_t length);
+
+/*
+ * Like uvtls_context_set_crl(), but the index is mapped into memory from a
+ * file compiled by uvtls_crl_compile(). The file is watched and reloaded like
+ * uvtls_context_set_ocsp_response_file(); replace it by renaming a new file
+ * over it.
+ */
+int uvtls_context_set_crl_file(uvtls_context_t* context,
+                               uv_loop_t* loop,
+                               const char* path,
+                               unsigned int interval);
+
+/*
+ * Compile PEM encoded CRLs into an index file. An existing file is replaced
+ * atomically.
+ */
+int uvtls_crl_compile(const char* crl, size_t length, const char* path);
+
+/*
+ * Use `sni_context` (its certificate, key and OCSP response) for server
+ * handshakes that request `hostname` using SNI. The hostname may start with
+ * a wildcard label ("*.example.com"), which is tried after exact matches.
+ * Hostnames are kept in a hash index and any number of them can share a
+ * context. Add hostnames before starting handshakes with `context`.
+ */
+int uvtls_context_add_sni(uvtls_context_t* context,
+                          const char* hostname,
+                          size_t length,
+                          uvtls_context_t* sni_context);
+
+/*
+ * Connections initialized with a loop (uvtls_init_ex()) allocate their
+ * session state and ring buffer blocks from per-loop slabs. Memory released
+ * by closed connections is reused by new ones instead of going back to the
+ * allocator, and it's freed when the loop is closed.
+ */
+int uvtls_loop_init(uvtls_loop_t* tls_loop, uv_loop_t* loop);
+void uvtls_loop_close(uvtls_loop_t* tls_loop, uvtls_loop_close_cb cb);
+
+/*
+ * Limit the number of server handshakes (uvtls_accept()) running
+ * concurrently on the loop. Connections accepted beyond the limit wait in a
+ * FIFO queue and are started as running handshakes finish. A connection that
+ * waits longer than `queue_timeout` (in milliseconds) is shed: its accept
+ * callback is called with UVTLS_EQUEUETIMEOUT. A `max_handshakes` of zero
+ * disables the limit and a `queue_timeout` of zero waits indefinitely.
+ */
+void uvtls_loop_set_handshake_limit(uvtls_loop_t* tls_loop,
+                                    unsigned int max_handshakes,
+                                    uint64_t queue_timeout);
+
+/*
+ * Fail handshakes (both uvtls_connect() and uvtls_accept()) of connections
+ * on the loop that don't complete within `timeout` milliseconds. The
+ * handshake callback is called with UV_ETIMEDOUT. The deadlines of all the
+ * loop's connections are tracked by a single timer wheel. A `timeout` of zero
+ * disables the deadline.
+ */
+void uvtls_loop_set_handshake_timeout(uvtls_loop_t* tls_loop,
+                                      uint64_t timeout);
+
+void uvtls_loop_get_handshake_stats(const uvtls_loop_t* tls_loop,
+                                    uvtls_handshake_stats_t* stats);
+
+/*
+ * A server accepts connections on `loop` and hands each one off to one of
+ * `workers_count` worker threads (round-robin), each running its own loop
+ * and uvtls_loop_t, so that handshakes and encryption scale across cores.
+ * The workers share `context`. Worker loops can be configured (e.g. with
+ * uvtls_loop_set_handshake_limit()) until uvtls_server_listen() is called.
+ * Requires libuv 1.41 or later.
+ */
+int uvtls_server_init(uvtls_server_t* server,
+                      uv_loop_t* loop,
+                      uvtls_context_t* context,
+                      unsigned int workers_count);
+
+/*
+ * Bind, listen and start the worker threads. `cb` is called on a worker's
+ * thread for each connection handed to it, which must then be accepted using
+ * uvtls_worker_accept().
+ * `stop_cb` is called on each worker's thread when the server is closed and
+ * must close the worker's remaining connections. The server must be closed
+ * even if this fails.
+ */
+int uvtls_server_listen(uvtls_server_t* server,
+                        const struct sockaddr* addr,
+                        int backlog,
+                        uvtls_worker_connection_cb cb,
+                        uvtls_worker_stop_cb stop_cb);
+
+/*
+ * Accept a connection handed to a worker into `client`, which must be
+ * initialized on the worker's loop, and initialize `tls` for it with the
+ * server's context and the worker's uvtls_loop_t. `client` must be closed if
+ * this fails.
+ */
+int uvtls_worker_accept(uvtls_worker_t* worker,
+                        uvtls_t* tls,
+                        uv_stream_t* client);
+
+/*
+ * Stop accepting connections and stop the workers. `cb` is called on the
+ * server's loop once the workers have exited.
+ */
+void uvtls_server_close(uvtls_server_t* server, uvtls_server_close_cb cb);
+
 int uvtls_init(uvtls_t* tls, uvtls_context_t* context, uv_stream_t* stream);
+int uvtls_init_ex(uvtls_t* tls,
+                  uvtls_context_t* context,
+                  uv_stream_t* stream,
+                  uvtls_loop_t* tls_loop);
 
+/*
+ * Set the hostname sent using SNI and used to verify the server's identity
+ * (UVTLS_VERIFY_PEER_IDENT). A lowercase copy of the hostname is allocated,
+ * so connections that don't set one (e.g. server connections) don't pay for
+ * it.
+ */
 int uvtls_set_hostname(uvtls_t* tls, const char* hostname, size_t length);
 
 int uvtls_connect(uvtls_t* tls, uvtls_connect_cb cb);
 
+/*
+ * The memory held by a connection's ring buffers, which is zero while it's
+ * hibernating (see UVTLS_CONTEXT_HIBERNATE). Memory held by the TLS library
+ * isn't included.
+ */
+size_t uvtls_get_memory_usage(const uvtls_t* tls);
+
+/*
+ * The memory held by the ring buffers of all connections (of all loops),
+ * plus the ring buffer blocks and connections freed but cached by loops for
+ * reuse (until uvtls_loop_close()).
+ */
+size_t uvtls_get_total_memory_usage(void);
+
+/*
+ * Counters kept for a connection, e.g. to find slow peers. They're always
+ * on and cost a few additions per read, write and record.
+ */
+void uvtls_get_stats(const uvtls_t* tls, uvtls_stats_t* stats);
+
+/*
+ * The TLS library error of the connection's last failed handshake or read,
+ * e.g. the reason of a UVTLS_EHANDSHAKE. The code is zero if there was none.
+ */
+void uvtls_get_error(const uvtls_t* tls, uvtls_error_t* error);
+
+/* Format a code from uvtls_error_t, which is slow, e.g. for logging */
+char* uvtls_error_string(unsigned long code, char* buf, size_t buflen);
+
+/*
+ * Counters for all connections of the process. Each thread updates its own
+ * counters without atomics or locks; they're summed here.
+ */
+void uvtls_get_metrics(uvtls_metrics_t* metrics);
+
+/*
+ * The error counted in a slot of handshakes_failed. Errors without a slot of
+ * their own are counted as UVTLS_UNKNOWN (slot 0).
+ */
+int uvtls_metrics_error(int slot);
+
 int uvtls_is_closing(uvtls_t* tls);
 void uvtls_close(uvtls_t* tls, uvtls_close_cb cb);
 
@@ -158,12 +689,28 @@ int uvtls_read_start(uvtls_t* tls,
                      uvtls_read_cb read_cb);
 int uvtls_read_stop(uvtls_t* tls);
 
+/*
+ * Writes issued before the handshake completes (e.g. right after
+ * uvtls_connect()) are queued until it does. When this side sends the final
+ * handshake flight (a client's Finished on TLS 1.3 or a resumed TLS 1.2
+ * handshake) they're sent in the same write as it, otherwise in their own
+ * write after it. They fail with the handshake's error if it fails.
+ */
 int uvtls_write(uvtls_write_t* req,
                 uvtls_t* tls,
                 const uv_buf_t bufs[],
                 unsigned int nbufs,
                 uvtls_write_cb cb);
 
+/*
+ * Encrypt writes of at least `min_size` bytes on the libuv threadpool instead
+ * of the loop's thread, so that large writes don't delay other connections on
+ * the loop. Writes are still sent in order. While a write is being encrypted,
+ * the connection's reads, later writes and uvtls_close() are deferred until
+ * it's done. A `min_size` of zero (the default) disables offloading.
+ */
+void uvtls_set_write_offload(uvtls_t* tls, size_t min_size);
+
 const char* uvtls_err_name(int err);
 #if UV_VERSION_HEX >= 0x011600 /* 1.22.0 */
 char* uvtls_err_name_r(int error, char* buf, size_t buflen);
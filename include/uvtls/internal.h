@@ -22,11 +22,18 @@
 #ifndef UVTLS_INTERNAL_H
 #define UVTLS_INTERNAL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define UVTLS_RING_BUF_BLOCK_SIZE (16 * 1014 + 5)
+#define UVTLS_TIMER_WHEEL_SLOTS 64
 
 typedef struct uvtls_ring_buf_s uvtls_ring_buf_t;
 typedef struct uvtls_ring_buf_block_s uvtls_ring_buf_block_t;
 typedef struct uvtls_ring_buf_pos_s uvtls_ring_buf_pos_t;
+typedef struct uvtls_slab_s uvtls_slab_t;
+typedef struct uvtls_timer_wheel_s uvtls_timer_wheel_t;
+typedef struct uvtls_timer_wheel_entry_s uvtls_timer_wheel_entry_t;
 
 struct uvtls_ring_buf_pos_s {
   int index;
@@ -37,7 +44,9 @@ struct uvtls_ring_buf_s {
   uvtls_ring_buf_pos_t tail;
   uvtls_ring_buf_pos_t head;
   uvtls_ring_buf_block_t* empty_blocks;
+  uvtls_slab_t* slab;
   int size;
+  int blocks_count;
   long ret;
 };
 
@@ -46,4 +55,23 @@ struct uvtls_ring_buf_block_s {
   uvtls_ring_buf_block_t* next;
 };
 
+struct uvtls_slab_s {
+  void* free_list;
+  size_t size;
+  unsigned int count;
+  unsigned int max_count;
+};
+
+struct uvtls_timer_wheel_entry_s {
+  void* queue[2];
+  uint64_t deadline;
+};
+
+struct uvtls_timer_wheel_s {
+  void* slots[UVTLS_TIMER_WHEEL_SLOTS][2];
+  uint64_t resolution;
+  uint64_t tick;
+  unsigned int count;
+};
+
 #endif /* UVTLS_INTERNAL_H */
@@ -0,0 +1,59 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef UVTLS_ATOMIC_H
+#define UVTLS_ATOMIC_H
+
+/* Sequentially consistent atomic operations on pointers and longs. The
+ * relaxed load and store only keep a single writer's value from tearing, they
+ * compile to plain moves. */
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+
+#define uvtls_atomic_load_ptr(ptr) \
+  _InterlockedCompareExchangePointer((void* volatile*) (ptr), NULL, NULL)
+#define uvtls_atomic_exchange_ptr(ptr, value) \
+  _InterlockedExchangePointer((void* volatile*) (ptr), (value))
+#define uvtls_atomic_load(ptr) _InterlockedCompareExchange((ptr), 0, 0)
+#define uvtls_atomic_store(ptr, value) \
+  ((void) _InterlockedExchange((ptr), (value)))
+#define uvtls_atomic_add(ptr, value) \
+  (_InterlockedExchangeAdd((ptr), (value)) + (value))
+#define uvtls_atomic_load_relaxed(ptr) (*(ptr))
+#define uvtls_atomic_store_relaxed(ptr, value) (*(ptr) = (value))
+#elif defined(__GNUC__)
+#define uvtls_atomic_load_ptr(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define uvtls_atomic_exchange_ptr(ptr, value) \
+  __atomic_exchange_n((ptr), (value), __ATOMIC_SEQ_CST)
+#define uvtls_atomic_load(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define uvtls_atomic_store(ptr, value) \
+  __atomic_store_n((ptr), (value), __ATOMIC_SEQ_CST)
+#define uvtls_atomic_add(ptr, value) \
+  __atomic_add_fetch((ptr), (value), __ATOMIC_SEQ_CST)
+#define uvtls_atomic_load_relaxed(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define uvtls_atomic_store_relaxed(ptr, value) \
+  __atomic_store_n((ptr), (value), __ATOMIC_RELAXED)
+#else
+#error "Atomic operations are not supported for this compiler"
+#endif
+
+#endif /* UVTLS_ATOMIC_H */
@@ -0,0 +1,323 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "crl-index.h"
+
+#include "uvtls-common.h"
+
+#include <uvtls.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* A saved index is a header followed by the sorted entries. The count is
+ * stored big-endian. */
+#define UVTLS_CRL_INDEX_MAGIC "UVTLSCRL"
+#define UVTLS_CRL_INDEX_VERSION 1
+#define UVTLS_CRL_INDEX_HEADER_SIZE 16
+
+/* Entries are saved as is, so they shouldn't have padding */
+typedef char uvtls_crl_entry_size_check_t
+    [sizeof(uvtls_crl_entry_t) ==
+             UVTLS_CRL_ISSUER_SIZE + 1 + UVTLS_CRL_MAX_SERIAL_SIZE
+         ? 1
+         : -1];
+
+static int entry_compare(const void* a, const void* b) {
+  return memcmp(a, b, sizeof(uvtls_crl_entry_t));
+}
+
+static void write_u32(unsigned char* p, unsigned long value) {
+  p[0] = (unsigned char) (value >> 24);
+  p[1] = (unsigned char) (value >> 16);
+  p[2] = (unsigned char) (value >> 8);
+  p[3] = (unsigned char) value;
+}
+
+static unsigned long read_u32(const unsigned char* p) {
+  return ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16) |
+         ((unsigned long) p[2] << 8) | (unsigned long) p[3];
+}
+
+/* Lookups require the entries to be sorted without duplicates */
+static int entries_are_sorted(const uvtls_crl_entry_t* entries, size_t count) {
+  size_t i;
+  for (i = 1; i < count; ++i) {
+    if (entry_compare(&entries[i - 1], &entries[i]) >= 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int uvtls_crl_entry_init(uvtls_crl_entry_t* entry,
+                         const unsigned char* issuer,
+                         const unsigned char* serial,
+                         size_t serial_length) {
+  if (serial_length > UVTLS_CRL_MAX_SERIAL_SIZE) {
+    return UVTLS_EINVAL; /* RFC 5280 limits serial numbers to 20 bytes */
+  }
+  memset(entry, 0, sizeof(*entry));
+  memcpy(entry->issuer, issuer, UVTLS_CRL_ISSUER_SIZE);
+  entry->serial_length = (unsigned char) serial_length;
+  memcpy(entry->serial, serial, serial_length);
+  return 0;
+}
+
+uvtls_crl_index_t* uvtls_crl_index_create(uvtls_crl_entry_t* entries,
+                                          size_t count) {
+  size_t i, unique = 0;
+  uvtls_crl_index_t* index =
+      (uvtls_crl_index_t*) uvtls__malloc(sizeof(uvtls_crl_index_t));
+  if (!index) {
+    uvtls__free(entries);
+    return NULL;
+  }
+
+  if (count > 0) {
+    qsort(entries, count, sizeof(uvtls_crl_entry_t), entry_compare);
+  }
+  for (i = 0; i < count; ++i) {
+    if (unique == 0 || entry_compare(&entries[unique - 1], &entries[i]) != 0) {
+      entries[unique++] = entries[i];
+    }
+  }
+
+  index->entries = entries;
+  index->count = unique;
+  index->data = entries;
+  index->length = count * sizeof(uvtls_crl_entry_t);
+  index->is_mapped = 0;
+  return index;
+}
+
+/* Validate a saved index and point at its entries */
+static int index_parse(uvtls_crl_index_t* index,
+                       const unsigned char* data,
+                       size_t length) {
+  size_t count, size;
+
+  if (length < UVTLS_CRL_INDEX_HEADER_SIZE ||
+      memcmp(data, UVTLS_CRL_INDEX_MAGIC, 8) != 0 ||
+      read_u32(data + 8) != UVTLS_CRL_INDEX_VERSION) {
+    return UVTLS_EINVAL;
+  }
+
+  count = read_u32(data + 12);
+  size = length - UVTLS_CRL_INDEX_HEADER_SIZE;
+  if (size % sizeof(uvtls_crl_entry_t) != 0 ||
+      size / sizeof(uvtls_crl_entry_t) != count) {
+    return UVTLS_EINVAL;
+  }
+
+  index->entries =
+      (const uvtls_crl_entry_t*) (data + UVTLS_CRL_INDEX_HEADER_SIZE);
+  index->count = count;
+
+#ifndef NDEBUG
+  /* The order is checked when the index is saved. Checking it here would
+   * touch every page of a mapped index. */
+  if (!entries_are_sorted(index->entries, count)) {
+    return UVTLS_EINVAL;
+  }
+#endif
+  return 0;
+}
+
+#ifndef _WIN32
+int uvtls_crl_index_load(const char* path, uvtls_crl_index_t** index) {
+  int rc;
+  int fd;
+  struct stat st;
+  void* data;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return uv_translate_sys_error(errno);
+  }
+
+  if (fstat(fd, &st) != 0) {
+    rc = uv_translate_sys_error(errno);
+    close(fd);
+    return rc;
+  }
+
+  if (st.st_size < UVTLS_CRL_INDEX_HEADER_SIZE) {
+    close(fd);
+    return UVTLS_EINVAL;
+  }
+
+  data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  rc = data == MAP_FAILED ? uv_translate_sys_error(errno) : 0;
+  close(fd);
+  if (rc != 0) {
+    return rc;
+  }
+
+  *index = (uvtls_crl_index_t*) uvtls__malloc(sizeof(uvtls_crl_index_t));
+  if (!*index) {
+    munmap(data, (size_t) st.st_size);
+    return UV_ENOMEM;
+  }
+  (*index)->data = data;
+  (*index)->length = (size_t) st.st_size;
+  (*index)->is_mapped = 1;
+
+  rc = index_parse(*index, (const unsigned char*) data, (size_t) st.st_size);
+  if (rc != 0) {
+    uvtls_crl_index_free(*index);
+    *index = NULL;
+  }
+  return rc;
+}
+#else
+int uvtls_crl_index_load(const char* path, uvtls_crl_index_t** index) {
+  int rc;
+  long length;
+  void* data;
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return uv_translate_sys_error(errno);
+  }
+
+  if (fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) < 0 ||
+      fseek(file, 0, SEEK_SET) != 0) {
+    fclose(file);
+    return UVTLS_EINVAL;
+  }
+
+  data = uvtls__malloc(length > 0 ? (size_t) length : 1);
+  *index = (uvtls_crl_index_t*) uvtls__malloc(sizeof(uvtls_crl_index_t));
+  if (!data || !*index) {
+    uvtls__free(data);
+    uvtls__free(*index);
+    fclose(file);
+    return UV_ENOMEM;
+  }
+  (*index)->data = data;
+  (*index)->length = (size_t) length;
+  (*index)->is_mapped = 0;
+
+  if (fread(data, 1, (size_t) length, file) != (size_t) length) {
+    rc = UVTLS_EINVAL;
+  } else {
+    rc = index_parse(*index, (const unsigned char*) data, (size_t) length);
+  }
+  fclose(file);
+  if (rc != 0) {
+    uvtls_crl_index_free(*index);
+    *index = NULL;
+  }
+  return rc;
+}
+#endif
+
+int uvtls_crl_index_save(const uvtls_crl_index_t* index, const char* path) {
+  unsigned char header[UVTLS_CRL_INDEX_HEADER_SIZE];
+  size_t length = strlen(path);
+  char* tmp_path;
+  FILE* file;
+  int rc = 0;
+
+  if (index->count > 0xFFFFFFFFUL ||
+      !entries_are_sorted(index->entries, index->count)) {
+    return UVTLS_EINVAL;
+  }
+
+  memcpy(header, UVTLS_CRL_INDEX_MAGIC, 8);
+  write_u32(header + 8, UVTLS_CRL_INDEX_VERSION);
+  write_u32(header + 12, (unsigned long) index->count);
+
+  /* Written beside the index and renamed over it, so that a loaded (mapped)
+   * index is never modified */
+  tmp_path = (char*) uvtls__malloc(length + sizeof(".tmp"));
+  if (!tmp_path) {
+    return UV_ENOMEM;
+  }
+  memcpy(tmp_path, path, length);
+  memcpy(tmp_path + length, ".tmp", sizeof(".tmp"));
+
+  file = fopen(tmp_path, "wb");
+  if (!file) {
+    rc = uv_translate_sys_error(errno);
+    uvtls__free(tmp_path);
+    return rc;
+  }
+
+  if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+      (index->count > 0 && fwrite(index->entries,
+                                  sizeof(uvtls_crl_entry_t),
+                                  index->count,
+                                  file) != index->count)) {
+    rc = UV_EIO;
+  }
+  if (fclose(file) != 0 && rc == 0) {
+    rc = UV_EIO;
+  }
+
+  if (rc == 0 && rename(tmp_path, path) != 0) {
+    rc = uv_translate_sys_error(errno);
+  }
+  if (rc != 0) {
+    remove(tmp_path);
+  }
+
+  uvtls__free(tmp_path);
+  return rc;
+}
+
+void uvtls_crl_index_free(void* data) {
+  uvtls_crl_index_t* index = (uvtls_crl_index_t*) data;
+  if (!index) {
+    return;
+  }
+#ifndef _WIN32
+  if (index->is_mapped) {
+    munmap(index->data, index->length);
+  } else {
+    uvtls__free(index->data);
+  }
+#else
+  uvtls__free(index->data);
+#endif
+  uvtls__free(index);
+}
+
+int uvtls_crl_index_contains(const uvtls_crl_index_t* index,
+                             const uvtls_crl_entry_t* entry) {
+  if (index->count == 0) {
+    return 0;
+  }
+  return bsearch(entry,
+                 index->entries,
+                 index->count,
+                 sizeof(uvtls_crl_entry_t),
+                 entry_compare) != NULL;
+}
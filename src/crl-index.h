@@ -0,0 +1,77 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef UVTLS_CRL_INDEX_H
+#define UVTLS_CRL_INDEX_H
+
+#include <stddef.h>
+
+#define UVTLS_CRL_ISSUER_SIZE 8
+#define UVTLS_CRL_MAX_SERIAL_SIZE 23
+
+/*
+ * A sorted array of revoked certificates, identified by a digest of their
+ * issuer's name and their serial number, that's searched with a binary
+ * search. An index can be saved to a file and loaded by mapping the file into
+ * memory, so that large revocation lists don't need to be parsed (or copied)
+ * at startup. A saved index is replaced by renaming a new file over it.
+ */
+
+typedef struct uvtls_crl_entry_s uvtls_crl_entry_t;
+typedef struct uvtls_crl_index_s uvtls_crl_index_t;
+
+/* Entries are compared as bytes, unused bytes are zero */
+struct uvtls_crl_entry_s {
+  unsigned char issuer[UVTLS_CRL_ISSUER_SIZE];
+  unsigned char serial_length;
+  unsigned char serial[UVTLS_CRL_MAX_SERIAL_SIZE];
+};
+
+struct uvtls_crl_index_s {
+  const uvtls_crl_entry_t* entries;
+  size_t count;
+  void* data; /* The allocated or mapped memory of the entries */
+  size_t length;
+  int is_mapped;
+};
+
+int uvtls_crl_entry_init(uvtls_crl_entry_t* entry,
+                         const unsigned char* issuer,
+                         const unsigned char* serial,
+                         size_t serial_length);
+
+/*
+ * Create an index that takes ownership of `entries` (allocated with
+ * uvtls__malloc()). Returns NULL if out of memory, `entries` are freed.
+ */
+uvtls_crl_index_t* uvtls_crl_index_create(uvtls_crl_entry_t* entries,
+                                          size_t count);
+
+int uvtls_crl_index_load(const char* path, uvtls_crl_index_t** index);
+
+int uvtls_crl_index_save(const uvtls_crl_index_t* index, const char* path);
+
+void uvtls_crl_index_free(void* index);
+
+int uvtls_crl_index_contains(const uvtls_crl_index_t* index,
+                             const uvtls_crl_entry_t* entry);
+
+#endif /* UVTLS_CRL_INDEX_H */
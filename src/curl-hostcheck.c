@@ -24,124 +24,59 @@
 
 #include "curl-hostcheck.h"
 
-#include <stdlib.h>
 #include <string.h>
 #include <uv.h>
 
-/* Portable, consistent toupper (remember EBCDIC). Do not use toupper() because
-   its behavior is altered by the current locale. */
-char Curl_raw_toupper(char in)
+/* Portable, consistent tolower. Do not use tolower() because its behavior is
+   altered by the current locale. */
+char Curl_raw_tolower(char in)
 {
-#if !defined(CURL_DOES_CONVERSIONS)
-  if(in >= 'a' && in <= 'z')
-    return (char)('A' + in - 'a');
-#else
-  switch(in) {
-  case 'a':
-    return 'A';
-  case 'b':
-    return 'B';
-  case 'c':
-    return 'C';
-  case 'd':
-    return 'D';
-  case 'e':
-    return 'E';
-  case 'f':
-    return 'F';
-  case 'g':
-    return 'G';
-  case 'h':
-    return 'H';
-  case 'i':
-    return 'I';
-  case 'j':
-    return 'J';
-  case 'k':
-    return 'K';
-  case 'l':
-    return 'L';
-  case 'm':
-    return 'M';
-  case 'n':
-    return 'N';
-  case 'o':
-    return 'O';
-  case 'p':
-    return 'P';
-  case 'q':
-    return 'Q';
-  case 'r':
-    return 'R';
-  case 's':
-    return 'S';
-  case 't':
-    return 'T';
-  case 'u':
-    return 'U';
-  case 'v':
-    return 'V';
-  case 'w':
-    return 'W';
-  case 'x':
-    return 'X';
-  case 'y':
-    return 'Y';
-  case 'z':
-    return 'Z';
-  }
-#endif
-
+  if(in >= 'A' && in <= 'Z')
+    return (char)('a' + in - 'A');
   return in;
 }
 
 /*
- * Curl_strcasecompare() is for doing "raw" case insensitive strings. This is
- * meant to be locale independent and only compare strings we know are safe
- * for this.  See
- * https://daniel.haxx.se/blog/2008/10/15/strcasecmp-in-turkish/ for some
- * further explanation to why this function is necessary.
- *
- * The function is capable of comparing a-z case insensitively even for
- * non-ascii.
- *
- * @unittest: 1301
+ * Compare `len` characters of a pattern case insensitively with a hostname
+ * that is already lowercase. Only a-z are compared case insensitively, even
+ * for non-ascii.
  */
-
-int Curl_strcasecompare(const char *first, const char *second)
+static int lowercompare(const char *pattern, const char *hostname, size_t len)
 {
-  while(*first && *second) {
-    if(Curl_raw_toupper(*first) != Curl_raw_toupper(*second))
-      /* get out of the loop as soon as they don't match */
-      break;
-    first++;
-    second++;
+  size_t i;
+  for(i = 0; i < len; i++) {
+    if(Curl_raw_tolower(pattern[i]) != hostname[i])
+      return 0;
   }
-  /* we do the comparison here (possibly again), just to make sure that if the
-     loop above is skipped because one of the strings reached zero, we must not
-     return this as a successful match */
-  return (Curl_raw_toupper(*first) == Curl_raw_toupper(*second));
+  return 1;
 }
 
-int Curl_strncasecompare(const char *first, const char *second, size_t max)
+static int lowercompare_len(const char *pattern, size_t patternlen,
+                            const char *hostname, size_t hostlen)
 {
-  while(*first && *second && max) {
-    if(Curl_raw_toupper(*first) != Curl_raw_toupper(*second)) {
-      break;
-    }
-    max--;
-    first++;
-    second++;
+  return patternlen == hostlen && lowercompare(pattern, hostname, hostlen);
+}
+
+int Curl_host_is_ip(const char *hostname)
+{
+  struct sockaddr_in si;
+  struct sockaddr_in6 si6;
+  char copy[64]; /* Longer than any address */
+  size_t len = strlen(hostname);
+
+  /* ignore a trailing dot, as hostmatch() does */
+  if(len > 0 && hostname[len-1] == '.') {
+    if(len > sizeof(copy))
+      return 0;
+    memcpy(copy, hostname, len - 1);
+    copy[len - 1] = '\0';
+    hostname = copy;
   }
-  if(0 == max)
-    return 1; /* they are equal this far */
 
-  return Curl_raw_toupper(*first) == Curl_raw_toupper(*second);
+  return uv_inet_pton(AF_INET, hostname, &si.sin_addr) == 0 ||
+    uv_inet_pton(AF_INET6, hostname, &si6.sin6_addr) == 0;
 }
 
-#define strcasecompare(a,b) Curl_strcasecompare(a,b)
-#define strncasecompare(a,b,c) Curl_strncasecompare(a,b,c)
-
 /*
  * Match a hostname against a wildcard pattern.
  * E.g.
@@ -158,54 +93,51 @@ int Curl_strncasecompare(const char *first, const char *second, size_t max)
  * apparent distinction between a name and an IP. We need to detect the use of
  * an IP address and not wildcard match on such names.
  *
- * NOTE: hostmatch() gets called with copied buffers so that it can modify the
- * contents at will.
+ * NOTE: hostmatch() works on the buffers in place using their lengths, so that
+ * it doesn't need to copy (or allocate) them.
  */
 
-static int hostmatch(char *hostname, char *pattern)
+static int hostmatch(const char *hostname, size_t hostlen, int host_is_ip,
+                     const char *pattern, size_t patternlen)
 {
   const char *pattern_label_end, *pattern_wildcard, *hostname_label_end;
-  int wildcard_enabled;
+  const char *pattern_end, *hostname_end;
   size_t prefixlen, suffixlen;
-  struct sockaddr_in si;
-  struct sockaddr_in6 si6;
 
-  /* normalize pattern and hostname by stripping off trailing dots */
-  size_t len = strlen(hostname);
-  if(hostname[len-1]=='.')
-    hostname[len-1] = 0;
-  len = strlen(pattern);
-  if(pattern[len-1]=='.')
-    pattern[len-1] = 0;
+  /* normalize pattern and hostname by ignoring trailing dots */
+  if(hostname[hostlen-1]=='.')
+    hostlen--;
+  if(pattern[patternlen-1]=='.')
+    patternlen--;
+  hostname_end = hostname + hostlen;
+  pattern_end = pattern + patternlen;
 
-  pattern_wildcard = strchr(pattern, '*');
+  pattern_wildcard = memchr(pattern, '*', patternlen);
   if(pattern_wildcard == NULL)
-    return strcasecompare(pattern, hostname) ?
+    return lowercompare_len(pattern, patternlen, hostname, hostlen) ?
       CURL_HOST_MATCH : CURL_HOST_NOMATCH;
 
   /* detect IP address as hostname and fail the match if so */
-  if(uv_inet_pton(AF_INET, hostname, &si.sin_addr) > 0)
-    return CURL_HOST_NOMATCH;
-
-  if(uv_inet_pton(AF_INET6, hostname, &si6.sin6_addr) > 0)
+  if(host_is_ip)
     return CURL_HOST_NOMATCH;
 
   /* We require at least 2 dots in pattern to avoid too wide wildcard
      match. */
-  wildcard_enabled = 1;
-  pattern_label_end = strchr(pattern, '.');
-  if(pattern_label_end == NULL || strchr(pattern_label_end + 1, '.') == NULL ||
+  pattern_label_end = memchr(pattern, '.', patternlen);
+  if(pattern_label_end == NULL ||
+     memchr(pattern_label_end + 1, '.',
+            (size_t)(pattern_end - (pattern_label_end + 1))) == NULL ||
      pattern_wildcard > pattern_label_end ||
-     strncasecompare(pattern, "xn--", 4)) {
-    wildcard_enabled = 0;
-  }
-  if(!wildcard_enabled)
-    return strcasecompare(pattern, hostname) ?
+     (patternlen >= 4 && lowercompare(pattern, "xn--", 4)))
+    return lowercompare_len(pattern, patternlen, hostname, hostlen) ?
       CURL_HOST_MATCH : CURL_HOST_NOMATCH;
 
-  hostname_label_end = strchr(hostname, '.');
+  hostname_label_end = memchr(hostname, '.', hostlen);
   if(hostname_label_end == NULL ||
-     !strcasecompare(pattern_label_end, hostname_label_end))
+     !lowercompare_len(pattern_label_end,
+                       (size_t)(pattern_end - pattern_label_end),
+                       hostname_label_end,
+                       (size_t)(hostname_end - hostname_label_end)))
     return CURL_HOST_NOMATCH;
 
   /* The wildcard must match at least one character, so the left-most
@@ -214,32 +146,22 @@ static int hostmatch(char *hostname, char *pattern)
   if(hostname_label_end - hostname < pattern_label_end - pattern)
     return CURL_HOST_NOMATCH;
 
-  prefixlen = pattern_wildcard - pattern;
-  suffixlen = pattern_label_end - (pattern_wildcard + 1);
-  return strncasecompare(pattern, hostname, prefixlen) &&
-    strncasecompare(pattern_wildcard + 1, hostname_label_end - suffixlen,
-                    suffixlen) ?
+  prefixlen = (size_t)(pattern_wildcard - pattern);
+  suffixlen = (size_t)(pattern_label_end - (pattern_wildcard + 1));
+  return lowercompare(pattern, hostname, prefixlen) &&
+    lowercompare(pattern_wildcard + 1, hostname_label_end - suffixlen,
+                 suffixlen) ?
     CURL_HOST_MATCH : CURL_HOST_NOMATCH;
 }
 
-int Curl_cert_hostcheck(const char *match_pattern, const char *hostname)
+int Curl_cert_hostcheck(const char *match_pattern, size_t pattern_len,
+                        const char *hostname, size_t hostname_len,
+                        int hostname_is_ip)
 {
-  int res = 0;
-  if(!match_pattern || !*match_pattern ||
-      !hostname || !*hostname) /* sanity check */
-    ;
-  else {
-    char *matchp = strdup(match_pattern);
-    if(matchp) {
-      char *hostp = strdup(hostname);
-      if(hostp) {
-        if(hostmatch(hostp, matchp) == CURL_HOST_MATCH)
-          res = 1;
-        free(hostp);
-      }
-      free(matchp);
-    }
-  }
+  if(!match_pattern || !pattern_len ||
+     !hostname || !hostname_len) /* sanity check */
+    return 0;
 
-  return res;
+  return hostmatch(hostname, hostname_len, hostname_is_ip,
+                   match_pattern, pattern_len) == CURL_HOST_MATCH;
 }
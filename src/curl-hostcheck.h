@@ -24,8 +24,21 @@
 
 /* clang-format off */
 
+#include <stddef.h>
+
 #define CURL_HOST_NOMATCH 0
 #define CURL_HOST_MATCH   1
-int Curl_cert_hostcheck(const char *match_pattern, const char *hostname);
+
+char Curl_raw_tolower(char in);
+
+/* Returns non-zero if the (NUL terminated) hostname is an IPv4 or IPv6
+   address, ignoring a trailing dot, which are never matched by wildcards */
+int Curl_host_is_ip(const char *hostname);
+
+/* Match a pattern against a lowercase hostname. Neither needs to be NUL
+   terminated and nothing is allocated. */
+int Curl_cert_hostcheck(const char *match_pattern, size_t pattern_len,
+                        const char *hostname, size_t hostname_len,
+                        int hostname_is_ip);
 
 #endif /* HEADER_CURL_HOSTCHECK_H */
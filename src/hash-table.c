@@ -0,0 +1,205 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "hash-table.h"
+
+#include "uvtls-common.h"
+
+#include <uv.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY 16
+
+/* FNV-1a */
+static size_t hash_key(const char* key, size_t length) {
+  size_t i;
+  unsigned int hash = 2166136261U;
+  for (i = 0; i < length; ++i) {
+    hash ^= (unsigned char) key[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+static uvtls_hash_table_entry_t* find_entry(uvtls_hash_table_entry_t* entries,
+                                            size_t capacity,
+                                            size_t hash,
+                                            const char* key,
+                                            size_t length) {
+  size_t mask = capacity - 1;
+  size_t i = hash & mask;
+  while (entries[i].key) {
+    uvtls_hash_table_entry_t* entry = &entries[i];
+    if (entry->hash == hash && entry->length == length &&
+        memcmp(entry->key, key, length) == 0) {
+      return entry;
+    }
+    i = (i + 1) & mask;
+  }
+  return &entries[i];
+}
+
+static int grow(uvtls_hash_table_t* table) {
+  size_t i;
+  size_t capacity = table->capacity > 0 ? 2 * table->capacity
+                                        : INITIAL_CAPACITY;
+  uvtls_hash_table_entry_t* entries =
+      (uvtls_hash_table_entry_t*) uvtls__calloc(
+          capacity, sizeof(uvtls_hash_table_entry_t));
+  if (!entries) {
+    return UV_ENOMEM;
+  }
+
+  for (i = 0; i < table->capacity; ++i) {
+    uvtls_hash_table_entry_t* entry = &table->entries[i];
+    if (entry->key) {
+      *find_entry(entries, capacity, entry->hash, entry->key, entry->length) =
+          *entry;
+    }
+  }
+
+  uvtls__free(table->entries);
+  table->entries = entries;
+  table->capacity = capacity;
+  return 0;
+}
+
+void uvtls_hash_table_init(uvtls_hash_table_t* table) {
+  table->entries = NULL;
+  table->capacity = 0;
+  table->count = 0;
+}
+
+void uvtls_hash_table_destroy(uvtls_hash_table_t* table,
+                              uvtls_hash_table_free_cb free_cb) {
+  size_t i;
+  for (i = 0; i < table->capacity; ++i) {
+    uvtls_hash_table_entry_t* entry = &table->entries[i];
+    if (entry->key) {
+      if (free_cb) {
+        free_cb(entry->value);
+      }
+      uvtls__free(entry->key);
+    }
+  }
+  uvtls__free(table->entries);
+}
+
+size_t uvtls_hash_table_count(const uvtls_hash_table_t* table) {
+  return table->count;
+}
+
+int uvtls_hash_table_set(uvtls_hash_table_t* table,
+                         const char* key,
+                         size_t length,
+                         void* value,
+                         void** previous) {
+  size_t hash = hash_key(key, length);
+  uvtls_hash_table_entry_t* entry;
+
+  if (2 * (table->count + 1) > table->capacity) {
+    int rc = grow(table);
+    if (rc != 0) {
+      return rc;
+    }
+  }
+
+  entry = find_entry(table->entries, table->capacity, hash, key, length);
+  if (entry->key) {
+    *previous = entry->value;
+    entry->value = value;
+    return 0;
+  }
+
+  /* Allocate at least one byte so that empty keys mark the entry used */
+  entry->key = (char*) uvtls__malloc(length > 0 ? length : 1);
+  if (!entry->key) {
+    return UV_ENOMEM;
+  }
+  memcpy(entry->key, key, length);
+  entry->hash = hash;
+  entry->length = length;
+  entry->value = value;
+  table->count++;
+
+  *previous = NULL;
+  return 0;
+}
+
+void* uvtls_hash_table_get(const uvtls_hash_table_t* table,
+                           const char* key,
+                           size_t length) {
+  uvtls_hash_table_entry_t* entry;
+  if (table->count == 0) {
+    return NULL;
+  }
+  entry = find_entry(table->entries,
+                     table->capacity,
+                     hash_key(key, length),
+                     key,
+                     length);
+  return entry->key ? entry->value : NULL;
+}
+
+void* uvtls_hash_table_remove(uvtls_hash_table_t* table,
+                              const char* key,
+                              size_t length) {
+  size_t mask = table->capacity - 1;
+  size_t i, j;
+  void* value;
+  uvtls_hash_table_entry_t* entry;
+  if (table->count == 0) {
+    return NULL;
+  }
+  entry = find_entry(table->entries,
+                     table->capacity,
+                     hash_key(key, length),
+                     key,
+                     length);
+  if (!entry->key) {
+    return NULL;
+  }
+  value = entry->value;
+  uvtls__free(entry->key);
+
+  /* Shift back the entries that follow in the same probe sequence so that
+   * lookups don't stop at the removed entry */
+  i = j = (size_t) (entry - table->entries);
+  for (;;) {
+    size_t home;
+    j = (j + 1) & mask;
+    if (!table->entries[j].key) {
+      break;
+    }
+    home = table->entries[j].hash & mask;
+    if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+      continue; /* Already reachable from its home slot */
+    }
+    table->entries[i] = table->entries[j];
+    i = j;
+  }
+  table->entries[i].key = NULL;
+  table->count--;
+
+  return value;
+}
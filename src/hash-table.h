@@ -0,0 +1,77 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef UVTLS_HASH_TABLE_H
+#define UVTLS_HASH_TABLE_H
+
+#include <stddef.h>
+
+/*
+ * A hash table that maps byte string keys to pointers using open addressing
+ * with linear probing. Keys are copied into the table. Lookups are O(1) on
+ * average and the table doubles in size when it's more than half full.
+ */
+
+typedef struct uvtls_hash_table_s uvtls_hash_table_t;
+typedef struct uvtls_hash_table_entry_s uvtls_hash_table_entry_t;
+
+typedef void (*uvtls_hash_table_free_cb)(void* value);
+
+struct uvtls_hash_table_entry_s {
+  size_t hash;
+  char* key;
+  size_t length;
+  void* value;
+};
+
+struct uvtls_hash_table_s {
+  uvtls_hash_table_entry_t* entries;
+  size_t capacity;
+  size_t count;
+};
+
+void uvtls_hash_table_init(uvtls_hash_table_t* table);
+
+void uvtls_hash_table_destroy(uvtls_hash_table_t* table,
+                              uvtls_hash_table_free_cb free_cb);
+
+size_t uvtls_hash_table_count(const uvtls_hash_table_t* table);
+
+/*
+ * Insert or replace a key's value. The replaced value (or NULL) is returned in
+ * `previous`.
+ */
+int uvtls_hash_table_set(uvtls_hash_table_t* table,
+                         const char* key,
+                         size_t length,
+                         void* value,
+                         void** previous);
+
+void* uvtls_hash_table_get(const uvtls_hash_table_t* table,
+                           const char* key,
+                           size_t length);
+
+/* Remove a key, returning its value (or NULL if it's not in the table) */
+void* uvtls_hash_table_remove(uvtls_hash_table_t* table,
+                              const char* key,
+                              size_t length);
+
+#endif /* UVTLS_HASH_TABLE_H */
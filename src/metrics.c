@@ -0,0 +1,148 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "metrics.h"
+
+#include "queue.h"
+#include "uvtls-common.h"
+
+#include <string.h>
+
+static const int errors__[UVTLS_METRICS_ERRORS] = {
+  UVTLS_UNKNOWN,       UVTLS_EHANDSHAKE,    UVTLS_ENOPEERCERT,
+  UVTLS_EBADPEERCERT,  UVTLS_EBADPEERIDENT, UVTLS_EQUEUETIMEOUT,
+  UVTLS_EREVOKED,      UV_ETIMEDOUT,        UV_EOF,
+  UV_ECONNRESET
+};
+
+static uv_once_t registry_init_guard__ = UV_ONCE_INIT;
+static int registry_is_initialized__;
+static uv_key_t block_key__;
+static uv_mutex_t registry_mutex__;
+static QUEUE blocks__;
+
+static void registry_init(void) {
+  if (uv_key_create(&block_key__) != 0) {
+    return;
+  }
+  if (uv_mutex_init(&registry_mutex__) != 0) {
+    uv_key_delete(&block_key__);
+    return;
+  }
+  QUEUE_INIT(&blocks__);
+  registry_is_initialized__ = 1;
+}
+
+uvtls_metrics_block_t* uvtls_metrics_local(void) {
+  uvtls_metrics_block_t* block;
+
+  uv_once(&registry_init_guard__, registry_init);
+  if (!registry_is_initialized__) {
+    return NULL;
+  }
+
+  block = (uvtls_metrics_block_t*) uv_key_get(&block_key__);
+  if (block) {
+    return block;
+  }
+
+  block = (uvtls_metrics_block_t*) uvtls__calloc(
+      1, sizeof(uvtls_metrics_block_t));
+  if (!block) {
+    return NULL;
+  }
+  uv_mutex_lock(&registry_mutex__);
+  QUEUE_INSERT_TAIL(&blocks__, &block->queue);
+  uv_mutex_unlock(&registry_mutex__);
+  uv_key_set(&block_key__, block);
+
+  return block;
+}
+
+void uvtls_metrics_handshake_failed(int status) {
+  int i;
+  for (i = UVTLS_METRICS_ERRORS - 1; i > 0; --i) {
+    if (errors__[i] == status) {
+      break;
+    }
+  }
+  uvtls_metrics_add(handshakes_failed[i], 1);
+}
+
+#define SUM(field) \
+  metrics->field += uvtls_atomic_load_relaxed(&block->field)
+
+void uvtls_get_metrics(uvtls_metrics_t* metrics) {
+  uint64_t closed = 0;
+  uint64_t created = 0;
+  uint64_t freed = 0;
+  uint64_t cached = 0;
+  uint64_t uncached = 0;
+  QUEUE* q;
+  int i;
+
+  memset(metrics, 0, sizeof(uvtls_metrics_t));
+
+  uv_once(&registry_init_guard__, registry_init);
+  if (!registry_is_initialized__) {
+    return;
+  }
+
+  uv_mutex_lock(&registry_mutex__);
+  QUEUE_FOREACH(q, &blocks__) {
+    uvtls_metrics_block_t* block = QUEUE_DATA(q, uvtls_metrics_block_t, queue);
+    SUM(handshakes_started);
+    SUM(handshakes_completed);
+    SUM(handshakes_resumed);
+    for (i = 0; i < UVTLS_METRICS_ERRORS; ++i) {
+      SUM(handshakes_failed[i]);
+    }
+    SUM(bytes_encrypted);
+    SUM(bytes_decrypted);
+    closed += uvtls_atomic_load_relaxed(&block->connections_closed);
+    created += uvtls_atomic_load_relaxed(&block->ring_buf_blocks_created);
+    freed += uvtls_atomic_load_relaxed(&block->ring_buf_blocks_freed);
+    cached += uvtls_atomic_load_relaxed(&block->slab_bytes_cached);
+    uncached += uvtls_atomic_load_relaxed(&block->slab_bytes_uncached);
+  }
+  uv_mutex_unlock(&registry_mutex__);
+
+  /* Blocks of different threads are read at slightly different times, a
+   * close or free may be seen before what it's paired with */
+  if (metrics->handshakes_completed > closed) {
+    metrics->connections_active = metrics->handshakes_completed - closed;
+  }
+  if (created > freed) {
+    metrics->ring_buf_blocks = created - freed;
+  }
+  if (cached > uncached) {
+    metrics->slab_bytes = cached - uncached;
+  }
+}
+
+#undef SUM
+
+int uvtls_metrics_error(int slot) {
+  if (slot < 0 || slot >= UVTLS_METRICS_ERRORS) {
+    return UVTLS_UNKNOWN;
+  }
+  return errors__[slot];
+}
@@ -0,0 +1,70 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef UVTLS_METRICS_H
+#define UVTLS_METRICS_H
+
+#include "atomic.h"
+#include "uvtls.h"
+
+#include <stdint.h>
+
+/*
+ * Process-wide counters kept in a block per thread. A block only has one
+ * writer, its thread, so incrementing it is a relaxed load and store rather
+ * than a locked instruction. Blocks are registered once per thread and live
+ * until the process exits; uvtls_get_metrics() sums them under the registry
+ * lock.
+ */
+
+typedef struct uvtls_metrics_block_s uvtls_metrics_block_t;
+
+struct uvtls_metrics_block_s {
+  void* queue[2];
+  uint64_t handshakes_started;
+  uint64_t handshakes_completed;
+  uint64_t handshakes_resumed;
+  uint64_t handshakes_failed[UVTLS_METRICS_ERRORS];
+  uint64_t connections_closed; /* Of completed handshakes */
+  uint64_t ring_buf_blocks_created;
+  uint64_t ring_buf_blocks_freed;
+  uint64_t slab_bytes_cached;   /* Put on a slab's free list */
+  uint64_t slab_bytes_uncached; /* Taken off or released from one */
+  uint64_t bytes_encrypted;
+  uint64_t bytes_decrypted;
+};
+
+/* The calling thread's block, NULL if it couldn't be allocated */
+uvtls_metrics_block_t* uvtls_metrics_local(void);
+
+#define uvtls_metrics_add(field, value)                                    \
+  do {                                                                     \
+    uvtls_metrics_block_t* block__ = uvtls_metrics_local();                \
+    if (block__) {                                                         \
+      uvtls_atomic_store_relaxed(                                          \
+          &block__->field,                                                 \
+          uvtls_atomic_load_relaxed(&block__->field) + (uint64_t) (value)); \
+    }                                                                      \
+  } while (0)
+
+void uvtls_metrics_handshake_failed(int status);
+
+#endif /* UVTLS_METRICS_H */
@@ -0,0 +1,98 @@
+/* Copyright (c) 2013, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Intrusive queue macros taken from libuv's internal "queue.h". */
+
+#ifndef UVTLS_QUEUE_H
+#define UVTLS_QUEUE_H
+
+#include <stddef.h>
+
+typedef void* QUEUE[2];
+
+/* Private macros. */
+#define QUEUE_NEXT(q) (*(QUEUE**) &((*(q))[0]))
+#define QUEUE_PREV(q) (*(QUEUE**) &((*(q))[1]))
+#define QUEUE_PREV_NEXT(q) (QUEUE_NEXT(QUEUE_PREV(q)))
+#define QUEUE_NEXT_PREV(q) (QUEUE_PREV(QUEUE_NEXT(q)))
+
+/* Public macros. */
+#define QUEUE_DATA(ptr, type, field) \
+  ((type*) ((char*) (ptr) -offsetof(type, field)))
+
+#define QUEUE_FOREACH(q, h) \
+  for ((q) = QUEUE_NEXT(h); (q) != (h); (q) = QUEUE_NEXT(q))
+
+#define QUEUE_EMPTY(q) ((const QUEUE*) (q) == (const QUEUE*) QUEUE_NEXT(q))
+
+#define QUEUE_HEAD(q) (QUEUE_NEXT(q))
+
+#define QUEUE_INIT(q)    \
+  do {                   \
+    QUEUE_NEXT(q) = (q); \
+    QUEUE_PREV(q) = (q); \
+  } while (0)
+
+#define QUEUE_ADD(h, n)                 \
+  do {                                  \
+    QUEUE_PREV_NEXT(h) = QUEUE_NEXT(n); \
+    QUEUE_NEXT_PREV(n) = QUEUE_PREV(h); \
+    QUEUE_PREV(h) = QUEUE_PREV(n);      \
+    QUEUE_PREV_NEXT(h) = (h);           \
+  } while (0)
+
+#define QUEUE_SPLIT(h, q, n)       \
+  do {                             \
+    QUEUE_PREV(n) = QUEUE_PREV(h); \
+    QUEUE_PREV_NEXT(n) = (n);      \
+    QUEUE_NEXT(n) = (q);           \
+    QUEUE_PREV(h) = QUEUE_PREV(q); \
+    QUEUE_PREV_NEXT(h) = (h);      \
+    QUEUE_PREV(q) = (n);           \
+  } while (0)
+
+#define QUEUE_MOVE(h, n)        \
+  do {                          \
+    if (QUEUE_EMPTY(h))         \
+      QUEUE_INIT(n);            \
+    else {                      \
+      QUEUE* q = QUEUE_HEAD(h); \
+      QUEUE_SPLIT(h, q, n);     \
+    }                           \
+  } while (0)
+
+#define QUEUE_INSERT_HEAD(h, q)    \
+  do {                             \
+    QUEUE_NEXT(q) = QUEUE_NEXT(h); \
+    QUEUE_PREV(q) = (h);           \
+    QUEUE_NEXT_PREV(q) = (q);      \
+    QUEUE_NEXT(h) = (q);           \
+  } while (0)
+
+#define QUEUE_INSERT_TAIL(h, q)    \
+  do {                             \
+    QUEUE_NEXT(q) = (h);           \
+    QUEUE_PREV(q) = QUEUE_PREV(h); \
+    QUEUE_PREV_NEXT(q) = (q);      \
+    QUEUE_PREV(h) = (q);           \
+  } while (0)
+
+#define QUEUE_REMOVE(q)                 \
+  do {                                  \
+    QUEUE_PREV_NEXT(q) = QUEUE_NEXT(q); \
+    QUEUE_NEXT_PREV(q) = QUEUE_PREV(q); \
+  } while (0)
+
+#endif /* UVTLS_QUEUE_H */
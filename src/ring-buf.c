@@ -21,6 +21,10 @@
 
 #include "ring-buf.h"
 
+#include "metrics.h"
+#include "slab.h"
+#include "uvtls-common.h"
+
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,33 +37,67 @@ uvtls_ring_buf_pos_t uvtls_ring_buf_pos_init(int index,
   return pos;
 }
 
-static void free_blocks(uvtls_ring_buf_block_t* blocks) {
+static void free_blocks(uvtls_ring_buf_t* rb,
+                        uvtls_ring_buf_block_t* blocks) {
   uvtls_ring_buf_block_t* current = blocks;
   while (current) {
     uvtls_ring_buf_block_t* next = current->next;
-    free(current);
+    rb->blocks_count--;
+    uvtls_metrics_add(ring_buf_blocks_freed, 1);
+    if (rb->slab) {
+      uvtls_slab_free(rb->slab, current);
+    } else {
+      uvtls__free(current);
+    }
     current = next;
   }
 }
 
-static uvtls_ring_buf_block_t* create_block() {
-  uvtls_ring_buf_block_t* block =
-      (uvtls_ring_buf_block_t*) malloc(sizeof(uvtls_ring_buf_block_t));
-  block->next = NULL;
+static uvtls_ring_buf_block_t* create_block(uvtls_ring_buf_t* rb) {
+  uvtls_ring_buf_block_t* block;
+  if (rb->slab) {
+    block = (uvtls_ring_buf_block_t*) uvtls_slab_alloc(rb->slab);
+  } else {
+    block = (uvtls_ring_buf_block_t*) uvtls__malloc(
+        sizeof(uvtls_ring_buf_block_t));
+  }
+  if (block) {
+    block->next = NULL;
+    rb->blocks_count++;
+    uvtls_metrics_add(ring_buf_blocks_created, 1);
+  }
   return block;
 }
 
-static void push_tail_block(uvtls_ring_buf_t* rb) {
-  if (rb->empty_blocks) {
-    uvtls_ring_buf_block_t* empty_block = rb->empty_blocks;
-    rb->tail.block->next = empty_block;
-    rb->empty_blocks = empty_block->next;
-    empty_block->next = NULL;
+/* Reacquire a block for a ring buffer that was released */
+static int acquire_tail_block(uvtls_ring_buf_t* rb) {
+  uvtls_ring_buf_block_t* block;
+  if (rb->tail.block) {
+    return 0;
+  }
+  block = create_block(rb);
+  if (!block) {
+    return UV_ENOMEM;
+  }
+  rb->head = rb->tail = uvtls_ring_buf_pos_init(0, block);
+  return 0;
+}
+
+static int push_tail_block(uvtls_ring_buf_t* rb) {
+  uvtls_ring_buf_block_t* block = rb->empty_blocks;
+  if (block) {
+    rb->empty_blocks = block->next;
+    block->next = NULL;
   } else {
-    rb->tail.block->next = create_block();
+    block = create_block(rb);
+    if (!block) {
+      return UV_ENOMEM;
+    }
   }
-  rb->tail.block = rb->tail.block->next;
+  rb->tail.block->next = block;
+  rb->tail.block = block;
   rb->tail.index = 0;
+  return 0;
 }
 
 static void pop_head_block(uvtls_ring_buf_t* rb) {
@@ -72,7 +110,14 @@ static void pop_head_block(uvtls_ring_buf_t* rb) {
 }
 
 int uvtls_ring_buf_init(uvtls_ring_buf_t* rb) {
-  uvtls_ring_buf_block_t* block = create_block();
+  return uvtls_ring_buf_init_ex(rb, NULL);
+}
+
+int uvtls_ring_buf_init_ex(uvtls_ring_buf_t* rb, uvtls_slab_t* slab) {
+  uvtls_ring_buf_block_t* block;
+  rb->slab = slab;
+  rb->blocks_count = 0;
+  block = create_block(rb);
   if (!block) {
     return UV_ENOMEM;
   }
@@ -84,8 +129,25 @@ int uvtls_ring_buf_init(uvtls_ring_buf_t* rb) {
 }
 
 void uvtls_ring_buf_destroy(uvtls_ring_buf_t* rb) {
-  free_blocks(rb->empty_blocks);
-  free_blocks(rb->head.block);
+  free_blocks(rb, rb->empty_blocks);
+  free_blocks(rb, rb->head.block);
+}
+
+void uvtls_ring_buf_release(uvtls_ring_buf_t* rb) {
+  assert(rb->size == 0 && "Only an empty ring buffer can be released");
+  uvtls_ring_buf_destroy(rb);
+  rb->empty_blocks = NULL;
+  rb->head = rb->tail = uvtls_ring_buf_pos_init(0, NULL);
+}
+
+int uvtls_ring_buf_blocks_count(const uvtls_ring_buf_t* rb) {
+  return rb->blocks_count;
+}
+
+long uvtls_ring_buf_total_blocks_count(void) {
+  uvtls_metrics_t metrics;
+  uvtls_get_metrics(&metrics);
+  return (long) metrics.ring_buf_blocks;
 }
 
 int uvtls_ring_buf_size(const uvtls_ring_buf_t* rb) {
@@ -100,10 +162,12 @@ void uvtls_ring_buf_reset(uvtls_ring_buf_t* rb) {
   rb->size = 0;
 }
 
-void uvtls_ring_buf_write(uvtls_ring_buf_t* rb, const char* data, int size) {
+int uvtls_ring_buf_write(uvtls_ring_buf_t* rb, const char* data, int size) {
   const char* pos = data;
   int remaining = size;
-  assert(rb->tail.block && "Tail block should never be NULL");
+  if (size > 0 && acquire_tail_block(rb) != 0) {
+    return UV_ENOMEM;
+  }
 
   while (remaining > 0) {
     int to_copy = UVTLS_RING_BUF_BLOCK_SIZE - rb->tail.index;
@@ -111,7 +175,9 @@ void uvtls_ring_buf_write(uvtls_ring_buf_t* rb, const char* data, int size) {
            "Tail index should always be less than or equal to block size");
 
     if (to_copy == 0) {
-      push_tail_block(rb);
+      if (push_tail_block(rb) != 0) {
+        return UV_ENOMEM;
+      }
       to_copy = UVTLS_RING_BUF_BLOCK_SIZE;
     }
 
@@ -126,16 +192,25 @@ void uvtls_ring_buf_write(uvtls_ring_buf_t* rb, const char* data, int size) {
     pos += to_copy;
     remaining -= to_copy;
   }
+
+  return 0;
 }
 
 int uvtls_ring_buf_tail_block(uvtls_ring_buf_t* rb, char** data, int size) {
-  int available = UVTLS_RING_BUF_BLOCK_SIZE - rb->tail.index;
-  assert(rb->tail.block && "Tail block should never be NULL");
+  int available;
+  if (acquire_tail_block(rb) != 0) {
+    *data = NULL;
+    return 0;
+  }
+  available = UVTLS_RING_BUF_BLOCK_SIZE - rb->tail.index;
   assert(rb->tail.index <= UVTLS_RING_BUF_BLOCK_SIZE &&
          "Tail index should always be less than or equal to block size");
 
   if (available == 0) {
-    push_tail_block(rb);
+    if (push_tail_block(rb) != 0) {
+      *data = NULL;
+      return 0;
+    }
     available = UVTLS_RING_BUF_BLOCK_SIZE;
   }
 
@@ -147,6 +222,9 @@ int uvtls_ring_buf_tail_block(uvtls_ring_buf_t* rb, char** data, int size) {
 void uvtls_ring_buf_tail_block_commit(uvtls_ring_buf_t* rb, int size) {
   int available = UVTLS_RING_BUF_BLOCK_SIZE - rb->tail.index;
   int to_commit = size;
+  if (size == 0) {
+    return;
+  }
   assert(rb->tail.block && "Tail block should never be NULL");
   if (to_commit > available) {
     to_commit = available;
@@ -161,7 +239,9 @@ int uvtls_ring_buf_read(uvtls_ring_buf_t* rb, char* data, int len) {
   int initial_size = rb->size;
   char* pos = data;
   int remaining = len;
-  assert(rb->head.block && "Head block should never be NULL");
+  if (!rb->head.block) {
+    return 0; /* Released */
+  }
 
   while (remaining > 0) {
     const char* block_pos = rb->head.block->data + rb->head.index;
@@ -206,9 +286,12 @@ uvtls_ring_buf_pos_t uvtls_ring_buf_head_blocks(const uvtls_ring_buf_t* rb,
                                                 uvtls_ring_buf_pos_t pos,
                                                 uv_buf_t* bufs,
                                                 int* bufs_count) {
-  uvtls_ring_buf_pos_t current = pos;
+  uvtls_ring_buf_pos_t current = pos.block ? pos : rb->head;
   int count = 0;
-  assert(pos.block && "Position block should never be NULL");
+  if (!current.block) {
+    *bufs_count = 0; /* Released */
+    return rb->tail;
+  }
 
   while (count < *bufs_count) {
     uv_buf_t* buf = bufs + count;
@@ -238,14 +321,49 @@ uvtls_ring_buf_pos_t uvtls_ring_buf_head_blocks(const uvtls_ring_buf_t* rb,
   return current;
 }
 
+int uvtls_ring_buf_head_blocks_count(const uvtls_ring_buf_t* rb,
+                                     uvtls_ring_buf_pos_t pos) {
+  uvtls_ring_buf_block_t* block = pos.block ? pos.block : rb->head.block;
+  int count = 1;
+
+  while (block != rb->tail.block) {
+    block = block->next;
+    count++;
+  }
+  return count;
+}
+
 void uvtls_ring_buf_head_blocks_commit(uvtls_ring_buf_t* rb,
                                        uvtls_ring_buf_pos_t pos) {
   while (rb->head.block != pos.block && rb->head.block != rb->tail.block) {
     rb->size -= UVTLS_RING_BUF_BLOCK_SIZE - rb->head.index;
     pop_head_block(rb);
   }
-  if (pos.block == rb->tail.block) {
+  if (rb->head.block == pos.block) {
+    /* The position's block may no longer be the tail block if more data was
+     * written after the blocks were handed out */
     rb->size -= pos.index - rb->head.index;
   }
   rb->head = pos;
 }
+
+int uvtls_ring_buf_extend_begin(uvtls_ring_buf_t* rb, uvtls_ring_buf_t* ext) {
+  int rc = acquire_tail_block(rb);
+  if (rc != 0) {
+    return rc;
+  }
+  ext->empty_blocks = NULL;
+  ext->slab = NULL; /* Slabs aren't thread-safe */
+  ext->head = ext->tail = rb->tail;
+  ext->size = 0;
+  ext->blocks_count = 0;
+  ext->ret = -1;
+  return 0;
+}
+
+void uvtls_ring_buf_extend_end(uvtls_ring_buf_t* rb, uvtls_ring_buf_t* ext) {
+  assert(!ext->empty_blocks && "Extension should never be read from");
+  rb->tail = ext->tail;
+  rb->size += ext->size;
+  rb->blocks_count += ext->blocks_count;
+}
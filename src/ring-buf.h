@@ -31,13 +31,35 @@ uvtls_ring_buf_pos_t uvtls_ring_buf_pos_init(int index,
 
 int uvtls_ring_buf_init(uvtls_ring_buf_t* rb);
 
+/*
+ * Like uvtls_ring_buf_init(), but blocks are allocated from, and returned to,
+ * `slab` (which must have been initialized with the size of a block).
+ */
+int uvtls_ring_buf_init_ex(uvtls_ring_buf_t* rb, uvtls_slab_t* slab);
+
 void uvtls_ring_buf_destroy(uvtls_ring_buf_t* rb);
 
+/*
+ * Free all the blocks of an empty ring buffer. A block is reacquired when the
+ * ring buffer is next written to. Positions taken while it's released refer
+ * to its head.
+ */
+void uvtls_ring_buf_release(uvtls_ring_buf_t* rb);
+
+int uvtls_ring_buf_blocks_count(const uvtls_ring_buf_t* rb);
+
+/* The number of blocks held by all ring buffers (from any thread) */
+long uvtls_ring_buf_total_blocks_count(void);
+
 int uvtls_ring_buf_size(const uvtls_ring_buf_t* rb);
 
 void uvtls_ring_buf_reset(uvtls_ring_buf_t* rb);
 
-void uvtls_ring_buf_write(uvtls_ring_buf_t* rb, const char* data, int size);
+/*
+ * Returns UV_ENOMEM if a block can't be allocated, in which case only part of
+ * `data` may have been written.
+ */
+int uvtls_ring_buf_write(uvtls_ring_buf_t* rb, const char* data, int size);
 
 int uvtls_ring_buf_tail_block(uvtls_ring_buf_t* rb, char** data, int size);
 
@@ -50,7 +72,20 @@ uvtls_ring_buf_pos_t uvtls_ring_buf_head_blocks(const uvtls_ring_buf_t* rb,
                                                 uv_buf_t* bufs,
                                                 int* bufs_count);
 
+int uvtls_ring_buf_head_blocks_count(const uvtls_ring_buf_t* rb,
+                                     uvtls_ring_buf_pos_t pos);
+
 void uvtls_ring_buf_head_blocks_commit(uvtls_ring_buf_t* rb,
                                        uvtls_ring_buf_pos_t pos);
 
+/*
+ * Append to `rb` through `ext` (e.g. from another thread) using only the
+ * space after `rb`'s tail, so `rb`'s existing data can still be handed out
+ * and committed meanwhile. `rb` must not be written to until the appended
+ * data is spliced onto it using uvtls_ring_buf_extend_end().
+ */
+int uvtls_ring_buf_extend_begin(uvtls_ring_buf_t* rb, uvtls_ring_buf_t* ext);
+
+void uvtls_ring_buf_extend_end(uvtls_ring_buf_t* rb, uvtls_ring_buf_t* ext);
+
 #endif /* UVTLS_RING_BUF_H */
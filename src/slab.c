@@ -0,0 +1,81 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "slab.h"
+
+#include "metrics.h"
+#include "uvtls-common.h"
+
+#include <assert.h>
+
+typedef struct uvtls_slab_chunk_s uvtls_slab_chunk_t;
+
+struct uvtls_slab_chunk_s {
+  uvtls_slab_chunk_t* next;
+};
+
+void uvtls_slab_init(uvtls_slab_t* slab, size_t size, unsigned int max_count) {
+  assert(size >= sizeof(uvtls_slab_chunk_t) &&
+         "Slab chunks should be big enough to hold a free list pointer");
+  slab->free_list = NULL;
+  slab->size = size;
+  slab->count = 0;
+  slab->max_count = max_count;
+}
+
+void uvtls_slab_destroy(uvtls_slab_t* slab) {
+  uvtls_slab_chunk_t* chunk = (uvtls_slab_chunk_t*) slab->free_list;
+  while (chunk) {
+    uvtls_slab_chunk_t* next = chunk->next;
+    uvtls__free(chunk);
+    chunk = next;
+  }
+  uvtls_metrics_add(slab_bytes_uncached, slab->count * slab->size);
+  slab->free_list = NULL;
+  slab->count = 0;
+  slab->max_count = 0;
+}
+
+void* uvtls_slab_alloc(uvtls_slab_t* slab) {
+  uvtls_slab_chunk_t* chunk = (uvtls_slab_chunk_t*) slab->free_list;
+  if (!chunk) {
+    return uvtls__malloc(slab->size);
+  }
+  slab->free_list = chunk->next;
+  slab->count--;
+  uvtls_metrics_add(slab_bytes_uncached, slab->size);
+  return chunk;
+}
+
+void uvtls_slab_free(uvtls_slab_t* slab, void* ptr) {
+  uvtls_slab_chunk_t* chunk = (uvtls_slab_chunk_t*) ptr;
+  if (!chunk) {
+    return;
+  }
+  if (slab->count >= slab->max_count) {
+    uvtls__free(chunk);
+    return;
+  }
+  chunk->next = (uvtls_slab_chunk_t*) slab->free_list;
+  slab->free_list = chunk;
+  slab->count++;
+  uvtls_metrics_add(slab_bytes_cached, slab->size);
+}
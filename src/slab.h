@@ -0,0 +1,47 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef UVTLS_SLAB_H
+#define UVTLS_SLAB_H
+
+#include "uvtls/internal.h"
+
+/*
+ * A cache of fixed-size chunks. Freed chunks are kept on a free list (up to
+ * `max_count` of them) and handed back out by the next allocation, so objects
+ * that are created and destroyed at a high rate on the same loop (e.g.
+ * connections) don't go through the allocator each time. A slab isn't
+ * thread-safe; it should only be used by the thread running its loop.
+ */
+
+void uvtls_slab_init(uvtls_slab_t* slab, size_t size, unsigned int max_count);
+
+/*
+ * Free the cached chunks. Chunks freed afterwards (e.g. by connections whose
+ * close callbacks are still pending) are released immediately.
+ */
+void uvtls_slab_destroy(uvtls_slab_t* slab);
+
+void* uvtls_slab_alloc(uvtls_slab_t* slab);
+
+void uvtls_slab_free(uvtls_slab_t* slab, void* ptr);
+
+#endif /* UVTLS_SLAB_H */
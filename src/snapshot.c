@@ -0,0 +1,213 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "snapshot.h"
+
+#include "atomic.h"
+#include "queue.h"
+#include "uvtls-common.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+typedef struct uvtls_snapshot_reader_s uvtls_snapshot_reader_t;
+
+/* A thread's reader state. Only its thread writes to it, and it's padded so
+ * that threads don't share a cache line. */
+struct uvtls_snapshot_reader_s {
+  void* queue[2];
+  long epoch; /* When the outermost acquire started, 0 if not reading */
+  long depth; /* Nested acquires, of any snapshot */
+  char padding[64];
+};
+
+static uv_once_t registry_init_guard__ = UV_ONCE_INIT;
+static int registry_is_initialized__;
+static uv_key_t reader_key__;
+static uv_mutex_t registry_mutex__;
+static QUEUE readers__;
+static long epoch__ = 1;
+
+/* Used by threads whose own reader state couldn't be allocated. Its depth is
+ * shared, so while it's non-zero nothing retired is freed. */
+static uvtls_snapshot_reader_t shared_reader__;
+
+static void registry_init(void) {
+  if (uv_key_create(&reader_key__) != 0) {
+    return;
+  }
+  if (uv_mutex_init(&registry_mutex__) != 0) {
+    uv_key_delete(&reader_key__);
+    return;
+  }
+  QUEUE_INIT(&readers__);
+  registry_is_initialized__ = 1;
+}
+
+static uvtls_snapshot_reader_t* local_reader(void) {
+  uvtls_snapshot_reader_t* reader;
+
+  uv_once(&registry_init_guard__, registry_init);
+  if (!registry_is_initialized__) {
+    return &shared_reader__;
+  }
+
+  reader = (uvtls_snapshot_reader_t*) uv_key_get(&reader_key__);
+  if (reader) {
+    return reader;
+  }
+
+  reader = (uvtls_snapshot_reader_t*) uvtls__calloc(
+      1, sizeof(uvtls_snapshot_reader_t));
+  if (reader) {
+    uv_mutex_lock(&registry_mutex__);
+    QUEUE_INSERT_TAIL(&readers__, &reader->queue);
+    uv_mutex_unlock(&registry_mutex__);
+  } else {
+    reader = &shared_reader__;
+  }
+  uv_key_set(&reader_key__, reader);
+
+  return reader;
+}
+
+/* The earliest epoch a thread that's reading started in */
+static long oldest_epoch(void) {
+  long oldest = LONG_MAX;
+  QUEUE* q;
+
+  if (uvtls_atomic_load(&shared_reader__.depth) != 0) {
+    return 0;
+  }
+
+  uv_once(&registry_init_guard__, registry_init);
+  if (!registry_is_initialized__) {
+    return oldest;
+  }
+
+  uv_mutex_lock(&registry_mutex__);
+  QUEUE_FOREACH(q, &readers__) {
+    uvtls_snapshot_reader_t* reader =
+        QUEUE_DATA(q, uvtls_snapshot_reader_t, queue);
+    long epoch = uvtls_atomic_load(&reader->epoch);
+    if (epoch != 0 && epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+  uv_mutex_unlock(&registry_mutex__);
+
+  return oldest;
+}
+
+/* Free the data retired before the oldest reader started */
+static void free_retired(uvtls_snapshot_t* snapshot, long oldest) {
+  size_t i, count = 0;
+  for (i = 0; i < snapshot->retired_count; ++i) {
+    if (snapshot->retired[i].epoch <= oldest) {
+      snapshot->free_cb(snapshot->retired[i].data);
+    } else {
+      snapshot->retired[count++] = snapshot->retired[i];
+    }
+  }
+  snapshot->retired_count = count;
+}
+
+static int retire(uvtls_snapshot_t* snapshot, void* data, long epoch) {
+  if (snapshot->retired_count == snapshot->retired_capacity) {
+    size_t capacity =
+        snapshot->retired_capacity > 0 ? 2 * snapshot->retired_capacity : 4;
+    uvtls_snapshot_retired_t* retired =
+        (uvtls_snapshot_retired_t*) uvtls__realloc(
+            snapshot->retired, capacity * sizeof(uvtls_snapshot_retired_t));
+    if (!retired) {
+      return UV_ENOMEM;
+    }
+    snapshot->retired = retired;
+    snapshot->retired_capacity = capacity;
+  }
+  snapshot->retired[snapshot->retired_count].data = data;
+  snapshot->retired[snapshot->retired_count].epoch = epoch;
+  snapshot->retired_count++;
+  return 0;
+}
+
+int uvtls_snapshot_init(uvtls_snapshot_t* snapshot,
+                        uvtls_snapshot_free_cb free_cb) {
+  snapshot->data = NULL;
+  snapshot->retired = NULL;
+  snapshot->retired_count = 0;
+  snapshot->retired_capacity = 0;
+  snapshot->free_cb = free_cb;
+  return uv_mutex_init(&snapshot->mutex);
+}
+
+void uvtls_snapshot_destroy(uvtls_snapshot_t* snapshot) {
+  free_retired(snapshot, LONG_MAX);
+  uvtls__free(snapshot->retired);
+  if (snapshot->data) {
+    snapshot->free_cb(snapshot->data);
+  }
+  uv_mutex_destroy(&snapshot->mutex);
+}
+
+void* uvtls_snapshot_acquire(uvtls_snapshot_t* snapshot) {
+  uvtls_snapshot_reader_t* reader = local_reader();
+  if (reader == &shared_reader__) {
+    uvtls_atomic_add(&shared_reader__.depth, 1);
+  } else if (reader->depth++ == 0) {
+    /* Stored before the data is loaded, so a publisher that retires the data
+     * after it's loaded sees this epoch */
+    uvtls_atomic_store(&reader->epoch, uvtls_atomic_load(&epoch__));
+  }
+  return uvtls_atomic_load_ptr(&snapshot->data);
+}
+
+void uvtls_snapshot_release(uvtls_snapshot_t* snapshot) {
+  uvtls_snapshot_reader_t* reader = local_reader();
+  if (reader == &shared_reader__) {
+    uvtls_atomic_add(&shared_reader__.depth, -1);
+  } else if (--reader->depth == 0) {
+    uvtls_atomic_store(&reader->epoch, 0);
+  }
+}
+
+void uvtls_snapshot_publish(uvtls_snapshot_t* snapshot, void* data) {
+  void* previous;
+  long epoch;
+
+  uv_mutex_lock(&snapshot->mutex);
+
+  previous = uvtls_atomic_exchange_ptr(&snapshot->data, data);
+
+  /* Readers that start in the new epoch can only see the new data */
+  epoch = uvtls_atomic_add(&epoch__, 1);
+
+  if (previous && retire(snapshot, previous, epoch) != 0) {
+    /* Out of memory; wait out the readers that might still see it */
+    while (oldest_epoch() < epoch) {
+    }
+    snapshot->free_cb(previous);
+  }
+
+  free_retired(snapshot, oldest_epoch());
+
+  uv_mutex_unlock(&snapshot->mutex);
+}
@@ -0,0 +1,70 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef UVTLS_SNAPSHOT_H
+#define UVTLS_SNAPSHOT_H
+
+#include <uv.h>
+
+/*
+ * A pointer to immutable data that's read on hot paths and replaced rarely.
+ * Readers never block and don't write to shared memory: each thread marks the
+ * epoch it started reading in, in its own reader state. A publisher swaps in
+ * the new data, advances the epoch and retires the previous data, which is
+ * freed once every thread reading has started since it was retired.
+ * Publishers are serialized by a mutex.
+ */
+
+typedef struct uvtls_snapshot_s uvtls_snapshot_t;
+typedef struct uvtls_snapshot_retired_s uvtls_snapshot_retired_t;
+
+typedef void (*uvtls_snapshot_free_cb)(void* data);
+
+struct uvtls_snapshot_retired_s {
+  void* data;
+  long epoch; /* Readers from this epoch on can't see it */
+};
+
+struct uvtls_snapshot_s {
+  void* data;
+  uvtls_snapshot_retired_t* retired;
+  size_t retired_count;
+  size_t retired_capacity;
+  uvtls_snapshot_free_cb free_cb;
+  uv_mutex_t mutex;
+};
+
+int uvtls_snapshot_init(uvtls_snapshot_t* snapshot,
+                        uvtls_snapshot_free_cb free_cb);
+
+void uvtls_snapshot_destroy(uvtls_snapshot_t* snapshot);
+
+/*
+ * Returns the current data (possibly NULL). It remains valid until
+ * uvtls_snapshot_release() is called.
+ */
+void* uvtls_snapshot_acquire(uvtls_snapshot_t* snapshot);
+
+void uvtls_snapshot_release(uvtls_snapshot_t* snapshot);
+
+void uvtls_snapshot_publish(uvtls_snapshot_t* snapshot, void* data);
+
+#endif /* UVTLS_SNAPSHOT_H */
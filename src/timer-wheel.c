@@ -0,0 +1,116 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "timer-wheel.h"
+
+#include "queue.h"
+
+#include <assert.h>
+
+#define SLOT(wheel, tick) \
+  (&(wheel)->slots[(tick) % UVTLS_TIMER_WHEEL_SLOTS])
+
+void uvtls_timer_wheel_init(uvtls_timer_wheel_t* wheel,
+                            uint64_t resolution,
+                            uint64_t now) {
+  int i;
+  assert(resolution > 0 && "Timer wheel resolution should be non-zero");
+  for (i = 0; i < UVTLS_TIMER_WHEEL_SLOTS; ++i) {
+    QUEUE_INIT(&wheel->slots[i]);
+  }
+  wheel->resolution = resolution;
+  wheel->tick = now / resolution;
+  wheel->count = 0;
+}
+
+int uvtls_timer_wheel_empty(const uvtls_timer_wheel_t* wheel) {
+  return wheel->count == 0;
+}
+
+void uvtls_timer_wheel_entry_init(uvtls_timer_wheel_entry_t* entry) {
+  QUEUE_INIT(&entry->queue);
+  entry->deadline = 0;
+}
+
+int uvtls_timer_wheel_entry_is_active(const uvtls_timer_wheel_entry_t* entry) {
+  return !QUEUE_EMPTY(&entry->queue);
+}
+
+void uvtls_timer_wheel_add(uvtls_timer_wheel_t* wheel,
+                           uvtls_timer_wheel_entry_t* entry,
+                           uint64_t now,
+                           uint64_t timeout) {
+  uint64_t tick;
+  assert(!uvtls_timer_wheel_entry_is_active(entry) &&
+         "Timer wheel entry is already active");
+  if (wheel->count == 0) {
+    wheel->tick = now / wheel->resolution; /* Skip ticks while idle */
+  }
+  entry->deadline = now + timeout;
+  tick = entry->deadline / wheel->resolution;
+  if (tick < wheel->tick) {
+    tick = wheel->tick;
+  }
+  QUEUE_INSERT_TAIL(SLOT(wheel, tick), &entry->queue);
+  wheel->count++;
+}
+
+void uvtls_timer_wheel_remove(uvtls_timer_wheel_t* wheel,
+                              uvtls_timer_wheel_entry_t* entry) {
+  if (uvtls_timer_wheel_entry_is_active(entry)) {
+    QUEUE_REMOVE(&entry->queue);
+    QUEUE_INIT(&entry->queue);
+    wheel->count--;
+  }
+}
+
+void uvtls_timer_wheel_expire(uvtls_timer_wheel_t* wheel,
+                              uint64_t now,
+                              uvtls_timer_wheel_expire_cb cb,
+                              void* data) {
+  while (wheel->count > 0) {
+    QUEUE pending;
+    QUEUE* slot = SLOT(wheel, wheel->tick);
+
+    /* The slot's entries are moved aside so that each is visited once per
+     * pass, even if the callback removes or adds entries */
+    QUEUE_MOVE(slot, &pending);
+    while (!QUEUE_EMPTY(&pending)) {
+      QUEUE* q = QUEUE_HEAD(&pending);
+      uvtls_timer_wheel_entry_t* entry =
+          QUEUE_DATA(q, uvtls_timer_wheel_entry_t, queue);
+      QUEUE_REMOVE(q);
+      if (entry->deadline <= now) {
+        QUEUE_INIT(q);
+        wheel->count--;
+        cb(entry, data);
+      } else {
+        QUEUE_INSERT_TAIL(slot, q); /* Due in a later rotation */
+      }
+    }
+
+    /* The callback may have reset the wheel with a new resolution */
+    if (wheel->tick >= now / wheel->resolution) {
+      break;
+    }
+    wheel->tick++;
+  }
+}
@@ -0,0 +1,65 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef UVTLS_TIMER_WHEEL_H
+#define UVTLS_TIMER_WHEEL_H
+
+#include "uvtls/internal.h"
+
+/*
+ * A hashed timing wheel. Adding and removing an entry is O(1) and expiring
+ * entries costs O(1) per entry for deadlines within one rotation of the wheel
+ * (`UVTLS_TIMER_WHEEL_SLOTS * resolution` milliseconds). The wheel doesn't own
+ * a timer; the caller drives it by calling uvtls_timer_wheel_expire() every
+ * `resolution` milliseconds while it's not empty.
+ */
+
+typedef void (*uvtls_timer_wheel_expire_cb)(uvtls_timer_wheel_entry_t* entry,
+                                            void* data);
+
+void uvtls_timer_wheel_init(uvtls_timer_wheel_t* wheel,
+                            uint64_t resolution,
+                            uint64_t now);
+
+int uvtls_timer_wheel_empty(const uvtls_timer_wheel_t* wheel);
+
+void uvtls_timer_wheel_entry_init(uvtls_timer_wheel_entry_t* entry);
+
+int uvtls_timer_wheel_entry_is_active(const uvtls_timer_wheel_entry_t* entry);
+
+void uvtls_timer_wheel_add(uvtls_timer_wheel_t* wheel,
+                           uvtls_timer_wheel_entry_t* entry,
+                           uint64_t now,
+                           uint64_t timeout);
+
+void uvtls_timer_wheel_remove(uvtls_timer_wheel_t* wheel,
+                              uvtls_timer_wheel_entry_t* entry);
+
+/*
+ * Remove the entries whose deadline has passed and call `cb` for each, in one
+ * pass over each slot up to `now`. The callback may add and remove entries.
+ */
+void uvtls_timer_wheel_expire(uvtls_timer_wheel_t* wheel,
+                              uint64_t now,
+                              uvtls_timer_wheel_expire_cb cb,
+                              void* data);
+
+#endif /* UVTLS_TIMER_WHEEL_H */
@@ -21,8 +21,54 @@
 
 #include "uvtls.h"
 
+#include "uvtls-common.h"
+
+#include <stdlib.h>
 #include <string.h>
 
+typedef struct uvtls_allocator_s uvtls_allocator_t;
+
+struct uvtls_allocator_s {
+  uvtls_malloc_func local_malloc;
+  uvtls_realloc_func local_realloc;
+  uvtls_calloc_func local_calloc;
+  uvtls_free_func local_free;
+};
+
+static uvtls_allocator_t allocator__ = {malloc, realloc, calloc, free};
+
+int uvtls_replace_allocator(uvtls_malloc_func malloc_func,
+                            uvtls_realloc_func realloc_func,
+                            uvtls_calloc_func calloc_func,
+                            uvtls_free_func free_func) {
+  if (!malloc_func || !realloc_func || !calloc_func || !free_func) {
+    return UV_EINVAL;
+  }
+
+  allocator__.local_malloc = malloc_func;
+  allocator__.local_realloc = realloc_func;
+  allocator__.local_calloc = calloc_func;
+  allocator__.local_free = free_func;
+
+  return 0;
+}
+
+void* uvtls__malloc(size_t size) {
+  return allocator__.local_malloc(size);
+}
+
+void* uvtls__realloc(void* ptr, size_t size) {
+  return allocator__.local_realloc(ptr, size);
+}
+
+void* uvtls__calloc(size_t count, size_t size) {
+  return allocator__.local_calloc(count, size);
+}
+
+void uvtls__free(void* ptr) {
+  allocator__.local_free(ptr);
+}
+
 #define UVTLS_ERR_NAME_GEN(name, _) \
   case UVTLS_##name:                \
     return #name;
@@ -19,18 +19,31 @@
  * IN THE SOFTWARE.
  */
 
+#include "atomic.h"
+#include "crl-index.h"
 #include "curl-hostcheck.h"
+#include "hash-table.h"
+#include "metrics.h"
+#include "queue.h"
 #include "ring-buf.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "timer-wheel.h"
+#include "uvtls-common.h"
+#include "verify-cache.h"
 
 #include <uvtls.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include <openssl/bio.h>
 #include <openssl/conf.h>
 #include <openssl/engine.h>
 #include <openssl/err.h>
+#include <openssl/ocsp.h>
 #include <openssl/pem.h>
 #include <openssl/pkcs12.h>
 #include <openssl/rand.h>
@@ -44,36 +57,121 @@
 #define UVTLS_METHOD SSLv23_method
 #endif
 
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L && \
+    !defined(LIBRESSL_VERSION_NUMBER) && !defined(OPENSSL_NO_COMP_ALG)
+#define UVTLS_HAVE_CERT_COMPRESSION
+#endif
+
 #define UVTLS_SUGGESTED_READ_SIZE UVTLS_RING_BUF_BLOCK_SIZE
 #define UVTLS_STACK_BUFS_COUNT 16
+#define UVTLS_MAX_HOSTNAME_LENGTH 255
 
-#define PRINT_INFO(ssl, w, flag, msg)      \
-  do {                                     \
-    if (w & flag) {                        \
-      fprintf(stderr,                      \
-              "%s - %s - %s\n",            \
-              msg,                         \
-              SSL_state_string(ssl),       \
-              SSL_state_string_long(ssl)); \
-    }                                      \
-  } while (0);
-
-static void debug_info_callback(const SSL* ssl, int where, int ret) {
-  if (ret == 0) {
-    fprintf(stderr, "info_callback, error occurred.\n");
-    return;
+#define UVTLS_TIMER_WHEEL_TICKS_PER_TIMEOUT 16
+
+/* Freed memory kept by a loop for reuse by new connections */
+#define UVTLS_LOOP_MAX_FREE_SESSIONS 1024
+#define UVTLS_LOOP_MAX_FREE_BLOCKS 256
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+enum {
+  UVTLS_FLAG_HANDSHAKE_QUEUED = 0x01, /* Waiting for a handshake slot */
+  UVTLS_FLAG_HANDSHAKE_ACTIVE = 0x02, /* Holding a handshake slot */
+  UVTLS_FLAG_HANDSHAKE_WRITE = 0x04,  /* Handshake write request in flight */
+  UVTLS_FLAG_CONNECTED = 0x08,        /* Handshake completed and verified */
+  UVTLS_FLAG_WRITE_OFFLOAD = 0x10,    /* Write being encrypted off the loop */
+  UVTLS_FLAG_CLOSE_PENDING = 0x20,    /* Closing once threadpool work ends */
+  UVTLS_FLAG_VERIFY = 0x40,           /* Verify callback on the threadpool */
+  UVTLS_FLAG_ESTABLISHED = 0x80       /* Counted as an active connection */
+};
+
+/* The trace callback of UVTLS_CONTEXT_DEBUG */
+static void debug_trace(const uvtls_trace_event_t* event) {
+  static const char* types[] = {
+      "QUEUED", "START", "MESSAGE", "STATE", "ALERT", "VERIFY", "DONE"};
+  static const char* directions[] = {"-", "IN", "OUT"};
+  fprintf(stderr,
+          "uvtls %p %llu %s %s %s message=%d alert=%d status=%d\n",
+          (void*) event->tls,
+          (unsigned long long) event->time,
+          types[event->type],
+          directions[event->direction],
+          event->state,
+          event->message,
+          event->alert,
+          event->status);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+static void* crypto_malloc(size_t size, const char* file, int line) {
+  return uvtls__malloc(size);
+}
+
+static void* crypto_realloc(void* ptr,
+                            size_t size,
+                            const char* file,
+                            int line) {
+  return uvtls__realloc(ptr, size);
+}
+
+static void crypto_free(void* ptr, const char* file, int line) {
+  uvtls__free(ptr);
+}
+#else
+#define crypto_malloc uvtls__malloc
+#define crypto_realloc uvtls__realloc
+#define crypto_free uvtls__free
+#endif
+
+int uvtls_replace_tls_allocator(void) {
+  if (!CRYPTO_set_mem_functions(crypto_malloc, crypto_realloc, crypto_free)) {
+    return UV_EBUSY; /* OpenSSL has already allocated memory */
   }
-  PRINT_INFO(ssl, where, SSL_CB_LOOP, "LOOP");
-  PRINT_INFO(ssl, where, SSL_CB_EXIT, "EXIT");
-  PRINT_INFO(ssl, where, SSL_CB_READ, "READ");
-  PRINT_INFO(ssl, where, SSL_CB_WRITE, "WRITE");
-  PRINT_INFO(ssl, where, SSL_CB_ALERT, "ALERT");
-  PRINT_INFO(ssl, where, SSL_CB_HANDSHAKE_DONE, "HANDSHAKE DONE");
+  return 0;
 }
-#undef PRINT_INFO
 
 static uv_once_t lib_init_guard__ = UV_ONCE_INIT;
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+/* OpenSSL before 1.1.0 relies on the application for locking, which is
+ * needed to share contexts between threads */
+static uv_mutex_t* crypto_locks__;
+
+static void crypto_locking_cb(int mode, int n, const char* file, int line) {
+  if (mode & CRYPTO_LOCK) {
+    uv_mutex_lock(&crypto_locks__[n]);
+  } else {
+    uv_mutex_unlock(&crypto_locks__[n]);
+  }
+}
+
+static void crypto_locks_init() {
+  int i;
+  int count = CRYPTO_num_locks();
+  crypto_locks__ = (uv_mutex_t*) uvtls__malloc(count * sizeof(uv_mutex_t));
+  if (!crypto_locks__) {
+    abort();
+  }
+  for (i = 0; i < count; ++i) {
+    if (uv_mutex_init(&crypto_locks__[i]) != 0) {
+      abort();
+    }
+  }
+  CRYPTO_set_locking_callback(crypto_locking_cb);
+}
+
+static void crypto_locks_destroy() {
+  int i;
+  int count = CRYPTO_num_locks();
+  CRYPTO_set_locking_callback(NULL);
+  for (i = 0; i < count; ++i) {
+    uv_mutex_destroy(&crypto_locks__[i]);
+  }
+  uvtls__free(crypto_locks__);
+  crypto_locks__ = NULL;
+}
+#endif
+
 static void lib_cleanup() {
   RAND_cleanup();
   ENGINE_cleanup();
@@ -87,9 +185,15 @@ static void lib_cleanup() {
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
   ERR_remove_thread_state(NULL);
 #endif
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+  crypto_locks_destroy();
+#endif
 }
 
 static void lib_init() {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+  crypto_locks_init();
+#endif
   SSL_library_init();
   SSL_load_error_strings();
   OpenSSL_add_all_algorithms();
@@ -178,7 +282,9 @@ int ring_buf_bio_read(BIO* bio, char* out, int len) {
 
 int ring_buf_bio_write(BIO* bio, const char* data, int len) {
   BIO_clear_retry_flags(bio);
-  uvtls_ring_buf_write(ring_buf_from_bio(bio), data, len);
+  if (uvtls_ring_buf_write(ring_buf_from_bio(bio), data, len) != 0) {
+    return -1; /* Out of memory, reported by SSL_get_error() as a syscall */
+  }
   return len;
 }
 
@@ -256,26 +362,78 @@ BIO* create_bio(uvtls_ring_buf_t* rb) {
   return bio;
 }
 
-static X509* load_cert(const char* cert, size_t length) {
+/*
+ * Load a leaf certificate followed by zero or more intermediate certificates
+ * (in the order they're sent to peers).
+ */
+static int load_cert_chain(const char* cert,
+                           size_t length,
+                           X509** leaf,
+                           STACK_OF(X509)** chain) {
   BIO* bio;
   X509* x509;
   if (length > INT_MAX) {
-    return NULL;
+    return UVTLS_EINVAL;
   }
 
   bio = BIO_new_mem_buf(cert, (int) length);
   if (bio == NULL) {
-    return NULL;
+    return UV_ENOMEM;
   }
 
-  x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL);
-  if (x509 == NULL) {
-    return NULL;
+  *leaf = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+  if (*leaf == NULL) {
+    BIO_free_all(bio);
+    return UVTLS_EINVAL;
+  }
+
+  *chain = sk_X509_new_null();
+  if (*chain == NULL) {
+    X509_free(*leaf);
+    BIO_free_all(bio);
+    return UV_ENOMEM;
+  }
+
+  while ((x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+    if (!sk_X509_push(*chain, x509)) {
+      X509_free(x509);
+      sk_X509_pop_free(*chain, X509_free);
+      X509_free(*leaf);
+      BIO_free_all(bio);
+      return UV_ENOMEM;
+    }
   }
+  ERR_clear_error(); /* Reading past the last certificate leaves an error */
 
   BIO_free_all(bio);
 
-  return x509;
+  return 0;
+}
+
+static int use_cert_chain(SSL_CTX* ssl_ctx,
+                          X509* leaf,
+                          STACK_OF(X509)* chain) {
+  if (!SSL_CTX_use_certificate(ssl_ctx, leaf)) {
+    return UVTLS_EINVAL;
+  }
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  if (!SSL_CTX_set1_chain(ssl_ctx, chain)) {
+    return UVTLS_EINVAL;
+  }
+#else
+  {
+    int i;
+    SSL_CTX_clear_extra_chain_certs(ssl_ctx);
+    for (i = 0; i < sk_X509_num(chain); ++i) {
+      X509* x509 = X509_dup(sk_X509_value(chain, i));
+      if (!x509 || !SSL_CTX_add_extra_chain_cert(ssl_ctx, x509)) {
+        X509_free(x509);
+        return UVTLS_EINVAL;
+      }
+    }
+  }
+#endif
+  return 0;
 }
 
 static EVP_PKEY* load_key(const char* key, size_t length) {
@@ -290,478 +448,2629 @@ static EVP_PKEY* load_key(const char* key, size_t length) {
   }
 
   pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
-  if (pkey == NULL) {
-    return NULL;
-  }
 
   BIO_free_all(bio);
 
   return pkey;
 }
 
-typedef struct uvtls_session_s uvtls_session_t;
+typedef struct uvtls_cert_bundle_s uvtls_cert_bundle_t;
+typedef struct uvtls_ocsp_response_s uvtls_ocsp_response_t;
+typedef struct uvtls_file_watcher_s uvtls_file_watcher_t;
+typedef struct uvtls_context_ex_s uvtls_context_ex_t;
 
-struct uvtls_session_s {
-  SSL* ssl;
-  BIO* incoming_bio;
-  BIO* outgoing_bio;
+struct uvtls_cert_bundle_s {
+  X509* leaf;
+  STACK_OF(X509)* chain;
+  EVP_PKEY* key;
 };
 
-static uvtls_session_t* uvtls_session_create(SSL_CTX* ssl_ctx,
-                                             uvtls_ring_buf_t* incoming,
-                                             uvtls_ring_buf_t* outgoing) {
-  /* FIXME: OOM */
-  uvtls_session_t* session =
-      (uvtls_session_t*) malloc(sizeof(uvtls_session_t));
+struct uvtls_ocsp_response_s {
+  size_t length;
+  unsigned char data[1];
+};
 
-  SSL_CTX_up_ref(ssl_ctx);
+/* Loads a watched file on the threadpool */
+typedef int (*uvtls_file_load_cb)(const char* path, void** loaded);
+
+struct uvtls_file_watcher_s {
+  uv_fs_poll_t poll;
+  uv_work_t work;
+  SSL_CTX* ssl_ctx; /* Keeps the context's published data alive */
+  uvtls_snapshot_t* snapshot; /* Where the reloaded data is published */
+  uvtls_file_load_cb load;
+  void* loaded;
+  int refs;
+  int is_work_pending;
+  char path[1];
+};
 
-  session->ssl = SSL_new(ssl_ctx);
-  session->incoming_bio = create_bio(incoming);
-  session->outgoing_bio = create_bio(outgoing);
+/* State for a context that doesn't fit in the SSL_CTX. It lives as long as
+ * the SSL_CTX, which sessions and watchers keep a reference to. */
+struct uvtls_context_ex_s {
+  uvtls_snapshot_t cert_bundle; /* Replaces the SSL_CTX's cert when reloaded */
+  uvtls_snapshot_t ocsp_response;
+  uvtls_file_watcher_t* ocsp_watcher;
+  uvtls_snapshot_t crl; /* Index of revoked certificates */
+  uvtls_file_watcher_t* crl_watcher;
+  uvtls_hash_table_t sni_contexts; /* Lowercase hostname to SSL_CTX* */
+  int cert_compression;
+  int verify_flags;
+  uvtls_verify_cache_t* verify_cache;
+  long trust_generation; /* Invalidates cached verifications */
+  int has_trust_store;   /* Uses a shared, immutable trust store */
+  uvtls_verify_cb verify_cb;
+  void* verify_cb_data;
+  int verify_offload;
+  uvtls_trace_cb trace_cb;
+  void* trace_cb_data;
+  unsigned int trace_sample_rate;
+  long trace_count; /* Handshakes considered for tracing */
+  uvtls_error_log_cb error_log_cb;
+  void* error_log_cb_data;
+  unsigned int error_log_max; /* Calls per second */
+  long error_log_second;      /* The second being counted */
+  long error_log_count;       /* Errors in that second */
+  long error_log_suppressed;  /* Errors not logged since the last call */
+  long is_published; /* Set once sessions (on any thread) use the context */
+};
 
-  SSL_set_bio(session->ssl, session->incoming_bio, session->outgoing_bio);
+static int context_ex_index__ = -1;
 
-  return session;
+static void sni_context_free(void* value) {
+  SSL_CTX_free((SSL_CTX*) value);
 }
 
-static void on_handshake_write(uv_write_t* req, int status);
-
-static void ssl_print_error() {
-  const char* data;
-  int flags;
-  unsigned long err;
-  while ((err = ERR_get_error_line_data(NULL, NULL, &data, &flags)) != 0) {
-    char buf[256];
-    ERR_error_string_n(err, buf, sizeof(buf));
-    fprintf(stderr, "%s:%s\n", buf, flags & ERR_TXT_STRING ? data : "");
+static void context_ex_free(void* parent,
+                            void* ptr,
+                            CRYPTO_EX_DATA* ad,
+                            int idx,
+                            long argl,
+                            void* argp) {
+  uvtls_context_ex_t* ex = (uvtls_context_ex_t*) ptr;
+  if (ex) {
+    uvtls_snapshot_destroy(&ex->cert_bundle);
+    uvtls_snapshot_destroy(&ex->ocsp_response);
+    uvtls_snapshot_destroy(&ex->crl);
+    uvtls_hash_table_destroy(&ex->sni_contexts, sni_context_free);
+    if (ex->verify_cache) {
+      uvtls_verify_cache_destroy(ex->verify_cache);
+      uvtls__free(ex->verify_cache);
+    }
+    uvtls__free(ex);
   }
 }
 
-static int do_write(uv_write_t* req,
-                    uvtls_t* tls,
-                    uvtls_ring_buf_pos_t start_pos,
-                    int start_size,
-                    uvtls_ring_buf_pos_t* commit_pos,
-                    uv_write_cb cb) {
-  uv_buf_t stack_bufs[UVTLS_STACK_BUFS_COUNT];
+static void context_ex_init() {
+  context_ex_index__ =
+      SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, context_ex_free);
+}
 
-  int rc;
-  int bufs_count;
-  uv_buf_t* bufs;
+static uv_once_t context_ex_init_guard__ = UV_ONCE_INIT;
 
-  int size = uvtls_ring_buf_size(&tls->outgoing) - start_size;
-  if (size > UVTLS_STACK_BUFS_COUNT * UVTLS_RING_BUF_BLOCK_SIZE) {
-    bufs_count = size / UVTLS_RING_BUF_BLOCK_SIZE;
-    bufs = (uv_buf_t*) malloc(sizeof(uv_buf_t) * (unsigned int) bufs_count);
-    if (!bufs) {
-      return UV_ENOMEM;
-    }
-  } else {
-    bufs_count = UVTLS_STACK_BUFS_COUNT;
-    bufs = stack_bufs;
+static uvtls_context_ex_t* context_ex(const uvtls_context_t* context) {
+  return (uvtls_context_ex_t*) SSL_CTX_get_ex_data((SSL_CTX*) context->impl,
+                                                   context_ex_index__);
+}
+
+/* Configuration is immutable once published so that loops on other threads
+ * can read it without locking */
+static void context_publish(uvtls_context_ex_t* ex) {
+  if (!uvtls_atomic_load(&ex->is_published)) {
+    uvtls_atomic_add(&ex->is_published, 1);
   }
+}
 
-  *commit_pos =
-      uvtls_ring_buf_head_blocks(&tls->outgoing, start_pos, bufs, &bufs_count);
-  rc = uv_write(
-      req, (uv_stream_t*) tls->stream, bufs, (unsigned int) bufs_count, cb);
+static int context_is_published(const uvtls_context_t* context) {
+  return uvtls_atomic_load(&context_ex(context)->is_published) != 0;
+}
 
-  if (bufs != stack_bufs) {
-    free(bufs);
+static void cert_bundle_free(void* data) {
+  uvtls_cert_bundle_t* bundle = (uvtls_cert_bundle_t*) data;
+  X509_free(bundle->leaf);
+  sk_X509_pop_free(bundle->chain, X509_free);
+  EVP_PKEY_free(bundle->key);
+  uvtls__free(bundle);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+static int on_cert(SSL* ssl, void* arg) {
+  int result = 1;
+  uvtls_context_ex_t* ex = (uvtls_context_ex_t*) arg;
+  uvtls_cert_bundle_t* bundle =
+      (uvtls_cert_bundle_t*) uvtls_snapshot_acquire(&ex->cert_bundle);
+
+  /* The SSL takes its own references so the bundle can be replaced while
+   * the handshake is still running */
+  if (bundle && (!SSL_use_certificate(ssl, bundle->leaf) ||
+                 !SSL_use_PrivateKey(ssl, bundle->key) ||
+                 !SSL_set1_chain(ssl, bundle->chain))) {
+    result = 0;
   }
 
-  return rc;
+  uvtls_snapshot_release(&ex->cert_bundle);
+  return result;
 }
+#endif
 
-static int do_handshake(uvtls_t* tls) {
-  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
-
-  uvtls_ring_buf_pos_t start_pos = tls->outgoing.tail;
-  int start_size = uvtls_ring_buf_size(&tls->outgoing);
+static int ocsp_response_create(const char* der,
+                                size_t length,
+                                uvtls_ocsp_response_t** response) {
+  OCSP_RESPONSE* ocsp;
+  const unsigned char* pos = (const unsigned char*) der;
 
-  int rc = SSL_do_handshake(session->ssl);
-  if (rc <= 0) {
-    int err = SSL_get_error(session->ssl, rc);
-    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_NONE) {
-      ssl_print_error();
-      return UVTLS_EHANDSHAKE;
-    }
+  if (length > INT_MAX) {
+    return UVTLS_EINVAL;
   }
 
-  if (uvtls_ring_buf_size(&tls->outgoing) - start_size > 0) {
-    uv_write_t* req = (uv_write_t*) malloc(sizeof(uv_write_t));
-    if (!req) {
-      return UV_ENOMEM;
-    }
-    req->data = tls;
-
-    return do_write(
-        req, tls, start_pos, start_size, &tls->commit_pos, on_handshake_write);
+  /* Only validate the encoding; the response is stapled as is */
+  ocsp = d2i_OCSP_RESPONSE(NULL, &pos, (long) length);
+  if (ocsp == NULL) {
+    return UVTLS_EINVAL;
+  }
+  OCSP_RESPONSE_free(ocsp);
+  if (pos != (const unsigned char*) der + length) {
+    return UVTLS_EINVAL;
   }
 
+  *response = (uvtls_ocsp_response_t*) uvtls__malloc(
+      offsetof(uvtls_ocsp_response_t, data) + length);
+  if (!*response) {
+    return UV_ENOMEM;
+  }
+  (*response)->length = length;
+  memcpy((*response)->data, der, length);
   return 0;
 }
 
-typedef enum { MATCH, NO_MATCH, BAD_CERT, NO_SAN_PRESENT } match_t;
+static int ocsp_response_load_file(const char* path,
+                                   uvtls_ocsp_response_t** response) {
+  int rc;
+  long length;
+  char* der;
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return uv_translate_sys_error(errno);
+  }
 
-static match_t match_san(X509* peer_cert, const char* hostname) {
-  int i;
-  match_t result = NO_MATCH;
-  STACK_OF(GENERAL_NAME)* names = (STACK_OF(GENERAL_NAME)*) (X509_get_ext_d2i(
-      peer_cert, NID_subject_alt_name, NULL, NULL));
-  if (names == NULL) {
-    return NO_SAN_PRESENT;
+  if (fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) < 0 ||
+      fseek(file, 0, SEEK_SET) != 0) {
+    fclose(file);
+    return UVTLS_EINVAL;
   }
 
-  for (i = 0; i < sk_GENERAL_NAME_num(names); ++i) {
-    GENERAL_NAME* name = sk_GENERAL_NAME_value(names, i);
+  der = (char*) uvtls__malloc(length > 0 ? (size_t) length : 1);
+  if (!der) {
+    fclose(file);
+    return UV_ENOMEM;
+  }
 
-    if (name->type == GEN_DNS) {
-      const char* common_name;
-      ASN1_STRING* str = name->d.dNSName;
-      if (str == NULL) {
-        result = BAD_CERT;
-        break;
-      }
+  if (fread(der, 1, (size_t) length, file) != (size_t) length) {
+    rc = UVTLS_EINVAL;
+  } else {
+    rc = ocsp_response_create(der, (size_t) length, response);
+  }
 
-      common_name = (const char*) (ASN1_STRING_get0_data(str));
-      if (strlen(common_name) != (size_t)(ASN1_STRING_length(str))) {
-        result = BAD_CERT;
-        break;
-      }
+  uvtls__free(der);
+  fclose(file);
+  return rc;
+}
 
-      if (Curl_cert_hostcheck(common_name, hostname) == CURL_HOST_MATCH) {
-        result = MATCH;
-        break;
-      }
+static int on_ocsp_status(SSL* ssl, void* arg) {
+  int result = SSL_TLSEXT_ERR_NOACK;
+  uvtls_context_ex_t* ex = (uvtls_context_ex_t*) arg;
+  uvtls_ocsp_response_t* response =
+      (uvtls_ocsp_response_t*) uvtls_snapshot_acquire(&ex->ocsp_response);
+
+  if (response) {
+    /* OpenSSL takes ownership of the stapled copy */
+    unsigned char* copy = (unsigned char*) OPENSSL_malloc(response->length);
+    if (copy) {
+      memcpy(copy, response->data, response->length);
+      SSL_set_tlsext_status_ocsp_resp(ssl, copy, (long) response->length);
+      result = SSL_TLSEXT_ERR_OK;
     }
   }
-  sk_GENERAL_NAME_pop_free(names, GENERAL_NAME_free);
 
+  uvtls_snapshot_release(&ex->ocsp_response);
   return result;
 }
 
-static match_t match_common_name(X509* peer_cert, const char* hostname) {
-  int i = -1;
-  X509_NAME* name = X509_get_subject_name(peer_cert);
-  if (name == NULL) {
-    return BAD_CERT;
+static char ascii_tolower(char c) {
+  return c >= 'A' && c <= 'Z' ? (char) (c - 'A' + 'a') : c;
+}
+
+static int on_servername(SSL* ssl, int* alert, void* arg) {
+  char key[256];
+  size_t i, length;
+  SSL_CTX* sni_ssl_ctx;
+  const char* dot;
+  uvtls_context_ex_t* ex = (uvtls_context_ex_t*) arg;
+  const char* hostname = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+  if (!hostname || (length = strlen(hostname)) >= sizeof(key)) {
+    return SSL_TLSEXT_ERR_OK; /* Use the default context */
   }
 
-  while ((i = X509_NAME_get_index_by_NID(name, NID_commonName, i)) >= 0) {
-    ASN1_STRING* str;
-    const char* common_name;
-    X509_NAME_ENTRY* name_entry = X509_NAME_get_entry(name, i);
-    if (name_entry == NULL) {
-      return BAD_CERT;
-    }
+  for (i = 0; i < length; ++i) {
+    key[i] = ascii_tolower(hostname[i]);
+  }
 
-    str = X509_NAME_ENTRY_get_data(name_entry);
-    if (str == NULL) {
-      return BAD_CERT;
-    }
+  sni_ssl_ctx =
+      (SSL_CTX*) uvtls_hash_table_get(&ex->sni_contexts, key, length);
 
-    common_name = (const char*) (ASN1_STRING_get0_data(str));
-    if (strlen(common_name) != (size_t)(ASN1_STRING_length(str))) {
-      return BAD_CERT;
-    }
+  /* Fallback to a wildcard for the first label e.g. "*.example.com" */
+  if (!sni_ssl_ctx && (dot = (const char*) memchr(key, '.', length)) &&
+      dot != key) {
+    size_t start = (size_t) (dot - key) - 1;
+    key[start] = '*';
+    sni_ssl_ctx = (SSL_CTX*) uvtls_hash_table_get(
+        &ex->sni_contexts, key + start, length - start);
+  }
 
-    if (Curl_cert_hostcheck(common_name, hostname) == CURL_HOST_MATCH) {
-      return MATCH;
-    }
+  if (sni_ssl_ctx) {
+    SSL_set_SSL_CTX(ssl, sni_ssl_ctx);
   }
 
-  return NO_MATCH;
+  return SSL_TLSEXT_ERR_OK;
 }
 
-static match_t match(X509* peer_cert, const char* hostname) {
-  match_t result = match_san(peer_cert, hostname);
-  if (result == NO_SAN_PRESENT) {
-    result = match_common_name(peer_cert, hostname);
-  }
-  return result;
+static int ocsp_response_load(const char* path, void** loaded) {
+  uvtls_ocsp_response_t* response;
+  int rc = ocsp_response_load_file(path, &response);
+  *loaded = response;
+  return rc;
 }
 
-static int verify(uvtls_t* tls) {
-  int result = UVTLS_UNKNOWN;
-  uvtls_session_t* session;
-  X509* peer_cert;
-  int verify_flags = tls->context->verify_flags;
-  if (!verify_flags) {
-    return 0;
+static int crl_issuer_key(X509_NAME* issuer, unsigned char* key) {
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int length;
+  if (!X509_NAME_digest(issuer, EVP_sha1(), md, &length)) {
+    return UV_ENOMEM;
   }
+  memcpy(key, md, UVTLS_CRL_ISSUER_SIZE);
+  return 0;
+}
 
-  session = (uvtls_session_t*) tls->impl;
-
-  peer_cert = SSL_get_peer_certificate(session->ssl);
-  if (peer_cert == NULL) {
-    result = UVTLS_ENOPEERCERT;
-    goto error;
+/* Index the certificates revoked by PEM encoded CRLs */
+static int crl_index_create(const char* crl,
+                            size_t length,
+                            uvtls_crl_index_t** index) {
+  int rc = 0;
+  int ncrls = 0;
+  X509_CRL* x509_crl;
+  uvtls_crl_entry_t* entries = NULL;
+  size_t count = 0, capacity = 0;
+  BIO* bio;
+  if (length > INT_MAX) {
+    return UVTLS_EINVAL;
   }
 
-  if (verify_flags & UVTLS_VERIFY_PEER_CERT) {
-    long rc = SSL_get_verify_result(session->ssl);
-    if (rc != X509_V_OK) {
-      result = UVTLS_EBADPEERCERT;
-      goto error;
-    }
+  bio = BIO_new_mem_buf(crl, (int) length);
+  if (bio == NULL) {
+    return UV_ENOMEM;
   }
 
-  if (verify_flags & UVTLS_VERIFY_PEER_IDENT) {
-    switch (match(peer_cert, tls->hostname)) {
-      case MATCH:
-        /* Success */
-        break;
-      case NO_MATCH:
-        result = UVTLS_EBADPEERIDENT;
-        goto error;
-      case BAD_CERT:
-        result = UVTLS_EBADPEERCERT;
-        goto error;
-      default:
-        result = UVTLS_UNKNOWN;
-        goto error;
+  while (rc == 0 &&
+         (x509_crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL)) != NULL) {
+    STACK_OF(X509_REVOKED)* revoked = X509_CRL_get_REVOKED(x509_crl);
+    unsigned char issuer[UVTLS_CRL_ISSUER_SIZE];
+    int i, n = revoked ? sk_X509_REVOKED_num(revoked) : 0;
+
+    rc = crl_issuer_key(X509_CRL_get_issuer(x509_crl), issuer);
+    for (i = 0; rc == 0 && i < n; ++i) {
+      const ASN1_INTEGER* serial =
+          X509_REVOKED_get0_serialNumber(sk_X509_REVOKED_value(revoked, i));
+      if (count == capacity) {
+        uvtls_crl_entry_t* grown;
+        capacity = capacity > 0 ? 2 * capacity : 64;
+        grown = (uvtls_crl_entry_t*) uvtls__realloc(
+            entries, capacity * sizeof(uvtls_crl_entry_t));
+        if (!grown) {
+          rc = UV_ENOMEM;
+          break;
+        }
+        entries = grown;
+      }
+      rc = uvtls_crl_entry_init(&entries[count++],
+                                issuer,
+                                ASN1_STRING_get0_data(serial),
+                                (size_t) ASN1_STRING_length(serial));
     }
+
+    X509_CRL_free(x509_crl);
+    ncrls++;
   }
 
-  X509_free(peer_cert);
-  return 0;
+  BIO_free_all(bio);
 
-error:
-  X509_free(peer_cert);
-  return result;
+  if (rc == 0 && ncrls == 0) {
+    rc = UVTLS_EINVAL;
+  }
+  if (rc != 0) {
+    uvtls__free(entries);
+    return rc;
+  }
+
+  *index = uvtls_crl_index_create(entries, count);
+  return *index ? 0 : UV_ENOMEM;
 }
 
-static void on_alloc(uv_handle_t* handle,
-                     size_t suggested_size,
-                     uv_buf_t* buf) {
-  uvtls_t* tls = (uvtls_t*) handle->data;
-  buf->len = (size_t) uvtls_ring_buf_tail_block(
-      &tls->incoming, &buf->base, (int) suggested_size);
+static int crl_index_load(const char* path, void** loaded) {
+  uvtls_crl_index_t* index;
+  int rc = uvtls_crl_index_load(path, &index);
+  *loaded = index;
+  return rc;
 }
 
-static void on_handshake_write(uv_write_t* req, int status) {
-  uvtls_t* tls = (uvtls_t*) req->data;
-  uvtls_ring_buf_head_blocks_commit(&tls->outgoing, tls->commit_pos);
-  free(req);
+static int is_cert_revoked(X509* cert, const uvtls_crl_index_t* index) {
+  uvtls_crl_entry_t entry;
+  unsigned char issuer[UVTLS_CRL_ISSUER_SIZE];
+  const ASN1_INTEGER* serial = X509_get0_serialNumber(cert);
+
+  if (crl_issuer_key(X509_get_issuer_name(cert), issuer) != 0) {
+    return 1; /* Fail closed */
+  }
+  if (uvtls_crl_entry_init(&entry,
+                           issuer,
+                           ASN1_STRING_get0_data(serial),
+                           (size_t) ASN1_STRING_length(serial)) != 0) {
+    return 0; /* Too long to be in the index */
+  }
+  return uvtls_crl_index_contains(index, &entry);
+}
+
+/* Whether the peer's certificate or its chain is revoked */
+static int is_revoked(SSL* ssl,
+                      X509* peer_cert,
+                      const uvtls_crl_index_t* index) {
+  STACK_OF(X509)* chain = SSL_get_peer_cert_chain(ssl);
+  int i, n = chain ? sk_X509_num(chain) : 0;
+
+  if (is_cert_revoked(peer_cert, index)) {
+    return 1;
+  }
+  for (i = 0; i < n; ++i) {
+    if (is_cert_revoked(sk_X509_value(chain, i), index)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void file_watcher_unref(uvtls_file_watcher_t* watcher) {
+  if (--watcher->refs == 0) {
+    SSL_CTX_free(watcher->ssl_ctx);
+    uvtls__free(watcher);
+  }
+}
+
+static void on_file_watcher_load(uv_work_t* work) {
+  uvtls_file_watcher_t* watcher = (uvtls_file_watcher_t*) work->data;
+  if (watcher->load(watcher->path, &watcher->loaded) != 0) {
+    watcher->loaded = NULL; /* Keep using the current data */
+  }
+}
+
+static void on_file_watcher_after_load(uv_work_t* work, int status) {
+  uvtls_file_watcher_t* watcher = (uvtls_file_watcher_t*) work->data;
+  watcher->is_work_pending = 0;
+  if (watcher->loaded) {
+    if (uv_is_closing((uv_handle_t*) &watcher->poll)) {
+      watcher->snapshot->free_cb(watcher->loaded);
+    } else {
+      uvtls_snapshot_publish(watcher->snapshot, watcher->loaded);
+    }
+    watcher->loaded = NULL;
+  }
+  file_watcher_unref(watcher);
+}
+
+static void on_file_watcher_poll(uv_fs_poll_t* handle,
+                                 int status,
+                                 const uv_stat_t* prev,
+                                 const uv_stat_t* curr) {
+  uvtls_file_watcher_t* watcher = (uvtls_file_watcher_t*) handle->data;
+  if (status != 0 || watcher->is_work_pending) {
+    return;
+  }
+  if (uv_queue_work(handle->loop,
+                    &watcher->work,
+                    on_file_watcher_load,
+                    on_file_watcher_after_load) == 0) {
+    watcher->is_work_pending = 1;
+    watcher->refs++;
+  }
+}
+
+static void on_file_watcher_close(uv_handle_t* handle) {
+  file_watcher_unref((uvtls_file_watcher_t*) handle->data);
+}
+
+/*
+ * Poll a file and reload it on the threadpool when it changes, publishing it
+ * to `snapshot` (which is part of the state of `ssl_ctx`).
+ */
+static int file_watcher_start(uvtls_file_watcher_t** watcher_out,
+                              SSL_CTX* ssl_ctx,
+                              uvtls_snapshot_t* snapshot,
+                              uvtls_file_load_cb load,
+                              uv_loop_t* loop,
+                              const char* path,
+                              unsigned int interval) {
+  int rc;
+  size_t length = strlen(path);
+  uvtls_file_watcher_t* watcher = (uvtls_file_watcher_t*) uvtls__malloc(
+      offsetof(uvtls_file_watcher_t, path) + length + 1);
+  if (!watcher) {
+    return UV_ENOMEM;
+  }
+
+  memcpy(watcher->path, path, length + 1);
+  watcher->snapshot = snapshot;
+  watcher->load = load;
+  watcher->loaded = NULL;
+  watcher->refs = 1;
+  watcher->is_work_pending = 0;
+  watcher->work.data = watcher;
+
+  rc = uv_fs_poll_init(loop, &watcher->poll);
+  if (rc != 0) {
+    uvtls__free(watcher);
+    return rc;
+  }
+  watcher->poll.data = watcher;
+
+  SSL_CTX_up_ref(ssl_ctx);
+  watcher->ssl_ctx = ssl_ctx;
+
+  rc = uv_fs_poll_start(
+      &watcher->poll, on_file_watcher_poll, watcher->path, interval);
+  if (rc != 0) {
+    uv_close((uv_handle_t*) &watcher->poll, on_file_watcher_close);
+    return rc;
+  }
+
+  *watcher_out = watcher;
+  return 0;
+}
+
+static void file_watcher_stop(uvtls_file_watcher_t** watcher) {
+  if (*watcher) {
+    uv_close((uv_handle_t*) &(*watcher)->poll, on_file_watcher_close);
+    *watcher = NULL;
+  }
+}
+
+typedef struct uvtls_session_s uvtls_session_t;
+
+struct uvtls_session_s {
+  SSL_CTX* ssl_ctx; /* The initial context, even if switched by SNI */
+  SSL* ssl;
+  BIO* incoming_bio;
+  BIO* outgoing_bio;
+  uvtls_ring_buf_pos_t write_pos; /* End of the data submitted to the stream */
+  uvtls_ring_buf_pos_t handshake_commit_pos;
+  unsigned int writes_count; /* Write requests in flight */
+  size_t hostname_length;
+  int hostname_is_ip;
+  int is_chain_cached;                /* Verified using the verify cache */
+  uvtls_verify_cache_t* verify_cache; /* Add the chain to once verified */
+  long chain_generation;
+  time_t chain_expires;
+  unsigned char chain_key[UVTLS_VERIFY_CACHE_KEY_SIZE];
+  struct uvtls_verify_work_s* verify_work; /* Running verify callback */
+  uvtls_context_ex_t* trace_ex; /* Set if the handshake is traced */
+  unsigned long error;          /* The TLS library's, see error_record() */
+  int ssl_error;
+  uvtls_stats_t stats;
+  uv_write_t handshake_req;
+  void* write_queue[2];           /* Writes waiting for the handshake */
+  void* flush_queue[2];           /* Encrypted, waiting to be written */
+  void* handshake_write_queue[2]; /* Sent with the handshake write request */
+  size_t offload_min_size;        /* Smallest write encrypted off the loop */
+  uv_work_t offload_req;
+  uvtls_write_t* offload_write;
+  uvtls_ring_buf_t offload_outgoing; /* Appended to the outgoing ring buffer */
+  void* offload_queue[2];            /* Writes waiting for the offload */
+  ssize_t offload_read_status;       /* Read error deferred by the offload */
+  int offload_ssl_error;             /* The offloaded write's SSL error */
+  unsigned long offload_error; /* Its TLS library error, from the worker */
+};
+
+static void trace(uvtls_t* tls,
+                  uvtls_trace_type_t type,
+                  uvtls_trace_direction_t direction,
+                  int code) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  uvtls_context_ex_t* ex = session->trace_ex;
+  uvtls_trace_event_t event;
+
+  if (!ex) {
+    return;
+  }
+
+  event.data = ex->trace_cb_data;
+  event.tls = tls;
+  event.time = uv_hrtime();
+  event.type = type;
+  event.direction = direction;
+  event.state = SSL_state_string(session->ssl);
+  event.message = type == UVTLS_TRACE_MESSAGE ? code : 0;
+  event.alert = type == UVTLS_TRACE_ALERT ? code : 0;
+  event.status = type == UVTLS_TRACE_DONE ? code : 0;
+  ex->trace_cb(&event);
+}
+
+static void on_trace_info(const SSL* ssl, int where, int ret) {
+  uvtls_t* tls = (uvtls_t*) SSL_get_app_data(ssl);
+  if (where & SSL_CB_ALERT) {
+    trace(tls,
+          UVTLS_TRACE_ALERT,
+          (where & SSL_CB_READ) ? UVTLS_TRACE_IN : UVTLS_TRACE_OUT,
+          ret);
+  } else if (where & SSL_CB_LOOP) {
+    trace(tls, UVTLS_TRACE_STATE, UVTLS_TRACE_NONE, 0);
+  }
+}
+
+/* Decide whether to trace a handshake that's about to start */
+static void trace_sample(uvtls_t* tls, uvtls_context_ex_t* ex) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  long count;
+
+  if (!ex->trace_cb || ex->trace_sample_rate == 0) {
+    return;
+  }
+
+  count = uvtls_atomic_add(&ex->trace_count, 1) - 1;
+  if ((unsigned long) count % ex->trace_sample_rate != 0) {
+    return;
+  }
+
+  session->trace_ex = ex;
+  SSL_set_info_callback(session->ssl, on_trace_info);
+}
+
+/* Count records, the TLS library reports each record's header. Handshake
+ * messages are traced. */
+static void on_msg(int write_p,
+                   int version,
+                   int content_type,
+                   const void* buf,
+                   size_t len,
+                   SSL* ssl,
+                   void* arg) {
+  uvtls_t* tls;
+  if (content_type == SSL3_RT_HEADER) {
+    tls = (uvtls_t*) SSL_get_app_data(ssl);
+    if (write_p) {
+      ((uvtls_session_t*) tls->impl)->stats.records_out++;
+    } else {
+      ((uvtls_session_t*) tls->impl)->stats.records_in++;
+    }
+  } else if (content_type == SSL3_RT_HANDSHAKE && len > 0) {
+    tls = (uvtls_t*) SSL_get_app_data(ssl);
+    trace(tls,
+          UVTLS_TRACE_MESSAGE,
+          write_p ? UVTLS_TRACE_OUT : UVTLS_TRACE_IN,
+          ((const unsigned char*) buf)[0]);
+  }
+}
+
+static uvtls_session_t* uvtls_session_create(uvtls_loop_t* tls_loop,
+                                             SSL_CTX* ssl_ctx,
+                                             uvtls_ring_buf_t* incoming,
+                                             uvtls_ring_buf_t* outgoing) {
+  uvtls_session_t* session;
+
+  if (tls_loop) {
+    session = (uvtls_session_t*) uvtls_slab_alloc(&tls_loop->session_slab);
+  } else {
+    session = (uvtls_session_t*) uvtls__malloc(sizeof(uvtls_session_t));
+  }
+  if (!session) {
+    return NULL;
+  }
+
+  SSL_CTX_up_ref(ssl_ctx);
+
+  session->ssl_ctx = ssl_ctx;
+  session->ssl = SSL_new(ssl_ctx);
+  session->incoming_bio = create_bio(incoming);
+  session->outgoing_bio = create_bio(outgoing);
+  session->write_pos = outgoing->tail;
+  session->handshake_commit_pos = outgoing->tail;
+  session->writes_count = 0;
+  session->hostname_length = 0;
+  session->hostname_is_ip = 0;
+  session->is_chain_cached = 0;
+  session->verify_cache = NULL;
+  session->verify_work = NULL;
+  session->trace_ex = NULL;
+  session->error = 0;
+  session->ssl_error = SSL_ERROR_NONE;
+  memset(&session->stats, 0, sizeof(session->stats));
+  QUEUE_INIT(&session->write_queue);
+  QUEUE_INIT(&session->flush_queue);
+  QUEUE_INIT(&session->handshake_write_queue);
+  session->offload_min_size = 0;
+  session->offload_write = NULL;
+  QUEUE_INIT(&session->offload_queue);
+  session->offload_read_status = 0;
+  session->offload_ssl_error = SSL_ERROR_NONE;
+  session->offload_error = 0;
+
+  SSL_set_bio(session->ssl, session->incoming_bio, session->outgoing_bio);
+  SSL_set_msg_callback(session->ssl, on_msg);
+
+  return session;
+}
+
+static void on_handshake_write(uv_write_t* req, int status);
+
+static void error_get(const uvtls_session_t* session, uvtls_error_t* error) {
+  error->code = session->error;
+  error->library = ERR_GET_LIB(session->error);
+  error->reason = ERR_GET_REASON(session->error);
+  error->ssl_error = session->ssl_error;
+}
+
+/* Limit the error log callback to a number of calls per second, shared by
+ * the context's connections on all threads */
+static int error_log_admit(uvtls_context_ex_t* ex, unsigned long* suppressed) {
+  long second;
+  long count;
+
+  if (ex->error_log_max != 0) {
+    second = (long) (uv_hrtime() / 1000000000);
+    if (uvtls_atomic_load(&ex->error_log_second) != second) {
+      /* Threads racing to start a second may let a few more through */
+      uvtls_atomic_store_relaxed(&ex->error_log_second, second);
+      uvtls_atomic_store_relaxed(&ex->error_log_count, 0);
+    }
+    count = uvtls_atomic_add(&ex->error_log_count, 1);
+    if (count > (long) ex->error_log_max) {
+      uvtls_atomic_add(&ex->error_log_suppressed, 1);
+      return 0;
+    }
+  }
+
+  count = uvtls_atomic_load(&ex->error_log_suppressed);
+  uvtls_atomic_add(&ex->error_log_suppressed, -count);
+  *suppressed = (unsigned long) count;
+  return 1;
+}
+
+/* Keep the TLS library's error as a code. Formatting it is left to the log
+ * callback (if any), it's too slow for a storm of failing handshakes. */
+static void error_record_code(uvtls_t* tls,
+                              unsigned long code,
+                              int ssl_error) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  uvtls_context_ex_t* ex;
+  uvtls_error_t error;
+  unsigned long suppressed;
+
+  session->error = code;
+  session->ssl_error = ssl_error;
+  ERR_clear_error();
+
+  ex = (uvtls_context_ex_t*) SSL_CTX_get_ex_data(session->ssl_ctx,
+                                                 context_ex_index__);
+  if (!ex->error_log_cb || !error_log_admit(ex, &suppressed)) {
+    return;
+  }
+  error_get(session, &error);
+  ex->error_log_cb(tls, &error, suppressed, ex->error_log_cb_data);
+}
+
+static void error_record(uvtls_t* tls, int ssl_error) {
+  /* The first is the root cause */
+  error_record_code(tls, ERR_get_error(), ssl_error);
+}
+
+static int has_unwritten(uvtls_t* tls) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  return session->write_pos.block != tls->outgoing.tail.block ||
+         session->write_pos.index != tls->outgoing.tail.index;
+}
+
+/*
+ * Submit all the outgoing data that hasn't been handed to the stream yet
+ * (everything after the session's write position) as a single write.
+ */
+static int do_write(uv_write_t* req,
+                    uvtls_t* tls,
+                    uvtls_ring_buf_pos_t* commit_pos,
+                    uv_write_cb cb) {
+  uv_buf_t stack_bufs[UVTLS_STACK_BUFS_COUNT];
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+
+  int rc;
+  uv_buf_t* bufs;
+  uvtls_ring_buf_pos_t pos;
+
+  int bufs_count =
+      uvtls_ring_buf_head_blocks_count(&tls->outgoing, session->write_pos);
+  if (bufs_count > UVTLS_STACK_BUFS_COUNT) {
+    bufs = (uv_buf_t*) uvtls__malloc(sizeof(uv_buf_t) *
+                                     (unsigned int) bufs_count);
+    if (!bufs) {
+      return UV_ENOMEM;
+    }
+  } else {
+    bufs_count = UVTLS_STACK_BUFS_COUNT;
+    bufs = stack_bufs;
+  }
+
+  pos = uvtls_ring_buf_head_blocks(
+      &tls->outgoing, session->write_pos, bufs, &bufs_count);
+  rc = uv_write(
+      req, (uv_stream_t*) tls->stream, bufs, (unsigned int) bufs_count, cb);
+  if (rc == 0) {
+    int i;
+    *commit_pos = session->write_pos = pos;
+    session->writes_count++;
+    session->stats.write_calls++;
+    for (i = 0; i < bufs_count; ++i) {
+      session->stats.ciphertext_bytes_out += bufs[i].len;
+    }
+    if ((size_t) uvtls_ring_buf_size(&tls->outgoing) >
+        session->stats.max_outgoing_size) {
+      session->stats.max_outgoing_size =
+          (size_t) uvtls_ring_buf_size(&tls->outgoing);
+    }
+  }
+
+  if (bufs != stack_bufs) {
+    uvtls__free(bufs);
+  }
+
+  return rc;
+}
+
+/*
+ * Write pending handshake output using the session's handshake write request.
+ * Output produced while that request is in flight is coalesced and flushed
+ * when it completes.
+ */
+static int handshake_flush(uvtls_t* tls) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  int rc;
+
+  if ((tls->flags & UVTLS_FLAG_HANDSHAKE_WRITE) || !has_unwritten(tls)) {
+    return 0;
+  }
+
+  session->handshake_req.data = tls;
+  rc = do_write(&session->handshake_req,
+                tls,
+                &session->handshake_commit_pos,
+                on_handshake_write);
+  if (rc == 0) {
+    tls->flags |= UVTLS_FLAG_HANDSHAKE_WRITE;
+    QUEUE_ADD(&session->handshake_write_queue, &session->flush_queue);
+    QUEUE_INIT(&session->flush_queue);
+  }
+  return rc;
+}
+
+/* Keep a copy of the buffers (not the data) for writes that are deferred */
+static int write_req_copy_bufs(uvtls_write_t* req,
+                               const uv_buf_t bufs[],
+                               unsigned int nbufs) {
+  req->bufs = req->bufsml;
+  if (nbufs > ARRAY_SIZE(req->bufsml)) {
+    req->bufs = (uv_buf_t*) uvtls__malloc(sizeof(uv_buf_t) * nbufs);
+    if (!req->bufs) {
+      return UV_ENOMEM;
+    }
+  }
+  memcpy(req->bufs, bufs, sizeof(uv_buf_t) * nbufs);
+  req->nbufs = nbufs;
+  return 0;
+}
+
+static void write_req_release_bufs(uvtls_write_t* req) {
+  if (req->bufs != req->bufsml) {
+    uvtls__free(req->bufs);
+  }
+  req->bufs = NULL;
+}
+
+static void write_queue_complete(QUEUE* queue, int status) {
+  QUEUE completed;
+  QUEUE_MOVE(queue, &completed);
+
+  while (!QUEUE_EMPTY(&completed)) {
+    QUEUE* q = QUEUE_HEAD(&completed);
+    uvtls_write_t* req = QUEUE_DATA(q, uvtls_write_t, queue);
+    QUEUE_REMOVE(q);
+    write_req_release_bufs(req);
+    req->cb(req, status);
+  }
+}
+
+/* Encrypt into the outgoing BIO, returns the SSL_get_error() kind on error */
+static int ssl_write_bufs(SSL* ssl,
+                          const uv_buf_t bufs[],
+                          unsigned int nbufs) {
+  unsigned int i;
+  for (i = 0; i < nbufs; ++i) {
+    if (bufs[i].len > 0) {
+      int rc = SSL_write(ssl, bufs[i].base, (int) bufs[i].len);
+      if (rc <= 0) {
+        return SSL_get_error(ssl, rc);
+      }
+    }
+  }
+  return SSL_ERROR_NONE;
+}
+
+/*
+ * The status of a failed ssl_write_bufs(). The ring buffer BIO only fails
+ * when a block can't be allocated, which is reported as a syscall error.
+ */
+static int write_error_code(uvtls_t* tls, unsigned long code, int ssl_error) {
+  error_record_code(tls, code, ssl_error);
+  return ssl_error == SSL_ERROR_SYSCALL ? UV_ENOMEM : UVTLS_UNKNOWN;
+}
+
+static int write_error(uvtls_t* tls, int ssl_error) {
+  return write_error_code(tls, ERR_get_error(), ssl_error);
+}
+
+/*
+ * Encrypt the writes queued during the handshake so that they're sent with
+ * any handshake output that's still pending. That's only the case when this
+ * side sends the final flight, e.g. a client's Finished on TLS 1.3 or a
+ * resumed TLS 1.2 handshake. On a full TLS 1.2 handshake the client's
+ * Finished is sent before the server's, so its data goes out in its own
+ * write once the handshake completes.
+ */
+static int write_queue_encrypt(uvtls_t* tls) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  int ssl_error = SSL_ERROR_NONE;
+  QUEUE* q;
+
+  QUEUE_FOREACH(q, &session->write_queue) {
+    uvtls_write_t* req = QUEUE_DATA(q, uvtls_write_t, queue);
+    ssl_error = ssl_write_bufs(session->ssl, req->bufs, req->nbufs);
+    if (ssl_error != SSL_ERROR_NONE) {
+      break;
+    }
+  }
+
+  QUEUE_ADD(&session->flush_queue, &session->write_queue);
+  QUEUE_INIT(&session->write_queue);
+  return ssl_error != SSL_ERROR_NONE ? write_error(tls, ssl_error) : 0;
+}
+
+static int is_handshake_complete(SSL* ssl) {
+#ifdef SSL_MODE_ENABLE_FALSE_START
+  if (SSL_in_false_start(ssl)) {
+    return 1;
+  }
+#endif
+  return SSL_is_init_finished(ssl);
+}
+
+static int do_handshake(uvtls_t* tls) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+
+  int rc = SSL_do_handshake(session->ssl);
+  if (rc <= 0) {
+    int err = SSL_get_error(session->ssl, rc);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_NONE) {
+      error_record(tls, err);
+      return UVTLS_EHANDSHAKE;
+    }
+  }
+
+  return 0;
+}
+
+typedef enum { MATCH, NO_MATCH, BAD_CERT, NO_SAN_PRESENT } match_t;
+
+/* The hostname is lowercase, see uvtls_set_hostname() */
+typedef struct {
+  const char* name;
+  size_t length;
+  int is_ip;
+} hostname_t;
+
+static match_t match_name(ASN1_STRING* str, const hostname_t* hostname) {
+  const char* name = (const char*) ASN1_STRING_get0_data(str);
+  int length = ASN1_STRING_length(str);
+  if (length < 0 || memchr(name, '\0', (size_t) length) != NULL) {
+    return BAD_CERT;
+  }
+  return Curl_cert_hostcheck(name,
+                             (size_t) length,
+                             hostname->name,
+                             hostname->length,
+                             hostname->is_ip)
+             ? MATCH
+             : NO_MATCH;
+}
+
+static match_t match_san(X509* peer_cert, const hostname_t* hostname) {
+  int i;
+  match_t result = NO_MATCH;
+  STACK_OF(GENERAL_NAME)* names = (STACK_OF(GENERAL_NAME)*) (X509_get_ext_d2i(
+      peer_cert, NID_subject_alt_name, NULL, NULL));
+  if (names == NULL) {
+    return NO_SAN_PRESENT;
+  }
+
+  for (i = 0; i < sk_GENERAL_NAME_num(names); ++i) {
+    GENERAL_NAME* name = sk_GENERAL_NAME_value(names, i);
+
+    if (name->type == GEN_DNS) {
+      ASN1_STRING* str = name->d.dNSName;
+      if (str == NULL) {
+        result = BAD_CERT;
+        break;
+      }
+
+      result = match_name(str, hostname);
+      if (result != NO_MATCH) {
+        break;
+      }
+    }
+  }
+  sk_GENERAL_NAME_pop_free(names, GENERAL_NAME_free);
+
+  return result;
+}
+
+static match_t match_common_name(X509* peer_cert,
+                                 const hostname_t* hostname) {
+  int i = -1;
+  X509_NAME* name = X509_get_subject_name(peer_cert);
+  if (name == NULL) {
+    return BAD_CERT;
+  }
+
+  while ((i = X509_NAME_get_index_by_NID(name, NID_commonName, i)) >= 0) {
+    ASN1_STRING* str;
+    match_t result;
+    X509_NAME_ENTRY* name_entry = X509_NAME_get_entry(name, i);
+    if (name_entry == NULL) {
+      return BAD_CERT;
+    }
+
+    str = X509_NAME_ENTRY_get_data(name_entry);
+    if (str == NULL) {
+      return BAD_CERT;
+    }
+
+    result = match_name(str, hostname);
+    if (result != NO_MATCH) {
+      return result;
+    }
+  }
+
+  return NO_MATCH;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+/* Digest a length, so that the key's components are framed */
+static int digest_length(EVP_MD_CTX* md_ctx, size_t length) {
+  unsigned char bytes[4];
+  bytes[0] = (unsigned char) (length >> 24);
+  bytes[1] = (unsigned char) (length >> 16);
+  bytes[2] = (unsigned char) (length >> 8);
+  bytes[3] = (unsigned char) length;
+  return EVP_DigestUpdate(md_ctx, bytes, sizeof(bytes));
+}
+
+/* Digest a certificate's SHA-256 fingerprint, covering all of its DER */
+static int digest_cert(EVP_MD_CTX* md_ctx, X509* cert) {
+  unsigned char fingerprint[EVP_MAX_MD_SIZE];
+  unsigned int length;
+  return X509_digest(cert, EVP_sha256(), fingerprint, &length) &&
+         digest_length(md_ctx, length) &&
+         EVP_DigestUpdate(md_ctx, fingerprint, length);
+}
+
+/*
+ * Digest the peer's chain and the hostname it's verified for. A hit skips
+ * both chain and identity verification, so the key uses a collision
+ * resistant fingerprint of each certificate and each component is prefixed
+ * by its length (and the chain by its count).
+ */
+static int chain_key(X509_STORE_CTX* store_ctx,
+                     const uvtls_t* tls,
+                     unsigned char* key) {
+  STACK_OF(X509)* chain = X509_STORE_CTX_get0_untrusted(store_ctx);
+  int count = chain ? sk_X509_num(chain) : 0;
+  size_t hostname_length = tls->hostname ? strlen(tls->hostname) : 0;
+  int i;
+  int ok;
+  EVP_MD_CTX* md_ctx = EVP_MD_CTX_new();
+  if (!md_ctx) {
+    return 0;
+  }
+
+  ok = EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL) &&
+       digest_cert(md_ctx, X509_STORE_CTX_get0_cert(store_ctx)) &&
+       digest_length(md_ctx, (size_t) count);
+  for (i = 0; ok && i < count; ++i) {
+    ok = digest_cert(md_ctx, sk_X509_value(chain, i));
+  }
+  ok = ok && digest_length(md_ctx, hostname_length) &&
+       EVP_DigestUpdate(md_ctx, tls->hostname, hostname_length) &&
+       EVP_DigestFinal_ex(md_ctx, key, NULL);
+
+  EVP_MD_CTX_free(md_ctx);
+  return ok;
+}
+
+/* The earliest expiry of the verified chain's certificates */
+static time_t chain_expires(X509_STORE_CTX* store_ctx) {
+  STACK_OF(X509)* chain = X509_STORE_CTX_get0_chain(store_ctx);
+  time_t now = time(NULL);
+  time_t expires = 0;
+  int i;
+
+  for (i = 0; chain && i < sk_X509_num(chain); ++i) {
+    int days, seconds;
+    time_t cert_expires;
+    X509* cert = sk_X509_value(chain, i);
+    if (!ASN1_TIME_diff(&days, &seconds, NULL, X509_get0_notAfter(cert))) {
+      return now;
+    }
+    cert_expires = now + (time_t) days * 24 * 60 * 60 + seconds;
+    if (i == 0 || cert_expires < expires) {
+      expires = cert_expires;
+    }
+  }
+
+  return expires;
+}
+
+/* Replaces OpenSSL's chain verification when the verify cache is enabled */
+static int on_cert_verify(X509_STORE_CTX* store_ctx, void* arg) {
+  uvtls_context_ex_t* ex = (uvtls_context_ex_t*) arg;
+  SSL* ssl = (SSL*) X509_STORE_CTX_get_ex_data(
+      store_ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+  uvtls_t* tls = (uvtls_t*) SSL_get_app_data(ssl);
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  int rc;
+
+  session->is_chain_cached = 0;
+  session->verify_cache = NULL;
+
+  if (!chain_key(store_ctx, tls, session->chain_key)) {
+    return X509_verify_cert(store_ctx);
+  }
+
+  if (uvtls_verify_cache_get(ex->verify_cache,
+                             session->chain_key,
+                             ex->trust_generation,
+                             time(NULL))) {
+    session->is_chain_cached = 1;
+    X509_STORE_CTX_set_error(store_ctx, X509_V_OK);
+    return 1;
+  }
+
+  rc = X509_verify_cert(store_ctx);
+  if (rc > 0 && X509_STORE_CTX_get_error(store_ctx) == X509_V_OK) {
+    /* Added if the rest of verify() succeeds */
+    session->verify_cache = ex->verify_cache;
+    session->chain_generation = ex->trust_generation;
+    session->chain_expires = chain_expires(store_ctx);
+  }
+  return rc;
+}
+#endif
+
+static match_t match(X509* peer_cert, const hostname_t* hostname) {
+  match_t result = match_san(peer_cert, hostname);
+  if (result == NO_SAN_PRESENT) {
+    result = match_common_name(peer_cert, hostname);
+  }
+  return result;
+}
+
+static int verify(uvtls_t* tls) {
+  int result = UVTLS_UNKNOWN;
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  X509* peer_cert;
+  /* The context may have been destroyed, but the SSL_CTX is still alive */
+  uvtls_context_ex_t* ex = (uvtls_context_ex_t*) SSL_CTX_get_ex_data(
+      session->ssl_ctx, context_ex_index__);
+  int verify_flags = ex->verify_flags;
+  if (!verify_flags) {
+    return 0;
+  }
+
+  peer_cert = SSL_get_peer_certificate(session->ssl);
+  if (peer_cert == NULL) {
+    result = UVTLS_ENOPEERCERT;
+    goto error;
+  }
+
+  if (verify_flags & UVTLS_VERIFY_PEER_CERT) {
+    int revoked;
+    uvtls_crl_index_t* index;
+    long rc = SSL_get_verify_result(session->ssl);
+    if (rc != X509_V_OK) {
+      result = UVTLS_EBADPEERCERT;
+      goto error;
+    }
+
+    index = (uvtls_crl_index_t*) uvtls_snapshot_acquire(&ex->crl);
+    revoked = index && is_revoked(session->ssl, peer_cert, index);
+    uvtls_snapshot_release(&ex->crl);
+    if (revoked) {
+      result = UVTLS_EREVOKED;
+      goto error;
+    }
+  }
+
+  if ((verify_flags & UVTLS_VERIFY_PEER_IDENT) && !session->is_chain_cached) {
+    hostname_t hostname;
+    hostname.name = tls->hostname ? tls->hostname : "";
+    hostname.length = session->hostname_length;
+    hostname.is_ip = session->hostname_is_ip;
+    switch (match(peer_cert, &hostname)) {
+      case MATCH:
+        /* Success */
+        break;
+      case NO_MATCH:
+        result = UVTLS_EBADPEERIDENT;
+        goto error;
+      case BAD_CERT:
+        result = UVTLS_EBADPEERCERT;
+        goto error;
+      default:
+        result = UVTLS_UNKNOWN;
+        goto error;
+    }
+  }
+
+  if (session->verify_cache) {
+    uvtls_verify_cache_put(session->verify_cache,
+                           session->chain_key,
+                           session->chain_generation,
+                           session->chain_expires);
+  }
+
+  X509_free(peer_cert);
+  return 0;
+
+error:
+  X509_free(peer_cert);
+  return result;
+}
+
+static void on_alloc(uv_handle_t* handle,
+                     size_t suggested_size,
+                     uv_buf_t* buf) {
+  uvtls_t* tls = (uvtls_t*) handle->data;
+  buf->len = (size_t) uvtls_ring_buf_tail_block(
+      &tls->incoming, &buf->base, (int) suggested_size);
+}
+
+/*
+ * Release the ring buffers of an idle connection. OpenSSL releases its own
+ * buffers (SSL_MODE_RELEASE_BUFFERS).
+ */
+static void hibernate(uvtls_t* tls) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+
+  if (!(SSL_get_mode(session->ssl) & SSL_MODE_RELEASE_BUFFERS) ||
+      !(tls->flags & UVTLS_FLAG_CONNECTED) ||
+      (tls->flags & UVTLS_FLAG_WRITE_OFFLOAD)) {
+    return;
+  }
+
+  if (uvtls_ring_buf_size(&tls->incoming) == 0) {
+    uvtls_ring_buf_release(&tls->incoming);
+  }
+
+  if (uvtls_ring_buf_size(&tls->outgoing) == 0 &&
+      session->writes_count == 0 && !has_unwritten(tls)) {
+    uvtls_ring_buf_release(&tls->outgoing);
+    session->write_pos = session->handshake_commit_pos = tls->outgoing.tail;
+  }
+}
+
+static void on_handshake_write(uv_write_t* req, int status) {
+  uvtls_t* tls = (uvtls_t*) req->data;
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  QUEUE written;
+
+  QUEUE_MOVE(&session->handshake_write_queue, &written);
+  tls->flags &= ~UVTLS_FLAG_HANDSHAKE_WRITE;
+  session->writes_count--;
+  uvtls_ring_buf_head_blocks_commit(&tls->outgoing,
+                                    session->handshake_commit_pos);
+  if (status == 0 && !uv_is_closing((uv_handle_t*) tls->stream)) {
+    handshake_flush(tls);
+    hibernate(tls);
+  }
+
+  write_queue_complete(&written, status);
+}
+
+static int handshake_start(uvtls_t* tls);
+static void handshake_done(uvtls_t* tls, int status);
+static void handshake_shed(uvtls_t* tls);
+
+static void on_handshake_timer(uvtls_timer_wheel_entry_t* entry, void* data) {
+  uvtls_loop_t* tls_loop = (uvtls_loop_t*) data;
+  uvtls_t* tls = QUEUE_DATA(entry, uvtls_t, handshake_timer);
+  if (tls->flags & UVTLS_FLAG_HANDSHAKE_QUEUED) {
+    handshake_shed(tls);
+  } else {
+    tls_loop->handshake_stats.timed_out++;
+    handshake_done(tls, UV_ETIMEDOUT);
+  }
+}
+
+static void on_loop_timer(uv_timer_t* handle) {
+  uvtls_loop_t* tls_loop = (uvtls_loop_t*) handle->data;
+
+  uvtls_timer_wheel_expire(&tls_loop->timer_wheel,
+                           uv_now(tls_loop->loop),
+                           on_handshake_timer,
+                           tls_loop);
+
+  if (uvtls_timer_wheel_empty(&tls_loop->timer_wheel)) {
+    uv_timer_stop(&tls_loop->timer);
+  }
+}
+
+static void loop_timer_update_resolution(uvtls_loop_t* tls_loop) {
+  uint64_t timeout = tls_loop->handshake_timeout;
+  uint64_t resolution;
+
+  if (!uvtls_timer_wheel_empty(&tls_loop->timer_wheel)) {
+    return; /* Updated when the wheel is next used after draining */
+  }
+
+  if (timeout == 0 || (tls_loop->handshake_queue_timeout != 0 &&
+                       tls_loop->handshake_queue_timeout < timeout)) {
+    timeout = tls_loop->handshake_queue_timeout;
+  }
+
+  resolution = timeout / UVTLS_TIMER_WHEEL_TICKS_PER_TIMEOUT;
+  if (resolution == 0) {
+    resolution = 1;
+  }
+  if (resolution != tls_loop->timer_wheel.resolution) {
+    uvtls_timer_wheel_init(
+        &tls_loop->timer_wheel, resolution, uv_now(tls_loop->loop));
+  }
+}
+
+static void loop_timer_add(uvtls_t* tls, uint64_t timeout) {
+  uvtls_loop_t* tls_loop = tls->tls_loop;
+  uvtls_timer_wheel_t* wheel = &tls_loop->timer_wheel;
+
+  if (timeout == 0) {
+    return;
+  }
+
+  if (uvtls_timer_wheel_empty(wheel)) {
+    /* The timeouts may have changed while the wheel was in use */
+    loop_timer_update_resolution(tls_loop);
+    uv_timer_start(
+        &tls_loop->timer, on_loop_timer, wheel->resolution, wheel->resolution);
+  }
+  uvtls_timer_wheel_add(
+      wheel, &tls->handshake_timer, uv_now(tls_loop->loop), timeout);
+}
+
+static void loop_timer_remove(uvtls_t* tls) {
+  uvtls_loop_t* tls_loop = tls->tls_loop;
+  if (!uvtls_timer_wheel_entry_is_active(&tls->handshake_timer)) {
+    return;
+  }
+  uvtls_timer_wheel_remove(&tls_loop->timer_wheel, &tls->handshake_timer);
+  if (uvtls_timer_wheel_empty(&tls_loop->timer_wheel)) {
+    uv_timer_stop(&tls_loop->timer);
+  }
+}
+
+static void handshake_queue_remove(uvtls_t* tls) {
+  uvtls_loop_t* tls_loop = tls->tls_loop;
+  QUEUE_REMOVE(&tls->handshake_queue);
+  QUEUE_INIT(&tls->handshake_queue);
+  tls->flags &= ~UVTLS_FLAG_HANDSHAKE_QUEUED;
+  tls_loop->handshake_stats.queued--;
+}
+
+static void handshake_failed(uvtls_t* tls, int status) {
+  uvtls_metrics_handshake_failed(status);
+  trace(tls, UVTLS_TRACE_DONE, UVTLS_TRACE_NONE, status);
+}
+
+static void handshake_shed(uvtls_t* tls) {
+  handshake_queue_remove(tls);
+  loop_timer_remove(tls);
+  tls->tls_loop->handshake_stats.shed++;
+  handshake_failed(tls, UVTLS_EQUEUETIMEOUT);
+  tls->handshake_done_cb(tls, UVTLS_EQUEUETIMEOUT);
+}
+
+static int handshake_slot_available(uvtls_loop_t* tls_loop) {
+  return tls_loop->max_handshakes == 0 ||
+         tls_loop->handshake_stats.active < tls_loop->max_handshakes;
+}
+
+static void handshake_slot_acquire(uvtls_t* tls) {
+  uvtls_handshake_stats_t* stats = &tls->tls_loop->handshake_stats;
+  tls->flags |= UVTLS_FLAG_HANDSHAKE_ACTIVE;
+  stats->active++;
+  stats->started++;
+}
+
+static void handshake_admit_next(uvtls_loop_t* tls_loop) {
+  uvtls_handshake_stats_t* stats = &tls_loop->handshake_stats;
+
+  while (!QUEUE_EMPTY(&tls_loop->handshake_queue) &&
+         handshake_slot_available(tls_loop)) {
+    int rc;
+    uint64_t wait_time;
+    QUEUE* q = QUEUE_HEAD(&tls_loop->handshake_queue);
+    uvtls_t* tls = QUEUE_DATA(q, uvtls_t, handshake_queue);
+
+    wait_time = uv_now(tls_loop->loop) - tls->handshake_queued_time;
+    if (tls_loop->handshake_queue_timeout != 0 &&
+        wait_time >= tls_loop->handshake_queue_timeout) {
+      handshake_shed(tls);
+      continue;
+    }
+
+    handshake_queue_remove(tls);
+    loop_timer_remove(tls);
+    stats->total_wait_time += wait_time;
+    if (wait_time > stats->max_wait_time) {
+      stats->max_wait_time = wait_time;
+    }
+
+    handshake_slot_acquire(tls);
+    rc = handshake_start(tls);
+    if (rc != 0) {
+      tls->flags &= ~UVTLS_FLAG_HANDSHAKE_ACTIVE;
+      stats->active--;
+      loop_timer_remove(tls);
+      handshake_failed(tls, rc);
+      tls->handshake_done_cb(tls, rc);
+    }
+  }
+}
+
+static int handshake_admit(uvtls_t* tls) {
+  uvtls_loop_t* tls_loop = tls->tls_loop;
+  uvtls_handshake_stats_t* stats = &tls_loop->handshake_stats;
+
+  if (handshake_slot_available(tls_loop) &&
+      QUEUE_EMPTY(&tls_loop->handshake_queue)) {
+    handshake_slot_acquire(tls);
+    return 1;
+  }
+
+  tls->flags |= UVTLS_FLAG_HANDSHAKE_QUEUED;
+  tls->handshake_queued_time = uv_now(tls_loop->loop);
+  QUEUE_INSERT_TAIL(&tls_loop->handshake_queue, &tls->handshake_queue);
+
+  stats->total_queued++;
+  if (++stats->queued > stats->max_queued) {
+    stats->max_queued = stats->queued;
+  }
+
+  loop_timer_add(tls, tls_loop->handshake_queue_timeout);
+
+  return 0;
+}
+
+static void handshake_release(uvtls_t* tls) {
+  if (!tls->tls_loop) {
+    return;
+  }
+
+  loop_timer_remove(tls);
+
+  if (tls->flags & UVTLS_FLAG_HANDSHAKE_QUEUED) {
+    handshake_queue_remove(tls);
+  } else if (tls->flags & UVTLS_FLAG_HANDSHAKE_ACTIVE) {
+    tls->flags &= ~UVTLS_FLAG_HANDSHAKE_ACTIVE;
+    tls->tls_loop->handshake_stats.active--;
+    handshake_admit_next(tls->tls_loop);
+  }
+}
+
+static void handshake_done(uvtls_t* tls, int status) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  uv_read_stop(tls->stream);
+  handshake_release(tls);
+  session->verify_work = NULL; /* A running verify callback is ignored */
+  session->stats.handshake_end = uv_hrtime();
+  if (status == 0) {
+    tls->flags |= UVTLS_FLAG_ESTABLISHED;
+    uvtls_metrics_add(handshakes_completed, 1);
+    if (SSL_session_reused(session->ssl)) {
+      uvtls_metrics_add(handshakes_resumed, 1);
+    }
+    trace(tls, UVTLS_TRACE_DONE, UVTLS_TRACE_NONE, 0);
+  } else {
+    handshake_failed(tls, status);
+    write_queue_complete(&session->flush_queue, status);
+    write_queue_complete(&session->write_queue, status);
+  }
+  tls->handshake_done_cb(tls, status);
+}
+
+/* Account for ciphertext read from the stream */
+static void stats_read(uvtls_t* tls, ssize_t nread) {
+  uvtls_stats_t* stats = &((uvtls_session_t*) tls->impl)->stats;
+  if (nread > 0) {
+    stats->read_calls++;
+    stats->ciphertext_bytes_in += (uint64_t) nread;
+    if ((size_t) uvtls_ring_buf_size(&tls->incoming) >
+        stats->max_incoming_size) {
+      stats->max_incoming_size = (size_t) uvtls_ring_buf_size(&tls->incoming);
+    }
+  }
+}
+
+static void handshake_finish(uvtls_t* tls, int status) {
+  if (status == 0) {
+    /* Queued application data goes out in the same write as the final
+     * handshake flight */
+    tls->flags |= UVTLS_FLAG_CONNECTED;
+    status = write_queue_encrypt(tls);
+    if (status == 0) {
+      status = handshake_flush(tls);
+    }
+  }
+  handshake_done(tls, status);
+}
+
+/* A verify callback request with a copy of the peer's certificates */
+typedef struct uvtls_verify_work_s {
+  uv_work_t work;
+  uvtls_verify_t req;
+  uvtls_verify_cb cb;
+  int status;
+} uvtls_verify_work_t;
+
+static uvtls_verify_work_t* verify_work_create(uvtls_t* tls,
+                                               uvtls_context_ex_t* ex) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  X509* leaf = SSL_get_peer_certificate(session->ssl);
+  STACK_OF(X509)* chain = SSL_get_peer_cert_chain(session->ssl);
+  int count = chain ? sk_X509_num(chain) : 0;
+  unsigned int ncerts = 0;
+  size_t size = 0;
+  uvtls_verify_work_t* vw = NULL;
+  uv_buf_t* certs;
+  unsigned char* der;
+  int i;
+
+  /* The leaf is first. A server's peer chain doesn't include it. */
+  for (i = -1; i < count; ++i) {
+    X509* cert = i < 0 ? leaf : sk_X509_value(chain, i);
+    int length;
+    if (!cert || (i >= 0 && leaf && X509_cmp(cert, leaf) == 0)) {
+      continue;
+    }
+    length = i2d_X509(cert, NULL);
+    if (length < 0) {
+      goto done;
+    }
+    size += (size_t) length;
+    ncerts++;
+  }
+
+  vw = (uvtls_verify_work_t*) uvtls__malloc(
+      sizeof(uvtls_verify_work_t) + ncerts * sizeof(uv_buf_t) + size);
+  if (!vw) {
+    goto done;
+  }
+  certs = (uv_buf_t*) (vw + 1);
+  der = (unsigned char*) (certs + ncerts);
+
+  vw->req.data = ex->verify_cb_data;
+  vw->req.tls = tls;
+  vw->req.hostname = tls->hostname;
+  vw->req.certs = certs;
+  vw->req.ncerts = ncerts;
+  vw->cb = ex->verify_cb;
+  vw->status = 0;
+
+  for (i = -1; i < count; ++i) {
+    X509* cert = i < 0 ? leaf : sk_X509_value(chain, i);
+    unsigned char* base = der;
+    if (!cert || (i >= 0 && leaf && X509_cmp(cert, leaf) == 0)) {
+      continue;
+    }
+    *certs++ = uv_buf_init((char*) base, (unsigned int) i2d_X509(cert, &der));
+  }
+
+done:
+  X509_free(leaf);
+  return vw;
+}
+
+static void on_verify_work(uv_work_t* work) {
+  uvtls_verify_work_t* vw = (uvtls_verify_work_t*) work->data;
+  vw->status = vw->cb(&vw->req);
+}
+
+static void on_verify_done(uv_work_t* work, int status) {
+  uvtls_verify_work_t* vw = (uvtls_verify_work_t*) work->data;
+  uvtls_t* tls = vw->req.tls;
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  int is_current = session->verify_work == vw;
+
+  status = status == 0 ? vw->status : status;
+  uvtls__free(vw);
+  tls->flags &= ~UVTLS_FLAG_VERIFY;
+
+  if (tls->flags & UVTLS_FLAG_CLOSE_PENDING) {
+    uvtls_close(tls, tls->close_cb);
+    return;
+  }
+
+  if (is_current) { /* Otherwise the handshake has timed out */
+    session->verify_work = NULL;
+    handshake_finish(tls, status);
+  }
+}
+
+/*
+ * Run the context's verify callback, on the threadpool if it's offloaded,
+ * and finish the handshake with its status. Reading is stopped while the
+ * callback runs off the loop.
+ */
+static void verify_cb_run(uvtls_t* tls) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  uvtls_context_ex_t* ex = (uvtls_context_ex_t*) SSL_CTX_get_ex_data(
+      session->ssl_ctx, context_ex_index__);
+  uvtls_verify_work_t* vw;
+  int rc;
+
+  if (!ex->verify_cb) {
+    handshake_finish(tls, 0);
+    return;
+  }
+
+  trace(tls, UVTLS_TRACE_VERIFY, UVTLS_TRACE_NONE, 0);
+
+  vw = verify_work_create(tls, ex);
+  if (!vw) {
+    handshake_finish(tls, UV_ENOMEM);
+    return;
+  }
+
+  if (!ex->verify_offload) {
+    rc = vw->cb(&vw->req);
+    uvtls__free(vw);
+    handshake_finish(tls, rc);
+    return;
+  }
+
+  vw->work.data = vw;
+  rc = uv_queue_work(
+      tls->stream->loop, &vw->work, on_verify_work, on_verify_done);
+  if (rc != 0) {
+    uvtls__free(vw);
+    handshake_finish(tls, rc);
+    return;
+  }
+
+  uv_read_stop(tls->stream);
+  tls->flags |= UVTLS_FLAG_VERIFY;
+  session->verify_work = vw;
 }
 
 static void on_handshake_read(uv_stream_t* stream,
                               ssize_t nread,
                               const uv_buf_t* buf) {
   int rc;
-  uvtls_t* tls = (uvtls_t*) stream->data;
-  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  uvtls_t* tls = (uvtls_t*) stream->data;
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+
+  if ((nread == UV_EOF && !SSL_is_init_finished(session->ssl)) ||
+      (nread != UV_EOF && nread < 0)) {
+    handshake_done(tls, (int) nread);
+    return;
+  }
+
+  uvtls_ring_buf_tail_block_commit(&tls->incoming, (int) nread);
+  stats_read(tls, nread);
+
+  rc = do_handshake(tls);
+  if (rc == 0 && is_handshake_complete(session->ssl)) {
+    rc = verify(tls);
+    if (rc == 0) {
+      verify_cb_run(tls);
+    } else {
+      handshake_done(tls, rc);
+    }
+  } else if (rc != 0 || (rc = handshake_flush(tls)) != 0) {
+    handshake_done(tls, rc);
+  }
+}
+
+static int handshake_start(uvtls_t* tls) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  int rc;
+  session->stats.handshake_start = uv_hrtime();
+  trace(tls, UVTLS_TRACE_START, UVTLS_TRACE_NONE, 0);
+  rc = do_handshake(tls);
+  assert(!SSL_is_init_finished(session->ssl) &&
+         "Handshake shouldn't be finished");
+  if (rc != 0 || handshake_flush(tls) != 0) {
+    return UVTLS_EHANDSHAKE;
+  }
+
+  if (tls->tls_loop) {
+    loop_timer_add(tls, tls->tls_loop->handshake_timeout);
+  }
+
+  return uv_read_start(tls->stream, on_alloc, on_handshake_read);
+}
+
+static int handshake(uvtls_t* tls, uvtls_handshake_done_cb cb) {
+  int rc;
+  tls->stream->data = tls;
+  tls->handshake_done_cb = cb;
+  rc = handshake_start(tls);
+  if (rc != 0) {
+    handshake_failed(tls, rc);
+  }
+  return rc;
+}
+
+static void do_read(uvtls_t* tls) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  if (tls->flags & UVTLS_FLAG_WRITE_OFFLOAD) {
+    return; /* The SSL is in use, resumed once the offload finishes */
+  }
+  while (tls->read_cb) {
+    int nread;
+    uv_buf_t* buf = &tls->alloc_buf;
+    if (buf->base == NULL) {
+      tls->alloc_cb(tls, UVTLS_SUGGESTED_READ_SIZE, buf);
+      if (buf->base == NULL || buf->len == 0) {
+        tls->read_cb(tls, UV_ENOBUFS, buf);
+        return;
+      }
+      assert(buf->len <= INT_MAX && "Allocate read buf is too big");
+    }
+    nread = SSL_read(session->ssl, buf->base, (int) buf->len);
+    if (nread <= 0) {
+      int error = SSL_get_error(session->ssl, nread);
+      if (error == SSL_ERROR_WANT_READ) {
+        /* Wait for next read */
+      } else {
+        if (error != SSL_ERROR_ZERO_RETURN) {
+          error_record(tls, error);
+        }
+        tls->read_cb(
+            tls, error == SSL_ERROR_ZERO_RETURN ? UV_EOF : UVTLS_EREAD, buf);
+      }
+      return;
+    }
+    session->stats.plaintext_bytes_in += (uint64_t) nread;
+    uvtls_metrics_add(bytes_decrypted, nread);
+    tls->read_cb(tls, nread, buf);
+    *buf = uv_buf_init(NULL, 0);
+  }
+}
+
+static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  uvtls_t* tls = (uvtls_t*) stream->data;
+
+  if (nread < 0) {
+    if (tls->flags & UVTLS_FLAG_WRITE_OFFLOAD) {
+      /* Reported after the data that's still waiting to be decrypted */
+      ((uvtls_session_t*) tls->impl)->offload_read_status = nread;
+      return;
+    }
+    tls->read_cb(tls, nread, buf);
+    return;
+  }
+
+  uvtls_ring_buf_tail_block_commit(&tls->incoming, (int) nread);
+  stats_read(tls, nread);
+
+  do_read(tls);
+
+  /* Write post-handshake messages (e.g. a key update response) */
+  if (!uv_is_closing((uv_handle_t*) stream)) {
+    handshake_flush(tls);
+    hibernate(tls);
+  }
+}
+
+static void on_write(uv_write_t* req, int status) {
+  uvtls_write_t* write_req = (uvtls_write_t*) req->data;
+  uvtls_t* tls = write_req->tls;
+  ((uvtls_session_t*) tls->impl)->writes_count--;
+  uvtls_ring_buf_head_blocks_commit(&tls->outgoing, write_req->commit_pos);
+  if (!uv_is_closing((uv_handle_t*) tls->stream)) {
+    hibernate(tls);
+  }
+  write_req->cb(write_req, status);
+}
+
+static size_t bufs_size(const uv_buf_t bufs[], unsigned int nbufs) {
+  unsigned int i;
+  size_t size = 0;
+  for (i = 0; i < nbufs; ++i) {
+    size += bufs[i].len;
+  }
+  return size;
+}
+
+static void on_offload_work(uv_work_t* work) {
+  uvtls_t* tls = (uvtls_t*) work->data;
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  session->offload_ssl_error = ssl_write_bufs(session->ssl,
+                                              session->offload_write->bufs,
+                                              session->offload_write->nbufs);
+  /* The error queue is per thread, the error is recorded on the loop's */
+  session->offload_error = ERR_get_error();
+  ERR_clear_error();
+}
+
+static void on_offload_done(uv_work_t* work, int status);
+
+/*
+ * Encrypt a write on the threadpool. The ciphertext is appended after the
+ * outgoing ring buffer's tail, which is spliced on once it's finished. Until
+ * then the SSL is only used by the threadpool: reads, later writes and
+ * closing the connection are deferred.
+ */
+static int offload_start(uvtls_write_t* req) {
+  uvtls_t* tls = req->tls;
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  int rc;
+
+  rc = uvtls_ring_buf_extend_begin(&tls->outgoing, &session->offload_outgoing);
+  if (rc != 0) {
+    return rc;
+  }
+  BIO_set_data(session->outgoing_bio, &session->offload_outgoing);
+
+  session->offload_write = req;
+  session->offload_req.data = tls;
+  rc = uv_queue_work(tls->stream->loop,
+                     &session->offload_req,
+                     on_offload_work,
+                     on_offload_done);
+  if (rc != 0) {
+    BIO_set_data(session->outgoing_bio, &tls->outgoing);
+    session->offload_write = NULL;
+    return rc;
+  }
+
+  tls->flags |= UVTLS_FLAG_WRITE_OFFLOAD;
+  return 0;
+}
+
+/* Encrypt and write, on the threadpool if the write is large enough */
+static int write_start(uvtls_write_t* req,
+                       const uv_buf_t bufs[],
+                       unsigned int nbufs) {
+  uvtls_t* tls = req->tls;
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  int ssl_error;
+  int rc;
+
+  if (session->offload_min_size > 0 &&
+      bufs_size(bufs, nbufs) >= session->offload_min_size) {
+    if (bufs != req->bufs) {
+      rc = write_req_copy_bufs(req, bufs, nbufs);
+      if (rc != 0) {
+        return rc;
+      }
+    }
+    rc = offload_start(req);
+    if (rc != 0) {
+      write_req_release_bufs(req);
+    }
+    return rc;
+  }
+
+  ssl_error = ssl_write_bufs(session->ssl, bufs, nbufs);
+  if (bufs == req->bufs) {
+    write_req_release_bufs(req);
+  }
+  if (ssl_error != SSL_ERROR_NONE) {
+    return write_error(tls, ssl_error);
+  }
+  return do_write(&req->req, tls, &req->commit_pos, on_write);
+}
+
+static void offload_queue_drain(uvtls_t* tls) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+
+  while (!(tls->flags & UVTLS_FLAG_WRITE_OFFLOAD) &&
+         !QUEUE_EMPTY(&session->offload_queue)) {
+    QUEUE* q = QUEUE_HEAD(&session->offload_queue);
+    uvtls_write_t* req = QUEUE_DATA(q, uvtls_write_t, queue);
+    int rc;
+    QUEUE_REMOVE(q);
+    rc = write_start(req, req->bufs, req->nbufs);
+    if (rc != 0) {
+      write_req_release_bufs(req);
+      req->cb(req, rc);
+    }
+  }
+}
+
+static void on_offload_done(uv_work_t* work, int status) {
+  uvtls_t* tls = (uvtls_t*) work->data;
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  uvtls_write_t* req = session->offload_write;
+  ssize_t read_status = session->offload_read_status;
+  int rc;
+
+  BIO_set_data(session->outgoing_bio, &tls->outgoing);
+  uvtls_ring_buf_extend_end(&tls->outgoing, &session->offload_outgoing);
+  tls->flags &= ~UVTLS_FLAG_WRITE_OFFLOAD;
+  session->offload_write = NULL;
+  session->offload_read_status = 0;
+
+  write_req_release_bufs(req);
+  if (session->offload_ssl_error != SSL_ERROR_NONE) {
+    rc = write_error_code(
+        tls, session->offload_error, session->offload_ssl_error);
+  } else {
+    rc = do_write(&req->req, tls, &req->commit_pos, on_write);
+  }
+  if (rc != 0) {
+    req->cb(req, rc);
+  }
+
+  if (tls->flags & UVTLS_FLAG_CLOSE_PENDING) {
+    uvtls_close(tls, tls->close_cb);
+    return;
+  }
+
+  /* Catch up on reads that arrived while the SSL was in use */
+  do_read(tls);
+  if (read_status < 0 && !uvtls_is_closing(tls)) {
+    uv_buf_t buf = uv_buf_init(NULL, 0);
+    tls->read_cb(tls, read_status, &buf);
+  }
+
+  if (!uvtls_is_closing(tls)) {
+    handshake_flush(tls);
+    offload_queue_drain(tls);
+  }
+}
+
+static void on_close(uv_handle_t* handle) {
+  uvtls_t* tls = (uvtls_t*) handle->data;
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  write_queue_complete(&session->flush_queue, UV_ECANCELED);
+  write_queue_complete(&session->write_queue, UV_ECANCELED);
+  write_queue_complete(&session->offload_queue, UV_ECANCELED);
+  SSL_free(session->ssl);
+  SSL_CTX_free(session->ssl_ctx);
+  uvtls__free(tls->hostname);
+  tls->hostname = NULL;
+  if (tls->flags & UVTLS_FLAG_ESTABLISHED) {
+    uvtls_metrics_add(connections_closed, 1);
+  }
+  if (tls->tls_loop) {
+    uvtls_slab_free(&tls->tls_loop->session_slab, session);
+  } else {
+    uvtls__free(session);
+  }
+  if (tls->close_cb) {
+    tls->close_cb(tls);
+  }
+}
+
+int uvtls_context_init(uvtls_context_t* context, int flags) {
+  SSL_CTX* ssl_ctx;
+  uvtls_context_ex_t* ex;
+
+#ifndef SSL_MODE_ENABLE_FALSE_START
+  if (flags & UVTLS_CONTEXT_FALSE_START) {
+    return UV_ENOTSUP;
+  }
+#endif
+
+  if (flags & UVTLS_CONTEXT_LIB_INIT) {
+    uv_once(&lib_init_guard__, lib_init);
+  }
+  uv_once(&context_ex_init_guard__, context_ex_init);
+
+  ssl_ctx = SSL_CTX_new(UVTLS_METHOD());
+  if (!ssl_ctx) {
+    return UV_ENOMEM;
+  }
+
+  ex = (uvtls_context_ex_t*) uvtls__malloc(sizeof(uvtls_context_ex_t));
+  if (!ex) {
+    SSL_CTX_free(ssl_ctx);
+    return UV_ENOMEM;
+  }
+  if (uvtls_snapshot_init(&ex->cert_bundle, cert_bundle_free) != 0) {
+    uvtls__free(ex);
+    SSL_CTX_free(ssl_ctx);
+    return UV_ENOMEM;
+  }
+  if (uvtls_snapshot_init(&ex->ocsp_response, uvtls__free) != 0) {
+    uvtls_snapshot_destroy(&ex->cert_bundle);
+    uvtls__free(ex);
+    SSL_CTX_free(ssl_ctx);
+    return UV_ENOMEM;
+  }
+  if (uvtls_snapshot_init(&ex->crl, uvtls_crl_index_free) != 0) {
+    uvtls_snapshot_destroy(&ex->ocsp_response);
+    uvtls_snapshot_destroy(&ex->cert_bundle);
+    uvtls__free(ex);
+    SSL_CTX_free(ssl_ctx);
+    return UV_ENOMEM;
+  }
+  ex->ocsp_watcher = NULL;
+  ex->crl_watcher = NULL;
+  uvtls_hash_table_init(&ex->sni_contexts);
+  ex->cert_compression = 0;
+  ex->verify_flags = UVTLS_VERIFY_PEER_CERT;
+  ex->verify_cache = NULL;
+  ex->trust_generation = 0;
+  ex->has_trust_store = 0;
+  ex->verify_cb = NULL;
+  ex->verify_cb_data = NULL;
+  ex->verify_offload = 0;
+  ex->trace_cb = NULL;
+  ex->trace_cb_data = NULL;
+  ex->trace_sample_rate = 0;
+  ex->trace_count = 0;
+  ex->error_log_cb = NULL;
+  ex->error_log_cb_data = NULL;
+  ex->error_log_max = 0;
+  ex->error_log_second = 0;
+  ex->error_log_count = 0;
+  ex->error_log_suppressed = 0;
+  ex->is_published = 0;
+  SSL_CTX_set_ex_data(ssl_ctx, context_ex_index__, ex);
+
+  SSL_CTX_set_tlsext_status_cb(ssl_ctx, on_ocsp_status);
+  SSL_CTX_set_tlsext_status_arg(ssl_ctx, ex);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  SSL_CTX_set_cert_cb(ssl_ctx, on_cert, ex);
+#endif
+
+  context->impl = ssl_ctx;
+
+  if (flags & UVTLS_CONTEXT_DEBUG) {
+    ex->trace_cb = debug_trace;
+    ex->trace_sample_rate = 1;
+  }
+
+  if (flags & UVTLS_CONTEXT_HIBERNATE) {
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+  }
+
+#ifdef SSL_MODE_ENABLE_FALSE_START
+  if (flags & UVTLS_CONTEXT_FALSE_START) {
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_FALSE_START);
+  }
+#endif
+
+  SSL_CTX_set_ecdh_auto(ssl_ctx, 1);
+  SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+  return 0;
+}
+
+void uvtls_context_destroy(uvtls_context_t* context) {
+  uvtls_context_ex_t* ex = context_ex(context);
+  file_watcher_stop(&ex->ocsp_watcher);
+  file_watcher_stop(&ex->crl_watcher);
+  SSL_CTX_free((SSL_CTX*) context->impl);
+}
+
+int uvtls_context_set_verify_flags(uvtls_context_t* context,
+                                   int verify_flags) {
+  if (context_is_published(context)) {
+    return UV_EBUSY;
+  }
+  context_ex(context)->verify_flags = verify_flags;
+  return 0;
+}
+
+int uvtls_context_get_verify_flags(const uvtls_context_t* context) {
+  return context_ex(context)->verify_flags;
+}
+
+static int store_add_certs(X509_STORE* store,
+                           const char* cert,
+                           size_t length) {
+  int ncerts = 0;
+  X509* x509;
+  BIO* bio;
+  if (length > INT_MAX) {
+    return UVTLS_EINVAL;
+  }
+
+  bio = BIO_new_mem_buf(cert, (int) length);
+  if (bio == NULL) {
+    return UV_ENOMEM;
+  }
+
+  while ((x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+    X509_STORE_add_cert(store, x509);
+    X509_free(x509);
+    ncerts++;
+  }
+
+  BIO_free_all(bio);
+
+  return ncerts == 0 ? UVTLS_EINVAL : 0;
+}
+
+/* OpenSSL's hashed directory lookup loads certificates as they're needed */
+static int store_add_dir(X509_STORE* store, const char* path) {
+  X509_LOOKUP* lookup = X509_STORE_add_lookup(store, X509_LOOKUP_hash_dir());
+  if (!lookup) {
+    return UV_ENOMEM;
+  }
+  if (!X509_LOOKUP_add_dir(lookup, path, X509_FILETYPE_PEM)) {
+    return UVTLS_EINVAL;
+  }
+  return 0;
+}
+
+int uvtls_trust_store_init(uvtls_trust_store_t* store) {
+  store->impl = X509_STORE_new();
+  if (!store->impl) {
+    return UV_ENOMEM;
+  }
+  store->is_published = 0;
+  return 0;
+}
+
+void uvtls_trust_store_destroy(uvtls_trust_store_t* store) {
+  X509_STORE_free((X509_STORE*) store->impl);
+}
+
+int uvtls_trust_store_add_certs(uvtls_trust_store_t* store,
+                                const char* cert,
+                                size_t length) {
+  if (uvtls_atomic_load(&store->is_published)) {
+    return UV_EBUSY;
+  }
+  return store_add_certs((X509_STORE*) store->impl, cert, length);
+}
+
+int uvtls_trust_store_add_dir(uvtls_trust_store_t* store, const char* path) {
+  if (uvtls_atomic_load(&store->is_published)) {
+    return UV_EBUSY;
+  }
+  return store_add_dir((X509_STORE*) store->impl, path);
+}
+
+int uvtls_context_add_trusted_certs(uvtls_context_t* context,
+                                    const char* cert,
+                                    size_t length) {
+  uvtls_context_ex_t* ex = context_ex(context);
+  int rc;
 
-  if ((nread == UV_EOF && !SSL_is_init_finished(session->ssl)) ||
-      (nread != UV_EOF && nread < 0)) {
-    uv_read_stop(stream);
-    tls->handshake_done_cb(tls, (int) nread);
-    return;
+  if (context_is_published(context) || ex->has_trust_store) {
+    return UV_EBUSY;
   }
 
-  uvtls_ring_buf_tail_block_commit(&tls->incoming, (int) nread);
+  rc = store_add_certs(
+      SSL_CTX_get_cert_store((SSL_CTX*) context->impl), cert, length);
+  if (rc == 0) {
+    ex->trust_generation++;
+  }
+  return rc;
+}
 
-  rc = do_handshake(tls);
-  if (rc != 0) {
-    uv_read_stop(stream);
-    tls->handshake_done_cb(tls, rc);
-  } else if (SSL_is_init_finished(session->ssl)) {
-    uv_read_stop(stream);
-    tls->handshake_done_cb(tls, verify(tls));
+int uvtls_context_add_trusted_dir(uvtls_context_t* context, const char* path) {
+  uvtls_context_ex_t* ex = context_ex(context);
+  int rc;
+
+  if (context_is_published(context) || ex->has_trust_store) {
+    return UV_EBUSY;
+  }
+
+  rc = store_add_dir(SSL_CTX_get_cert_store((SSL_CTX*) context->impl), path);
+  if (rc == 0) {
+    ex->trust_generation++;
   }
+  return rc;
 }
 
-static int handshake(uvtls_t* tls,
-                     uvtls_session_t* session,
-                     uvtls_handshake_done_cb cb) {
-  int rc = do_handshake(tls);
-  assert(!SSL_is_init_finished(session->ssl) &&
-         "Handshake shouldn't be finished");
-  if (rc != 0) {
-    return UVTLS_EHANDSHAKE;
+int uvtls_context_set_trust_store(uvtls_context_t* context,
+                                  uvtls_trust_store_t* store) {
+  X509_STORE* x509_store = (X509_STORE*) store->impl;
+  uvtls_context_ex_t* ex = context_ex(context);
+
+  if (context_is_published(context)) {
+    return UV_EBUSY;
   }
 
-  tls->stream->data = tls;
-  tls->handshake_done_cb = cb;
-  return uv_read_start(tls->stream, on_alloc, on_handshake_read);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  X509_STORE_up_ref(x509_store);
+#else
+  CRYPTO_add(&x509_store->references, 1, CRYPTO_LOCK_X509_STORE);
+#endif
+  SSL_CTX_set_cert_store((SSL_CTX*) context->impl, x509_store);
+
+  if (!uvtls_atomic_load(&store->is_published)) {
+    uvtls_atomic_add(&store->is_published, 1);
+  }
+  ex->has_trust_store = 1;
+  ex->trust_generation++;
+  return 0;
 }
 
-static void do_read(uvtls_t* tls) {
-  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
-  while (tls->read_cb) {
-    int nread;
-    uv_buf_t* buf = &tls->alloc_buf;
-    if (buf->base == NULL) {
-      tls->alloc_cb(tls, UVTLS_SUGGESTED_READ_SIZE, buf);
-      if (buf->base == NULL || buf->len == 0) {
-        tls->read_cb(tls, UV_ENOBUFS, buf);
-        return;
-      }
-      assert(buf->len <= INT_MAX && "Allocate read buf is too big");
+int uvtls_context_set_verify_cb(uvtls_context_t* context,
+                                uvtls_verify_cb cb,
+                                void* data,
+                                int offload) {
+  uvtls_context_ex_t* ex = context_ex(context);
+  if (context_is_published(context)) {
+    return UV_EBUSY;
+  }
+  ex->verify_cb = cb;
+  ex->verify_cb_data = data;
+  ex->verify_offload = offload;
+  return 0;
+}
+
+int uvtls_context_set_trace_cb(uvtls_context_t* context,
+                               uvtls_trace_cb cb,
+                               void* data,
+                               unsigned int sample_rate) {
+  uvtls_context_ex_t* ex = context_ex(context);
+  if (context_is_published(context)) {
+    return UV_EBUSY;
+  }
+  ex->trace_cb = cb;
+  ex->trace_cb_data = data;
+  ex->trace_sample_rate = sample_rate;
+  return 0;
+}
+
+int uvtls_context_set_error_log_cb(uvtls_context_t* context,
+                                   uvtls_error_log_cb cb,
+                                   void* data,
+                                   unsigned int max_per_second) {
+  uvtls_context_ex_t* ex = context_ex(context);
+  if (context_is_published(context)) {
+    return UV_EBUSY;
+  }
+  ex->error_log_cb = cb;
+  ex->error_log_cb_data = data;
+  ex->error_log_max = max_per_second;
+  return 0;
+}
+
+int uvtls_context_set_verify_cache(uvtls_context_t* context,
+                                   size_t max_entries) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  SSL_CTX* ssl_ctx = (SSL_CTX*) context->impl;
+  uvtls_context_ex_t* ex = context_ex(context);
+  uvtls_verify_cache_t* cache = NULL;
+  int rc;
+
+  if (context_is_published(context)) {
+    return UV_EBUSY;
+  }
+
+  if (max_entries > 0) {
+    cache =
+        (uvtls_verify_cache_t*) uvtls__malloc(sizeof(uvtls_verify_cache_t));
+    if (!cache) {
+      return UV_ENOMEM;
     }
-    nread = SSL_read(session->ssl, buf->base, (int) buf->len);
-    if (nread <= 0) {
-      int error = SSL_get_error(session->ssl, nread);
-      if (error == SSL_ERROR_WANT_READ) {
-        /* Wait for next read */
-      } else {
-        tls->read_cb(
-            tls, error == SSL_ERROR_ZERO_RETURN ? UV_EOF : UVTLS_EREAD, buf);
-      }
-      return;
+    rc = uvtls_verify_cache_init(cache, max_entries);
+    if (rc != 0) {
+      uvtls__free(cache);
+      return rc;
     }
-    tls->read_cb(tls, nread, buf);
-    *buf = uv_buf_init(NULL, 0);
   }
+
+  if (ex->verify_cache) {
+    uvtls_verify_cache_destroy(ex->verify_cache);
+    uvtls__free(ex->verify_cache);
+  }
+  ex->verify_cache = cache;
+  SSL_CTX_set_cert_verify_callback(ssl_ctx, cache ? on_cert_verify : NULL, ex);
+  return 0;
+#else
+  return UV_ENOTSUP;
+#endif
 }
 
-static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
-  uvtls_t* tls = (uvtls_t*) stream->data;
+void uvtls_context_get_verify_cache_stats(const uvtls_context_t* context,
+                                          uvtls_verify_cache_stats_t* stats) {
+  uvtls_context_ex_t* ex = context_ex(context);
+  if (ex->verify_cache) {
+    uvtls_verify_cache_get_stats(
+        ex->verify_cache, &stats->count, &stats->hits, &stats->misses);
+  } else {
+    memset(stats, 0, sizeof(*stats));
+  }
+}
 
-  if (nread < 0) {
-    tls->read_cb(tls, nread, buf);
-    return;
+int uvtls_context_set_cert(uvtls_context_t* context,
+                           const char* cert,
+                           size_t length) {
+  X509* leaf;
+  STACK_OF(X509)* chain;
+  SSL_CTX* ssl_ctx = (SSL_CTX*) context->impl;
+  int rc;
+
+  if (context_is_published(context)) {
+    return UV_EBUSY;
   }
 
-  uvtls_ring_buf_tail_block_commit(&tls->incoming, (int) nread);
+  rc = load_cert_chain(cert, length, &leaf, &chain);
+  if (rc != 0) {
+    return rc;
+  }
 
-  do_read(tls);
-}
+  rc = use_cert_chain(ssl_ctx, leaf, chain);
+  X509_free(leaf);
+  sk_X509_pop_free(chain, X509_free);
 
-static void on_write(uv_write_t* req, int status) {
-  uvtls_write_t* write_req = (uvtls_write_t*) req->data;
-  uvtls_ring_buf_head_blocks_commit(&write_req->tls->outgoing,
-                                    write_req->commit_pos);
-  write_req->cb(write_req, status);
+#ifdef UVTLS_HAVE_CERT_COMPRESSION
+  /* Compress the chain once instead of during every handshake */
+  if (rc == 0 && context_ex(context)->cert_compression &&
+      !SSL_CTX_compress_certs(ssl_ctx, 0)) {
+    rc = UV_ENOTSUP;
+  }
+#endif
+
+  return rc;
 }
 
-static void on_close(uv_handle_t* handle) {
-  uvtls_t* tls = (uvtls_t*) handle->data;
-  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
-  SSL_CTX_free(SSL_get_SSL_CTX(session->ssl));
-  SSL_free(session->ssl);
-  free(session);
-  if (tls->close_cb) {
-    tls->close_cb(tls);
+int uvtls_context_set_cert_compression(uvtls_context_t* context,
+                                       int enable) {
+#ifdef UVTLS_HAVE_CERT_COMPRESSION
+  SSL_CTX* ssl_ctx = (SSL_CTX*) context->impl;
+  const uint64_t options = SSL_OP_NO_TX_CERTIFICATE_COMPRESSION |
+                           SSL_OP_NO_RX_CERTIFICATE_COMPRESSION;
+
+  if (context_is_published(context)) {
+    return UV_EBUSY;
+  }
+
+  if (!enable) {
+    SSL_CTX_set_options(ssl_ctx, options);
+    context_ex(context)->cert_compression = 0;
+    return 0;
+  }
+
+  SSL_CTX_clear_options(ssl_ctx, options);
+  if (SSL_CTX_get0_certificate(ssl_ctx) &&
+      !SSL_CTX_compress_certs(ssl_ctx, 0)) {
+    return UV_ENOTSUP; /* No compression algorithms available */
   }
+  context_ex(context)->cert_compression = 1;
+  return 0;
+#else
+  return UV_ENOTSUP;
+#endif
 }
 
-int uvtls_context_init(uvtls_context_t* context, int flags) {
-  SSL_CTX* ssl_ctx;
+int uvtls_context_set_private_key(uvtls_context_t* context,
+                                  const char* key,
+                                  size_t length) {
+  EVP_PKEY* pkey;
 
-  if (flags & UVTLS_CONTEXT_LIB_INIT) {
-    uv_once(&lib_init_guard__, lib_init);
+  if (context_is_published(context)) {
+    return UV_EBUSY;
   }
 
-  ssl_ctx = SSL_CTX_new(UVTLS_METHOD());
-  if (!ssl_ctx) {
+  pkey = load_key(key, length);
+  if (pkey == NULL) {
+    return UVTLS_EINVAL;
+  }
+
+  SSL_CTX_use_PrivateKey((SSL_CTX*) context->impl, pkey);
+  EVP_PKEY_free(pkey);
+  return 0;
+}
+
+int uvtls_context_reload_cert(uvtls_context_t* context,
+                              const char* cert,
+                              size_t cert_length,
+                              const char* key,
+                              size_t key_length) {
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  int rc;
+  uvtls_cert_bundle_t* bundle =
+      (uvtls_cert_bundle_t*) uvtls__malloc(sizeof(uvtls_cert_bundle_t));
+  if (!bundle) {
     return UV_ENOMEM;
   }
 
-  context->impl = ssl_ctx;
-  context->verify_flags = UVTLS_VERIFY_PEER_CERT;
+  rc = load_cert_chain(cert, cert_length, &bundle->leaf, &bundle->chain);
+  if (rc != 0) {
+    uvtls__free(bundle);
+    return rc;
+  }
 
-  if (flags & UVTLS_CONTEXT_DEBUG) {
-    SSL_CTX_set_info_callback(ssl_ctx, debug_info_callback);
+  bundle->key = load_key(key, key_length);
+  if (bundle->key == NULL || !X509_check_private_key(bundle->leaf,
+                                                     bundle->key)) {
+    ERR_clear_error();
+    cert_bundle_free(bundle);
+    return UVTLS_EINVAL;
   }
 
-  SSL_CTX_set_ecdh_auto(ssl_ctx, 1);
-  SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+  uvtls_snapshot_publish(&context_ex(context)->cert_bundle, bundle);
   return 0;
+#else
+  return UV_ENOTSUP;
+#endif
 }
 
-void uvtls_context_destroy(uvtls_context_t* context) {
-  SSL_CTX_free((SSL_CTX*) context->impl);
+int uvtls_context_set_ocsp_response(uvtls_context_t* context,
+                                    const char* response,
+                                    size_t length) {
+  uvtls_context_ex_t* ex = context_ex(context);
+  uvtls_ocsp_response_t* ocsp_response = NULL;
+
+  if (length > 0) {
+    int rc = ocsp_response_create(response, length, &ocsp_response);
+    if (rc != 0) {
+      return rc;
+    }
+  }
+
+  file_watcher_stop(&ex->ocsp_watcher);
+  uvtls_snapshot_publish(&ex->ocsp_response, ocsp_response);
+  return 0;
 }
 
-void uvtls_context_set_verify_flags(uvtls_context_t* context,
-                                    int verify_flags) {
-  context->verify_flags = verify_flags;
+int uvtls_context_set_ocsp_response_file(uvtls_context_t* context,
+                                         uv_loop_t* loop,
+                                         const char* path,
+                                         unsigned int interval) {
+  uvtls_context_ex_t* ex = context_ex(context);
+  uvtls_ocsp_response_t* ocsp_response;
+
+  int rc = ocsp_response_load_file(path, &ocsp_response);
+  if (rc != 0) {
+    return rc;
+  }
+
+  file_watcher_stop(&ex->ocsp_watcher);
+  uvtls_snapshot_publish(&ex->ocsp_response, ocsp_response);
+
+  if (loop) {
+    return file_watcher_start(&ex->ocsp_watcher,
+                              (SSL_CTX*) context->impl,
+                              &ex->ocsp_response,
+                              ocsp_response_load,
+                              loop,
+                              path,
+                              interval);
+  }
+  return 0;
 }
 
-int uvtls_context_add_trusted_certs(uvtls_context_t* context,
-                                    const char* cert,
-                                    size_t length) {
-  int ncerts = 0;
-  X509* x509;
-  X509_STORE* trusted_store = SSL_CTX_get_cert_store((SSL_CTX*) context->impl);
+int uvtls_context_set_crl(uvtls_context_t* context,
+                          const char* crl,
+                          size_t length) {
+  uvtls_context_ex_t* ex = context_ex(context);
+  uvtls_crl_index_t* index = NULL;
 
-  BIO* bio = BIO_new_mem_buf(cert, (int) length);
-  if (bio == NULL) {
-    return UV_ENOMEM;
+  if (length > 0) {
+    int rc = crl_index_create(crl, length, &index);
+    if (rc != 0) {
+      return rc;
+    }
   }
 
-  while ((x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
-    X509_STORE_add_cert(trusted_store, x509);
-    X509_free(x509);
-    ncerts++;
+  file_watcher_stop(&ex->crl_watcher);
+  uvtls_snapshot_publish(&ex->crl, index);
+  return 0;
+}
+
+int uvtls_context_set_crl_file(uvtls_context_t* context,
+                               uv_loop_t* loop,
+                               const char* path,
+                               unsigned int interval) {
+  uvtls_context_ex_t* ex = context_ex(context);
+  uvtls_crl_index_t* index;
+
+  int rc = uvtls_crl_index_load(path, &index);
+  if (rc != 0) {
+    return rc;
   }
 
-  BIO_free_all(bio);
+  file_watcher_stop(&ex->crl_watcher);
+  uvtls_snapshot_publish(&ex->crl, index);
+
+  if (loop) {
+    return file_watcher_start(&ex->crl_watcher,
+                              (SSL_CTX*) context->impl,
+                              &ex->crl,
+                              crl_index_load,
+                              loop,
+                              path,
+                              interval);
+  }
+  return 0;
+}
 
-  return ncerts == 0 ? UVTLS_EINVAL : 0;
+int uvtls_crl_compile(const char* crl, size_t length, const char* path) {
+  uvtls_crl_index_t* index;
+  int rc = crl_index_create(crl, length, &index);
+  if (rc != 0) {
+    return rc;
+  }
+  rc = uvtls_crl_index_save(index, path);
+  uvtls_crl_index_free(index);
+  return rc;
 }
 
-int uvtls_context_set_cert(uvtls_context_t* context,
-                           const char* cert,
-                           size_t length) {
-  X509* x509 = load_cert(cert, length);
-  if (x509 == NULL) {
+int uvtls_context_add_sni(uvtls_context_t* context,
+                          const char* hostname,
+                          size_t length,
+                          uvtls_context_t* sni_context) {
+  char key[256];
+  size_t i;
+  int rc;
+  void* previous;
+  SSL_CTX* ssl_ctx = (SSL_CTX*) context->impl;
+  SSL_CTX* sni_ssl_ctx = (SSL_CTX*) sni_context->impl;
+  uvtls_context_ex_t* ex = context_ex(context);
+
+  if (length == 0 || length >= sizeof(key) || sni_ssl_ctx == ssl_ctx) {
     return UVTLS_EINVAL;
   }
+  if (context_is_published(context)) {
+    return UV_EBUSY;
+  }
+
+  for (i = 0; i < length; ++i) {
+    key[i] = ascii_tolower(hostname[i]);
+  }
+
+  rc = uvtls_hash_table_set(
+      &ex->sni_contexts, key, length, sni_ssl_ctx, &previous);
+  if (rc != 0) {
+    return rc;
+  }
+
+  /* Each hostname only holds a reference, so aliases share a context */
+  SSL_CTX_up_ref(sni_ssl_ctx);
+  context_publish(context_ex(sni_context));
+  if (previous) {
+    SSL_CTX_free((SSL_CTX*) previous);
+  }
 
-  SSL_CTX_use_certificate((SSL_CTX*) context->impl, x509);
-  X509_free(x509);
+  SSL_CTX_set_tlsext_servername_callback(ssl_ctx, on_servername);
+  SSL_CTX_set_tlsext_servername_arg(ssl_ctx, ex);
   return 0;
 }
 
-int uvtls_context_set_private_key(uvtls_context_t* context,
-                                  const char* key,
-                                  size_t length) {
-  EVP_PKEY* pkey = load_key(key, length);
-  if (pkey == NULL) {
-    return UVTLS_EINVAL;
+static void on_loop_close(uv_handle_t* handle) {
+  uvtls_loop_t* tls_loop = (uvtls_loop_t*) handle->data;
+  if (tls_loop->close_cb) {
+    tls_loop->close_cb(tls_loop);
   }
+}
+
+int uvtls_loop_init(uvtls_loop_t* tls_loop, uv_loop_t* loop) {
+  int rc = uv_timer_init(loop, &tls_loop->timer);
+  if (rc != 0) {
+    return rc;
+  }
+
+  tls_loop->loop = loop;
+  tls_loop->max_handshakes = 0;
+  tls_loop->handshake_queue_timeout = 0;
+  tls_loop->handshake_timeout = 0;
+  QUEUE_INIT(&tls_loop->handshake_queue);
+  tls_loop->timer.data = tls_loop;
+  uvtls_timer_wheel_init(&tls_loop->timer_wheel, 1, uv_now(loop));
+  memset(&tls_loop->handshake_stats, 0, sizeof(tls_loop->handshake_stats));
+  uvtls_slab_init(&tls_loop->session_slab,
+                  sizeof(uvtls_session_t),
+                  UVTLS_LOOP_MAX_FREE_SESSIONS);
+  uvtls_slab_init(&tls_loop->block_slab,
+                  sizeof(uvtls_ring_buf_block_t),
+                  UVTLS_LOOP_MAX_FREE_BLOCKS);
+  tls_loop->close_cb = NULL;
 
-  SSL_CTX_use_PrivateKey((SSL_CTX*) context->impl, pkey);
-  EVP_PKEY_free(pkey);
   return 0;
 }
 
+void uvtls_loop_close(uvtls_loop_t* tls_loop, uvtls_loop_close_cb cb) {
+  assert(QUEUE_EMPTY(&tls_loop->handshake_queue) &&
+         uvtls_timer_wheel_empty(&tls_loop->timer_wheel) &&
+         "All connections should be closed before closing the loop");
+  uvtls_slab_destroy(&tls_loop->session_slab);
+  uvtls_slab_destroy(&tls_loop->block_slab);
+  tls_loop->close_cb = cb;
+  uv_close((uv_handle_t*) &tls_loop->timer, on_loop_close);
+}
+
+void uvtls_loop_set_handshake_limit(uvtls_loop_t* tls_loop,
+                                    unsigned int max_handshakes,
+                                    uint64_t queue_timeout) {
+  tls_loop->max_handshakes = max_handshakes;
+  tls_loop->handshake_queue_timeout = queue_timeout;
+  loop_timer_update_resolution(tls_loop);
+  handshake_admit_next(tls_loop);
+}
+
+void uvtls_loop_set_handshake_timeout(uvtls_loop_t* tls_loop,
+                                      uint64_t timeout) {
+  tls_loop->handshake_timeout = timeout;
+  loop_timer_update_resolution(tls_loop);
+}
+
+void uvtls_loop_get_handshake_stats(const uvtls_loop_t* tls_loop,
+                                    uvtls_handshake_stats_t* stats) {
+  *stats = tls_loop->handshake_stats;
+}
+
 int uvtls_init(uvtls_t* tls, uvtls_context_t* context, uv_stream_t* stream) {
+  return uvtls_init_ex(tls, context, stream, NULL);
+}
+
+int uvtls_init_ex(uvtls_t* tls,
+                  uvtls_context_t* context,
+                  uv_stream_t* stream,
+                  uvtls_loop_t* tls_loop) {
   int rc;
+  uvtls_slab_t* block_slab;
 
   ring_buf_bio_init_once();
 
   tls->stream = stream;
   tls->context = context;
-  tls->hostname[0] = '\0';
+  tls->tls_loop = tls_loop;
+  tls->hostname = NULL;
   tls->alloc_cb = NULL;
   tls->alloc_buf = uv_buf_init(NULL, 0);
   tls->read_cb = NULL;
   tls->handshake_done_cb = NULL;
   tls->connection_cb = NULL;
-  tls->commit_pos = uvtls_ring_buf_pos_init(0, NULL);
   tls->close_cb = NULL;
+  QUEUE_INIT(&tls->handshake_queue);
+  tls->handshake_queued_time = 0;
+  uvtls_timer_wheel_entry_init(&tls->handshake_timer);
+  tls->flags = 0;
 
-  rc = uvtls_ring_buf_init(&tls->incoming);
+  block_slab = tls_loop ? &tls_loop->block_slab : NULL;
+
+  rc = uvtls_ring_buf_init_ex(&tls->incoming, block_slab);
   if (rc != 0) {
-    goto error;
+    return rc;
   }
 
-  rc = uvtls_ring_buf_init(&tls->outgoing);
+  rc = uvtls_ring_buf_init_ex(&tls->outgoing, block_slab);
   if (rc != 0) {
-    goto error;
+    uvtls_ring_buf_destroy(&tls->incoming);
+    return rc;
   }
 
-  tls->impl = uvtls_session_create(
-      (SSL_CTX*) context->impl, &tls->incoming, &tls->outgoing);
+  tls->impl = uvtls_session_create(tls_loop,
+                                   (SSL_CTX*) context->impl,
+                                   &tls->incoming,
+                                   &tls->outgoing);
   if (!tls->impl) {
     rc = UV_ENOMEM;
     goto error;
   }
+  SSL_set_app_data(((uvtls_session_t*) tls->impl)->ssl, tls);
 
   return 0;
 
@@ -773,12 +3082,25 @@ error:
 
 int uvtls_set_hostname(uvtls_t* tls, const char* hostname, size_t length) {
   uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  char* copy;
+  size_t i;
 
-  if (length + 1 > sizeof(tls->hostname)) {
+  if (length > UVTLS_MAX_HOSTNAME_LENGTH) {
     return UV_EINVAL;
   }
-  tls->hostname[length] = '\0';
-  memcpy(tls->hostname, hostname, length);
+  copy = (char*) uvtls__malloc(length + 1);
+  if (!copy) {
+    return UV_ENOMEM;
+  }
+  /* Lowercased once here so that matching doesn't need to */
+  for (i = 0; i < length; ++i) {
+    copy[i] = ascii_tolower(hostname[i]);
+  }
+  copy[length] = '\0';
+  uvtls__free(tls->hostname);
+  tls->hostname = copy;
+  session->hostname_length = length;
+  session->hostname_is_ip = Curl_host_is_ip(copy);
 
   SSL_set_tlsext_host_name(
       session->ssl,
@@ -789,20 +3111,70 @@ int uvtls_set_hostname(uvtls_t* tls, const char* hostname, size_t length) {
 
 int uvtls_connect(uvtls_t* tls, uvtls_connect_cb cb) {
   uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  uvtls_context_ex_t* ex = (uvtls_context_ex_t*) SSL_CTX_get_ex_data(
+      session->ssl_ctx, context_ex_index__);
+  context_publish(ex);
   SSL_set_connect_state(session->ssl);
-  return handshake(tls, session, cb);
+  uvtls_metrics_add(handshakes_started, 1);
+  trace_sample(tls, ex);
+  return handshake(tls, cb);
+}
+
+size_t uvtls_get_memory_usage(const uvtls_t* tls) {
+  return (size_t) (uvtls_ring_buf_blocks_count(&tls->incoming) +
+                   uvtls_ring_buf_blocks_count(&tls->outgoing)) *
+         sizeof(uvtls_ring_buf_block_t);
+}
+
+size_t uvtls_get_total_memory_usage(void) {
+  uvtls_metrics_t metrics;
+  uvtls_get_metrics(&metrics);
+  return (size_t) (metrics.ring_buf_blocks * sizeof(uvtls_ring_buf_block_t) +
+                   metrics.slab_bytes);
+}
+
+void uvtls_get_stats(const uvtls_t* tls, uvtls_stats_t* stats) {
+  uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  *stats = session->stats;
+  if (session->stats.handshake_end != 0 &&
+      (tls->flags & UVTLS_FLAG_CONNECTED)) {
+    stats->is_session_reused = SSL_session_reused(session->ssl);
+    stats->cipher = SSL_get_cipher_name(session->ssl);
+    stats->version = SSL_get_version(session->ssl);
+  }
+}
+
+void uvtls_get_error(const uvtls_t* tls, uvtls_error_t* error) {
+  error_get((const uvtls_session_t*) tls->impl, error);
+}
+
+char* uvtls_error_string(unsigned long code, char* buf, size_t buflen) {
+  ERR_error_string_n(code, buf, buflen);
+  return buf;
 }
 
 int uvtls_is_closing(uvtls_t* tls) {
-  return uv_is_closing((uv_handle_t*) tls->stream);
+  return (tls->flags & UVTLS_FLAG_CLOSE_PENDING) ||
+         uv_is_closing((uv_handle_t*) tls->stream);
 }
 
 void uvtls_close(uvtls_t* tls, uvtls_close_cb cb) {
+  handshake_release(tls);
   tls->close_cb = cb;
+  if (tls->flags & (UVTLS_FLAG_WRITE_OFFLOAD | UVTLS_FLAG_VERIFY)) {
+    /* The connection is still in use on the threadpool */
+    tls->flags |= UVTLS_FLAG_CLOSE_PENDING;
+    return;
+  }
+  tls->flags &= ~UVTLS_FLAG_CLOSE_PENDING;
   tls->stream->data = tls;
   uv_close((uv_handle_t*) tls->stream, on_close);
 }
 
+void uvtls_set_write_offload(uvtls_t* tls, size_t min_size) {
+  ((uvtls_session_t*) tls->impl)->offload_min_size = min_size;
+}
+
 static void on_connection(uv_stream_t* server, int status) {
   uvtls_t* tls = (uvtls_t*) server->data;
   tls->connection_cb(tls, status);
@@ -815,9 +3187,31 @@ int uvtls_listen(uvtls_t* tls, int backlog, uvtls_connection_cb cb) {
 }
 
 int uvtls_accept(uvtls_t* tls, uvtls_accept_cb cb) {
+  int rc;
   uvtls_session_t* session = (uvtls_session_t*) tls->impl;
+  uvtls_context_ex_t* ex = (uvtls_context_ex_t*) SSL_CTX_get_ex_data(
+      session->ssl_ctx, context_ex_index__);
+  context_publish(ex);
   SSL_set_accept_state(session->ssl);
-  return handshake(tls, session, cb);
+  uvtls_metrics_add(handshakes_started, 1);
+  trace_sample(tls, ex);
+
+  if (tls->tls_loop) {
+    tls->stream->data = tls;
+    tls->handshake_done_cb = cb;
+    if (!handshake_admit(tls)) {
+      trace(tls, UVTLS_TRACE_QUEUED, UVTLS_TRACE_NONE, 0);
+      return 0; /* Queued until a handshake slot is available */
+    }
+    rc = handshake_start(tls);
+    if (rc != 0) {
+      handshake_release(tls);
+      handshake_failed(tls, rc);
+    }
+    return rc;
+  }
+
+  return handshake(tls, cb);
 }
 
 int uvtls_read_start(uvtls_t* tls,
@@ -842,21 +3236,49 @@ int uvtls_write(uvtls_write_t* req,
                 unsigned int nbufs,
                 uvtls_write_cb cb) {
   uvtls_session_t* session;
-  unsigned int i;
-
-  const uvtls_ring_buf_pos_t start_pos = tls->outgoing.tail;
-  int start_size = uvtls_ring_buf_size(&tls->outgoing);
+  int rc;
 
   req->req.data = req;
   req->cb = cb;
   req->tls = tls;
+  req->bufs = NULL;
   tls->stream->data = tls;
 
   session = (uvtls_session_t*) tls->impl;
-  for (i = 0; i < nbufs; ++i) {
-    SSL_write(session->ssl, bufs[i].base, (int) bufs[i].len);
+
+  if (!(tls->flags & UVTLS_FLAG_CONNECTED)) {
+    /* Encrypted and sent once the handshake completes */
+    rc = write_req_copy_bufs(req, bufs, nbufs);
+    if (rc == 0) {
+      QUEUE_INSERT_TAIL(&session->write_queue, &req->queue);
+    }
+  } else if ((tls->flags & UVTLS_FLAG_WRITE_OFFLOAD) ||
+             !QUEUE_EMPTY(&session->offload_queue)) {
+    /* Encrypted in order once the offloaded write finishes */
+    rc = write_req_copy_bufs(req, bufs, nbufs);
+    if (rc == 0) {
+      QUEUE_INSERT_TAIL(&session->offload_queue, &req->queue);
+    }
+  } else if ((tls->flags & UVTLS_FLAG_HANDSHAKE_WRITE) &&
+             !QUEUE_EMPTY(&session->flush_queue)) {
+    /* Sent with the writes that are waiting for the handshake write to
+     * complete, otherwise this write would send their data and they'd never
+     * be completed */
+    int ssl_error = ssl_write_bufs(session->ssl, bufs, nbufs);
+    if (ssl_error != SSL_ERROR_NONE) {
+      rc = write_error(tls, ssl_error);
+    } else {
+      QUEUE_INSERT_TAIL(&session->flush_queue, &req->queue);
+      rc = 0;
+    }
+  } else {
+    rc = write_start(req, bufs, nbufs);
   }
 
-  return do_write(
-      &req->req, tls, start_pos, start_size, &req->commit_pos, on_write);
+  if (rc == 0) {
+    size_t size = bufs_size(bufs, nbufs);
+    session->stats.plaintext_bytes_out += size;
+    uvtls_metrics_add(bytes_encrypted, size);
+  }
+  return rc;
 }
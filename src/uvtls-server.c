@@ -0,0 +1,411 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "uvtls.h"
+
+#include "atomic.h"
+#include "uvtls-common.h"
+
+#include <stdlib.h>
+
+/* A connection being handed off to a worker */
+typedef struct dispatch_s dispatch_t;
+
+struct dispatch_s {
+  uv_write_t req;
+  uv_tcp_t tcp;
+};
+
+#if UV_VERSION_HEX >= 0x012900 /* 1.41.0 */
+
+static void close_fd(uv_file fd) {
+  uv_fs_t req;
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+}
+
+static void on_ipc_alloc(uv_handle_t* handle,
+                         size_t suggested_size,
+                         uv_buf_t* buf) {
+  uvtls_worker_t* worker = (uvtls_worker_t*) handle->data;
+  buf->base = worker->ipc_buf;
+  buf->len = sizeof(worker->ipc_buf);
+}
+
+static void worker_stop(uvtls_worker_t* worker) {
+  if (worker->server->stop_cb) {
+    worker->server->stop_cb(worker);
+  }
+  uv_close((uv_handle_t*) &worker->ipc, NULL);
+  uvtls_loop_close(&worker->tls_loop, NULL);
+}
+
+static void on_ipc_read(uv_stream_t* stream,
+                        ssize_t nread,
+                        const uv_buf_t* buf) {
+  int count;
+  uvtls_worker_t* worker = (uvtls_worker_t*) stream->data;
+
+  if (nread < 0) {
+    /* The server closes its end of the pipe to stop the worker */
+    if (nread != UV_EOF) {
+      worker->server->connection_cb(worker, (int) nread);
+    }
+    worker_stop(worker);
+    return;
+  }
+
+  /* Only a count is taken so a callback that doesn't accept can't spin */
+  count = uv_pipe_pending_count(&worker->ipc);
+  while (count-- > 0) {
+    worker->server->connection_cb(worker, 0);
+  }
+}
+
+static void worker_run(void* arg) {
+  uvtls_worker_t* worker = (uvtls_worker_t*) arg;
+  uvtls_server_t* server = worker->server;
+
+  uv_run(&worker->loop, UV_RUN_DEFAULT);
+
+  uvtls_atomic_add(&server->workers_stopped, 1);
+  uv_async_send(&server->async);
+}
+
+static int worker_init(uvtls_worker_t* worker, uvtls_server_t* server) {
+  int rc;
+  uv_file fds[2];
+
+  worker->data = NULL;
+  worker->server = server;
+  worker->is_started = 0;
+
+  rc = uv_loop_init(&worker->loop);
+  if (rc != 0) {
+    return rc;
+  }
+
+  rc = uvtls_loop_init(&worker->tls_loop, &worker->loop);
+  if (rc != 0) {
+    uv_loop_close(&worker->loop);
+    return rc;
+  }
+
+#ifdef _WIN32
+  rc = uv_pipe(fds, 0, 0);
+#else
+  rc = uv_socketpair(SOCK_STREAM, 0, fds, 0, 0);
+#endif
+  if (rc != 0) {
+    goto error_loop;
+  }
+
+  uv_pipe_init(&worker->loop, &worker->ipc, 1); /* Can't fail */
+  worker->ipc.data = worker;
+
+  rc = uv_pipe_open(&worker->ipc, fds[0]);
+  if (rc != 0) {
+    close_fd(fds[0]);
+    goto error_pipe;
+  }
+
+  rc = uv_read_start((uv_stream_t*) &worker->ipc, on_ipc_alloc, on_ipc_read);
+  if (rc != 0) {
+    goto error_pipe;
+  }
+
+  worker->dispatch_fd = fds[1];
+  return 0;
+
+error_pipe:
+  close_fd(fds[1]);
+  uv_close((uv_handle_t*) &worker->ipc, NULL);
+error_loop:
+  uvtls_loop_close(&worker->tls_loop, NULL);
+  uv_run(&worker->loop, UV_RUN_DEFAULT);
+  uv_loop_close(&worker->loop);
+  return rc;
+}
+
+static void workers_destroy(uvtls_worker_t* workers, unsigned int count) {
+  unsigned int i;
+  for (i = 0; i < count; ++i) {
+    uvtls_worker_t* worker = &workers[i];
+    uv_close((uv_handle_t*) &worker->ipc, NULL);
+    uvtls_loop_close(&worker->tls_loop, NULL);
+    close_fd(worker->dispatch_fd);
+    uv_run(&worker->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&worker->loop);
+  }
+  uvtls__free(workers);
+}
+
+static void on_handle_close(uv_handle_t* handle) {
+  unsigned int i;
+  uvtls_server_t* server = (uvtls_server_t*) handle->data;
+
+  if (--server->pending_closes > 0) {
+    return;
+  }
+
+  for (i = 0; i < server->workers_count; ++i) {
+    uv_loop_close(&server->workers[i].loop);
+  }
+  uvtls__free(server->workers);
+  server->workers = NULL;
+
+  if (server->close_cb) {
+    server->close_cb(server);
+  }
+}
+
+static void on_worker_stopped(uv_async_t* async) {
+  unsigned int i;
+  uvtls_server_t* server = (uvtls_server_t*) async->data;
+
+  if (!server->is_closing || uv_is_closing((uv_handle_t*) async) ||
+      (unsigned int) uvtls_atomic_load(&server->workers_stopped) <
+          server->workers_count) {
+    return;
+  }
+
+  for (i = 0; i < server->workers_count; ++i) {
+    if (server->workers[i].is_started) {
+      uv_thread_join(&server->workers[i].thread);
+    }
+  }
+  uv_close((uv_handle_t*) async, on_handle_close);
+}
+
+static void on_dispatch_close(uv_handle_t* handle) {
+  uvtls__free(handle->data);
+}
+
+static void on_dispatch_write(uv_write_t* req, int status) {
+  dispatch_t* dispatch = (dispatch_t*) req->data;
+  /* The worker has its own copy of the socket once the write completes */
+  uv_close((uv_handle_t*) &dispatch->tcp, on_dispatch_close);
+}
+
+static void on_connection(uv_stream_t* stream, int status) {
+  int rc;
+  uv_buf_t buf;
+  uvtls_worker_t* worker;
+  dispatch_t* dispatch;
+  uvtls_server_t* server = (uvtls_server_t*) stream->data;
+
+  if (status != 0) {
+    return;
+  }
+
+  dispatch = (dispatch_t*) uvtls__malloc(sizeof(dispatch_t));
+  if (!dispatch) {
+    return;
+  }
+  dispatch->req.data = dispatch;
+  dispatch->tcp.data = dispatch;
+
+  rc = uv_tcp_init(server->loop, &dispatch->tcp);
+  if (rc != 0) {
+    uvtls__free(dispatch);
+    return;
+  }
+
+  rc = uv_accept(stream, (uv_stream_t*) &dispatch->tcp);
+  if (rc == 0) {
+    worker = &server->workers[server->next_worker];
+    server->next_worker = (server->next_worker + 1) % server->workers_count;
+
+    buf = uv_buf_init((char*) "c", 1);
+    rc = uv_write2(&dispatch->req,
+                   (uv_stream_t*) &worker->dispatch,
+                   &buf,
+                   1,
+                   (uv_stream_t*) &dispatch->tcp,
+                   on_dispatch_write);
+  }
+
+  if (rc != 0) {
+    uv_close((uv_handle_t*) &dispatch->tcp, on_dispatch_close);
+  }
+}
+
+int uvtls_server_init(uvtls_server_t* server,
+                      uv_loop_t* loop,
+                      uvtls_context_t* context,
+                      unsigned int workers_count) {
+  int rc;
+  unsigned int i;
+
+  if (workers_count == 0) {
+    return UV_EINVAL;
+  }
+
+  server->workers =
+      (uvtls_worker_t*) uvtls__malloc(workers_count * sizeof(uvtls_worker_t));
+  if (!server->workers) {
+    return UV_ENOMEM;
+  }
+
+  for (i = 0; i < workers_count; ++i) {
+    rc = worker_init(&server->workers[i], server);
+    if (rc != 0) {
+      workers_destroy(server->workers, i);
+      return rc;
+    }
+  }
+
+  rc = uv_async_init(loop, &server->async, on_worker_stopped);
+  if (rc != 0) {
+    workers_destroy(server->workers, workers_count);
+    return rc;
+  }
+
+  /* Neither can fail with these arguments */
+  uv_tcp_init(loop, &server->tcp);
+  for (i = 0; i < workers_count; ++i) {
+    uv_pipe_init(loop, &server->workers[i].dispatch, 1);
+    server->workers[i].dispatch.data = server;
+  }
+
+  server->loop = loop;
+  server->context = context;
+  server->tcp.data = server;
+  server->async.data = server;
+  server->workers_count = workers_count;
+  server->next_worker = 0;
+  server->workers_stopped = 0;
+  server->pending_closes = 0;
+  server->is_closing = 0;
+  server->connection_cb = NULL;
+  server->stop_cb = NULL;
+  server->close_cb = NULL;
+
+  return 0;
+}
+
+int uvtls_server_listen(uvtls_server_t* server,
+                        const struct sockaddr* addr,
+                        int backlog,
+                        uvtls_worker_connection_cb cb,
+                        uvtls_worker_stop_cb stop_cb) {
+  int rc;
+  unsigned int i;
+
+  /* Set before the worker threads start, which only read them */
+  server->connection_cb = cb;
+  server->stop_cb = stop_cb;
+
+  for (i = 0; i < server->workers_count; ++i) {
+    uvtls_worker_t* worker = &server->workers[i];
+    rc = uv_pipe_open(&worker->dispatch, worker->dispatch_fd);
+    if (rc != 0) {
+      return rc;
+    }
+    worker->dispatch_fd = -1; /* Owned by the pipe */
+  }
+
+  rc = uv_tcp_bind(&server->tcp, addr, 0);
+  if (rc != 0) {
+    return rc;
+  }
+
+  rc = uv_listen((uv_stream_t*) &server->tcp, backlog, on_connection);
+  if (rc != 0) {
+    return rc;
+  }
+
+  for (i = 0; i < server->workers_count; ++i) {
+    uvtls_worker_t* worker = &server->workers[i];
+    rc = uv_thread_create(&worker->thread, worker_run, worker);
+    if (rc != 0) {
+      return rc;
+    }
+    worker->is_started = 1;
+  }
+
+  return 0;
+}
+
+int uvtls_worker_accept(uvtls_worker_t* worker,
+                        uvtls_t* tls,
+                        uv_stream_t* client) {
+  int rc = uv_accept((uv_stream_t*) &worker->ipc, client);
+  if (rc != 0) {
+    return rc;
+  }
+  return uvtls_init_ex(
+      tls, worker->server->context, client, &worker->tls_loop);
+}
+
+void uvtls_server_close(uvtls_server_t* server, uvtls_server_close_cb cb) {
+  unsigned int i;
+
+  server->close_cb = cb;
+  server->is_closing = 1;
+  server->pending_closes = server->workers_count + 2;
+
+  uv_close((uv_handle_t*) &server->tcp, on_handle_close);
+
+  /* Closing the server's end of a pipe stops its worker */
+  for (i = 0; i < server->workers_count; ++i) {
+    uvtls_worker_t* worker = &server->workers[i];
+    uv_close((uv_handle_t*) &worker->dispatch, on_handle_close);
+    if (worker->dispatch_fd != -1) {
+      close_fd(worker->dispatch_fd);
+    }
+    if (!worker->is_started) {
+      worker_stop(worker);
+      uv_run(&worker->loop, UV_RUN_DEFAULT);
+      uvtls_atomic_add(&server->workers_stopped, 1);
+    }
+  }
+
+  uv_async_send(&server->async);
+}
+
+#else
+
+int uvtls_server_init(uvtls_server_t* server,
+                      uv_loop_t* loop,
+                      uvtls_context_t* context,
+                      unsigned int workers_count) {
+  return UV_ENOTSUP;
+}
+
+int uvtls_server_listen(uvtls_server_t* server,
+                        const struct sockaddr* addr,
+                        int backlog,
+                        uvtls_worker_connection_cb cb,
+                        uvtls_worker_stop_cb stop_cb) {
+  return UV_ENOTSUP;
+}
+
+int uvtls_worker_accept(uvtls_worker_t* worker,
+                        uvtls_t* tls,
+                        uv_stream_t* client) {
+  return UV_ENOTSUP;
+}
+
+void uvtls_server_close(uvtls_server_t* server, uvtls_server_close_cb cb) {
+}
+
+#endif
@@ -0,0 +1,151 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "verify-cache.h"
+
+#include "queue.h"
+#include "uvtls-common.h"
+
+#include <assert.h>
+#include <string.h>
+
+typedef struct uvtls_verify_cache_entry_s uvtls_verify_cache_entry_t;
+
+struct uvtls_verify_cache_entry_s {
+  void* queue[2];
+  unsigned char key[UVTLS_VERIFY_CACHE_KEY_SIZE];
+  long generation;
+  time_t expires;
+};
+
+static void entry_remove(uvtls_verify_cache_t* cache,
+                         uvtls_verify_cache_entry_t* entry) {
+  uvtls_hash_table_remove(
+      &cache->entries, (const char*) entry->key, sizeof(entry->key));
+  QUEUE_REMOVE(&entry->queue);
+  uvtls__free(entry);
+}
+
+int uvtls_verify_cache_init(uvtls_verify_cache_t* cache, size_t max_count) {
+  int rc;
+  assert(max_count > 0 && "Verify cache should hold at least one entry");
+  rc = uv_mutex_init(&cache->mutex);
+  if (rc != 0) {
+    return rc;
+  }
+  uvtls_hash_table_init(&cache->entries);
+  QUEUE_INIT(&cache->lru);
+  cache->max_count = max_count;
+  cache->hits = 0;
+  cache->misses = 0;
+  return 0;
+}
+
+void uvtls_verify_cache_destroy(uvtls_verify_cache_t* cache) {
+  uvtls_hash_table_destroy(&cache->entries, uvtls__free);
+  uv_mutex_destroy(&cache->mutex);
+}
+
+void uvtls_verify_cache_get_stats(uvtls_verify_cache_t* cache,
+                                  size_t* count,
+                                  uint64_t* hits,
+                                  uint64_t* misses) {
+  uv_mutex_lock(&cache->mutex);
+  *count = uvtls_hash_table_count(&cache->entries);
+  *hits = cache->hits;
+  *misses = cache->misses;
+  uv_mutex_unlock(&cache->mutex);
+}
+
+int uvtls_verify_cache_get(uvtls_verify_cache_t* cache,
+                           const unsigned char* key,
+                           long generation,
+                           time_t now) {
+  int found = 0;
+  uvtls_verify_cache_entry_t* entry;
+
+  uv_mutex_lock(&cache->mutex);
+  entry = (uvtls_verify_cache_entry_t*) uvtls_hash_table_get(
+      &cache->entries, (const char*) key, UVTLS_VERIFY_CACHE_KEY_SIZE);
+  if (entry) {
+    if (entry->generation != generation || entry->expires <= now) {
+      entry_remove(cache, entry);
+    } else {
+      QUEUE_REMOVE(&entry->queue);
+      QUEUE_INSERT_HEAD(&cache->lru, &entry->queue);
+      found = 1;
+    }
+  }
+  if (found) {
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+  uv_mutex_unlock(&cache->mutex);
+
+  return found;
+}
+
+int uvtls_verify_cache_put(uvtls_verify_cache_t* cache,
+                           const unsigned char* key,
+                           long generation,
+                           time_t expires) {
+  int rc = 0;
+  void* previous;
+  uvtls_verify_cache_entry_t* entry;
+
+  uv_mutex_lock(&cache->mutex);
+  entry = (uvtls_verify_cache_entry_t*) uvtls_hash_table_get(
+      &cache->entries, (const char*) key, UVTLS_VERIFY_CACHE_KEY_SIZE);
+  if (entry) {
+    QUEUE_REMOVE(&entry->queue);
+  } else {
+    if (uvtls_hash_table_count(&cache->entries) >= cache->max_count) {
+      entry_remove(cache,
+                   QUEUE_DATA(QUEUE_PREV(&cache->lru),
+                              uvtls_verify_cache_entry_t,
+                              queue));
+    }
+    entry = (uvtls_verify_cache_entry_t*) uvtls__malloc(
+        sizeof(uvtls_verify_cache_entry_t));
+    if (!entry) {
+      rc = UV_ENOMEM;
+      goto done;
+    }
+    memcpy(entry->key, key, sizeof(entry->key));
+    rc = uvtls_hash_table_set(&cache->entries,
+                              (const char*) entry->key,
+                              sizeof(entry->key),
+                              entry,
+                              &previous);
+    if (rc != 0) {
+      uvtls__free(entry);
+      goto done;
+    }
+  }
+  entry->generation = generation;
+  entry->expires = expires;
+  QUEUE_INSERT_HEAD(&cache->lru, &entry->queue);
+
+done:
+  uv_mutex_unlock(&cache->mutex);
+  return rc;
+}
@@ -0,0 +1,71 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef UVTLS_VERIFY_CACHE_H
+#define UVTLS_VERIFY_CACHE_H
+
+#include "hash-table.h"
+
+#include <uv.h>
+
+#include <time.h>
+
+#define UVTLS_VERIFY_CACHE_KEY_SIZE 32
+
+/*
+ * A bounded, least recently used set of keys (e.g. digests of certificate
+ * chains and hostnames) that were verified. An entry is only valid until it
+ * expires and for the generation (e.g. of the trust store) it was verified
+ * with. The cache is locked so that it can be shared by loops on different
+ * threads.
+ */
+
+typedef struct uvtls_verify_cache_s uvtls_verify_cache_t;
+
+struct uvtls_verify_cache_s {
+  uv_mutex_t mutex;
+  uvtls_hash_table_t entries;
+  void* lru[2]; /* Most recently used first */
+  size_t max_count;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+int uvtls_verify_cache_init(uvtls_verify_cache_t* cache, size_t max_count);
+
+void uvtls_verify_cache_destroy(uvtls_verify_cache_t* cache);
+
+void uvtls_verify_cache_get_stats(uvtls_verify_cache_t* cache,
+                                  size_t* count,
+                                  uint64_t* hits,
+                                  uint64_t* misses);
+
+int uvtls_verify_cache_get(uvtls_verify_cache_t* cache,
+                           const unsigned char* key,
+                           long generation,
+                           time_t now);
+
+int uvtls_verify_cache_put(uvtls_verify_cache_t* cache,
+                           const unsigned char* key,
+                           long generation,
+                           time_t expires);
+
+#endif /* UVTLS_VERIFY_CACHE_H */
@@ -44,12 +44,30 @@ void redirect_error_to_console() {
 }
 #endif
 
+TEST_CASE_EXTERN(allocator);
+TEST_CASE_EXTERN(crl_index);
+TEST_CASE_EXTERN(hash_table);
+TEST_CASE_EXTERN(hostcheck);
 TEST_CASE_EXTERN(ring_buf);
+TEST_CASE_EXTERN(slab);
+TEST_CASE_EXTERN(snapshot);
+TEST_CASE_EXTERN(timer_wheel);
 TEST_CASE_EXTERN(client);
+TEST_CASE_EXTERN(server);
+TEST_CASE_EXTERN(worker_server);
 
 TEST_SUITE_BEGIN(uvtls)
+  TEST_CASE_ENTRY(allocator)
+  TEST_CASE_ENTRY(crl_index)
+  TEST_CASE_ENTRY(hash_table)
+  TEST_CASE_ENTRY(hostcheck)
   TEST_CASE_ENTRY(ring_buf)
+  TEST_CASE_ENTRY(slab)
+  TEST_CASE_ENTRY(snapshot)
+  TEST_CASE_ENTRY(timer_wheel)
   TEST_CASE_ENTRY(client)
+  TEST_CASE_ENTRY(server)
+  TEST_CASE_ENTRY(worker_server)
   TEST_CASE_ENTRY_LAST()
 TEST_SUITE_END()
 
@@ -70,6 +70,10 @@ static void on_client_alloc(uvtls_t* tls,
 }
 
 static void on_accept(uvtls_t* client, int status) {
+  if (status != 0) {
+    uvtls_close(client, on_client_close);
+    return;
+  }
   uvtls_read_start(client, on_client_alloc, on_client_read);
 }
 
@@ -79,9 +83,10 @@ void client_init(client_t* client, server_t* server) {
   client->server = server;
 
   FATAL(0 == uv_tcp_init(server->tcp.loop, &client->tcp));
-  FATAL(0 == uvtls_init(&client->tls,
-                        server->tls.context,
-                        (uv_stream_t*) &client->tcp));
+  FATAL(0 == uvtls_init_ex(&client->tls,
+                           server->tls.context,
+                           (uv_stream_t*) &client->tcp,
+                           &server->tls_loop));
 
   for (i = 0; i < MAX_SERVER_CLIENTS; ++i) {
     if (!server->clients[i]) {
@@ -103,6 +108,7 @@ static void on_close(uvtls_t* tls) {
       uvtls_close(&client->tls, on_client_close);
     }
   }
+  uvtls_loop_close(&server->tls_loop, NULL);
 }
 
 static void on_connection(uvtls_t* server, int status) {
@@ -126,6 +132,10 @@ static void on_run(void* arg) {
 }
 
 void server_init(server_t* server) {
+  server_init_ex(server, NULL);
+}
+
+void server_init_ex(server_t* server, server_config_cb config_cb) {
   struct sockaddr_in addr;
   uv_ip4_addr("0.0.0.0", SERVER_PORT, &addr);
 
@@ -139,10 +149,14 @@ void server_init(server_t* server) {
 
   FATAL(0 == uv_async_init(&server->loop, &server->async, on_async));
 
+  FATAL(0 == uvtls_loop_init(&server->tls_loop, &server->loop));
+
   FATAL(0 == uv_tcp_bind(&server->tcp, (const struct sockaddr*) &addr, 0));
 
   FATAL(0 == uvtls_context_init(&server->tls_context, UVTLS_CONTEXT_LIB_INIT));
 
+  uvtls_context_set_verify_flags(&server->tls_context, UVTLS_VERIFY_NONE);
+
   FATAL(0 == uvtls_context_set_cert(
                  &server->tls_context, server_cert, strlen(server_cert)));
 
@@ -153,6 +167,10 @@ void server_init(server_t* server) {
                         &server->tls_context,
                         (uv_stream_t*) &server->tcp));
 
+  if (config_cb) {
+    config_cb(server);
+  }
+
   FATAL(0 == uvtls_listen(&server->tls, 100, on_connection));
 
   FATAL(0 == uv_thread_create(&server->thread, on_run, server));
@@ -38,10 +38,13 @@ struct client_s {
   server_t* server;
 };
 
+typedef void (*server_config_cb)(server_t* server);
+
 struct server_s {
   uv_tcp_t tcp;
   uvtls_t tls;
   uvtls_context_t tls_context;
+  uvtls_loop_t tls_loop;
   uv_thread_t thread;
   uv_loop_t loop;
   uv_async_t async;
@@ -56,6 +59,7 @@ struct client_write_s {
 
 
 void server_init(server_t* server);
+void server_init_ex(server_t* server, server_config_cb config_cb);
 void server_close(server_t* server);
 
 #endif /* TEST_SERVER_H */
@@ -0,0 +1,107 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+
+#include "hash-table.h"
+#include "uvtls.h"
+
+#include <openssl/ssl.h>
+
+#include <stdlib.h>
+
+static int malloc_count;
+static int free_count;
+
+static void* counting_malloc(size_t size) {
+  malloc_count++;
+  return malloc(size);
+}
+
+static void* counting_realloc(void* ptr, size_t size) {
+  malloc_count++;
+  return realloc(ptr, size);
+}
+
+static void* counting_calloc(size_t count, size_t size) {
+  malloc_count++;
+  return calloc(count, size);
+}
+
+static void counting_free(void* ptr) {
+  if (ptr) {
+    free_count++;
+  }
+  free(ptr);
+}
+
+TEST(replace) {
+  uvtls_hash_table_t table;
+  void* previous;
+
+  ASSERT(UV_EINVAL ==
+         uvtls_replace_allocator(NULL, realloc, calloc, counting_free));
+  ASSERT(0 == uvtls_replace_allocator(counting_malloc,
+                                      counting_realloc,
+                                      counting_calloc,
+                                      counting_free));
+
+  malloc_count = free_count = 0;
+  uvtls_hash_table_init(&table);
+  ASSERT(0 == uvtls_hash_table_set(&table, "key", 3, &table, &previous));
+  ASSERT(0 < malloc_count);
+  uvtls_hash_table_destroy(&table, NULL);
+  ASSERT(malloc_count == free_count);
+
+  /* Restore the default allocator for the remaining tests */
+  ASSERT(0 == uvtls_replace_allocator(malloc, realloc, calloc, free));
+}
+
+TEST(replace_tls) {
+  SSL_CTX* ssl_ctx;
+  int rc;
+
+  ASSERT(0 == uvtls_replace_allocator(counting_malloc,
+                                      counting_realloc,
+                                      counting_calloc,
+                                      counting_free));
+
+  /* Only possible if this test runs before anything else used OpenSSL */
+  rc = uvtls_replace_tls_allocator();
+  ASSERT(0 == rc || UV_EBUSY == rc);
+
+  if (rc == 0) {
+    malloc_count = 0;
+    ssl_ctx = SSL_CTX_new(SSLv23_method());
+    ASSERT(ssl_ctx != NULL);
+    ASSERT(0 < malloc_count);
+    SSL_CTX_free(ssl_ctx);
+  }
+
+  /* OpenSSL keeps using it, which is fine because it wraps malloc() */
+  ASSERT(0 == uvtls_replace_allocator(malloc, realloc, calloc, free));
+}
+
+TEST_CASE_BEGIN(allocator)
+  TEST_ENTRY(replace)
+  TEST_ENTRY(replace_tls)
+  TEST_ENTRY_LAST()
+TEST_CASE_END()
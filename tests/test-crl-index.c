@@ -0,0 +1,140 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+
+#include "crl-index.h"
+#include "uvtls-common.h"
+
+#include <uvtls.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define CRL_INDEX_FILE "test-crl-index.crl"
+#define ENTRIES_COUNT 1000
+
+static const unsigned char issuer_a[UVTLS_CRL_ISSUER_SIZE] = "issuer1";
+static const unsigned char issuer_b[UVTLS_CRL_ISSUER_SIZE] = "issuer2";
+
+static void serial_init(unsigned char* serial, int i) {
+  serial[0] = (unsigned char) (i >> 8);
+  serial[1] = (unsigned char) i;
+}
+
+/* Even serials of `issuer_a` (with duplicates) */
+static uvtls_crl_index_t* index_create() {
+  int i;
+  unsigned char serial[2];
+  uvtls_crl_entry_t* entries = (uvtls_crl_entry_t*) uvtls__malloc(
+      2 * ENTRIES_COUNT * sizeof(uvtls_crl_entry_t));
+  FATAL(entries != NULL);
+  for (i = 0; i < 2 * ENTRIES_COUNT; ++i) {
+    serial_init(serial, 2 * (i % ENTRIES_COUNT));
+    FATAL(0 == uvtls_crl_entry_init(&entries[i], issuer_a, serial, 2));
+  }
+  return uvtls_crl_index_create(entries, 2 * ENTRIES_COUNT);
+}
+
+static int is_revoked(const uvtls_crl_index_t* index,
+                      const unsigned char* issuer,
+                      int i) {
+  uvtls_crl_entry_t entry;
+  unsigned char serial[2];
+  serial_init(serial, i);
+  ASSERT(0 == uvtls_crl_entry_init(&entry, issuer, serial, 2));
+  return uvtls_crl_index_contains(index, &entry);
+}
+
+TEST(lookup) {
+  int i;
+  unsigned char serial[UVTLS_CRL_MAX_SERIAL_SIZE + 1];
+  uvtls_crl_entry_t entry;
+  uvtls_crl_index_t* index = index_create();
+  ASSERT(index != NULL);
+
+  ASSERT(ENTRIES_COUNT == index->count);
+  for (i = 0; i < 2 * ENTRIES_COUNT; ++i) {
+    ASSERT((i % 2 == 0) == is_revoked(index, issuer_a, i));
+    ASSERT(!is_revoked(index, issuer_b, i));
+  }
+
+  memset(serial, 0, sizeof(serial));
+  ASSERT(UVTLS_EINVAL ==
+         uvtls_crl_entry_init(&entry, issuer_a, serial, sizeof(serial)));
+
+  uvtls_crl_index_free(index);
+}
+
+TEST(save_load) {
+  int i;
+  FILE* file;
+  uvtls_crl_index_t* loaded;
+  uvtls_crl_index_t* index = index_create();
+  ASSERT(index != NULL);
+
+  ASSERT(0 == uvtls_crl_index_save(index, CRL_INDEX_FILE));
+  uvtls_crl_index_free(index);
+
+  ASSERT(0 == uvtls_crl_index_load(CRL_INDEX_FILE, &loaded));
+  ASSERT(ENTRIES_COUNT == loaded->count);
+  for (i = 0; i < 2 * ENTRIES_COUNT; ++i) {
+    ASSERT((i % 2 == 0) == is_revoked(loaded, issuer_a, i));
+  }
+  uvtls_crl_index_free(loaded);
+
+  /* A truncated index is rejected */
+  file = fopen(CRL_INDEX_FILE, "ab");
+  ASSERT(file != NULL);
+  fputc(0, file);
+  fclose(file);
+  ASSERT(UVTLS_EINVAL == uvtls_crl_index_load(CRL_INDEX_FILE, &loaded));
+
+  ASSERT(UV_ENOENT == uvtls_crl_index_load("does-not-exist.crl", &loaded));
+
+  remove(CRL_INDEX_FILE);
+}
+
+TEST(save_unsorted) {
+  unsigned char serial[2];
+  uvtls_crl_entry_t entries[2];
+  uvtls_crl_index_t index;
+  FILE* file;
+
+  serial_init(serial, 2);
+  ASSERT(0 == uvtls_crl_entry_init(&entries[0], issuer_a, serial, 2));
+  serial_init(serial, 1);
+  ASSERT(0 == uvtls_crl_entry_init(&entries[1], issuer_a, serial, 2));
+
+  /* Only checked when saving, loading doesn't read every entry */
+  index.entries = entries;
+  index.count = 2;
+  ASSERT(UVTLS_EINVAL == uvtls_crl_index_save(&index, CRL_INDEX_FILE));
+  file = fopen(CRL_INDEX_FILE, "rb");
+  ASSERT(file == NULL);
+}
+
+TEST_CASE_BEGIN(crl_index)
+  TEST_ENTRY(lookup)
+  TEST_ENTRY(save_load)
+  TEST_ENTRY(save_unsorted)
+  TEST_ENTRY_LAST()
+TEST_CASE_END()
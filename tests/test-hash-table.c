@@ -0,0 +1,128 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+
+#include "hash-table.h"
+
+#define MANY_KEYS 10000
+
+TEST(set_get) {
+  uvtls_hash_table_t table;
+  void* previous;
+  int a, b;
+
+  uvtls_hash_table_init(&table);
+  ASSERT(NULL == uvtls_hash_table_get(&table, "a", 1));
+
+  ASSERT(0 == uvtls_hash_table_set(&table, "a", 1, &a, &previous));
+  ASSERT(NULL == previous);
+  ASSERT(0 == uvtls_hash_table_set(&table, "ab", 2, &b, &previous));
+  ASSERT(NULL == previous);
+  ASSERT(2 == uvtls_hash_table_count(&table));
+
+  ASSERT(&a == uvtls_hash_table_get(&table, "a", 1));
+  ASSERT(&b == uvtls_hash_table_get(&table, "ab", 2));
+  ASSERT(&a == uvtls_hash_table_get(&table, "ab", 1));
+  ASSERT(NULL == uvtls_hash_table_get(&table, "b", 1));
+
+  uvtls_hash_table_destroy(&table, NULL);
+}
+
+TEST(replace) {
+  uvtls_hash_table_t table;
+  void* previous;
+  int a, b;
+
+  uvtls_hash_table_init(&table);
+
+  ASSERT(0 == uvtls_hash_table_set(&table, "key", 3, &a, &previous));
+  ASSERT(0 == uvtls_hash_table_set(&table, "key", 3, &b, &previous));
+  ASSERT(&a == previous);
+  ASSERT(1 == uvtls_hash_table_count(&table));
+  ASSERT(&b == uvtls_hash_table_get(&table, "key", 3));
+
+  uvtls_hash_table_destroy(&table, NULL);
+}
+
+TEST(grow) {
+  uvtls_hash_table_t table;
+  void* previous;
+  char key[32];
+  intptr_t i;
+
+  uvtls_hash_table_init(&table);
+
+  for (i = 0; i < MANY_KEYS; ++i) {
+    int length = snprintf(key, sizeof(key), "host%d.example.com", (int) i);
+    ASSERT(0 == uvtls_hash_table_set(
+                    &table, key, (size_t) length, (void*) (i + 1), &previous));
+  }
+  ASSERT(MANY_KEYS == uvtls_hash_table_count(&table));
+
+  for (i = 0; i < MANY_KEYS; ++i) {
+    int length = snprintf(key, sizeof(key), "host%d.example.com", (int) i);
+    ASSERT((void*) (i + 1) ==
+           uvtls_hash_table_get(&table, key, (size_t) length));
+  }
+
+  uvtls_hash_table_destroy(&table, NULL);
+}
+
+TEST(remove) {
+  uvtls_hash_table_t table;
+  void* previous;
+  char key[32];
+  intptr_t i;
+
+  uvtls_hash_table_init(&table);
+  ASSERT(NULL == uvtls_hash_table_remove(&table, "key", 3));
+
+  for (i = 0; i < MANY_KEYS; ++i) {
+    int length = snprintf(key, sizeof(key), "host%d.example.com", (int) i);
+    ASSERT(0 == uvtls_hash_table_set(
+                    &table, key, (size_t) length, (void*) (i + 1), &previous));
+  }
+
+  /* Remove every other key, the rest must still be found */
+  for (i = 0; i < MANY_KEYS; i += 2) {
+    int length = snprintf(key, sizeof(key), "host%d.example.com", (int) i);
+    ASSERT((void*) (i + 1) ==
+           uvtls_hash_table_remove(&table, key, (size_t) length));
+  }
+  ASSERT(MANY_KEYS / 2 == uvtls_hash_table_count(&table));
+
+  for (i = 0; i < MANY_KEYS; ++i) {
+    int length = snprintf(key, sizeof(key), "host%d.example.com", (int) i);
+    ASSERT((i % 2 ? (void*) (i + 1) : NULL) ==
+           uvtls_hash_table_get(&table, key, (size_t) length));
+  }
+
+  uvtls_hash_table_destroy(&table, NULL);
+}
+
+TEST_CASE_BEGIN(hash_table)
+  TEST_ENTRY(set_get)
+  TEST_ENTRY(replace)
+  TEST_ENTRY(grow)
+  TEST_ENTRY(remove)
+  TEST_ENTRY_LAST()
+TEST_CASE_END()
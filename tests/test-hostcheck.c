@@ -0,0 +1,91 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+
+#include "curl-hostcheck.h"
+
+#include <string.h>
+
+static int check(const char* pattern, const char* hostname) {
+  return Curl_cert_hostcheck(pattern,
+                             strlen(pattern),
+                             hostname,
+                             strlen(hostname),
+                             Curl_host_is_ip(hostname));
+}
+
+TEST(exact) {
+  ASSERT(check("example.com", "example.com"));
+  ASSERT(check("EXAMPLE.com", "example.com"));
+  ASSERT(check("example.com.", "example.com"));
+  ASSERT(check("example.com", "example.com."));
+  ASSERT(!check("example.com", "example.org"));
+  ASSERT(!check("example.com", "www.example.com"));
+  ASSERT(!check("", "example.com"));
+  ASSERT(!check("example.com", ""));
+}
+
+TEST(wildcard) {
+  ASSERT(check("*.example.com", "www.example.com"));
+  ASSERT(check("*.EXAMPLE.COM", "www.example.com"));
+  ASSERT(check("w*.example.com", "www.example.com"));
+  ASSERT(check("*w.example.com", "www.example.com"));
+  ASSERT(!check("*.example.com", "example.com"));
+  ASSERT(!check("*.example.com", "a.b.example.com"));
+  ASSERT(!check("x*.example.com", "www.example.com"));
+
+  /* Too wide, not in the left-most label or an IDN */
+  ASSERT(!check("*.com", "example.com"));
+  ASSERT(!check("www.*.com", "www.example.com"));
+  ASSERT(!check("xn--*.example.com", "xn--a.example.com"));
+}
+
+TEST(ip_address) {
+  ASSERT(Curl_host_is_ip("127.0.0.1"));
+  ASSERT(Curl_host_is_ip("::1"));
+  ASSERT(!Curl_host_is_ip("example.com"));
+
+  ASSERT(check("127.0.0.1", "127.0.0.1"));
+  ASSERT(!check("*.0.0.1", "127.0.0.1"));
+
+  /* A trailing dot doesn't make an address a name */
+  ASSERT(Curl_host_is_ip("10.0.0.1."));
+  ASSERT(!Curl_host_is_ip("."));
+  ASSERT(check("10.0.0.1", "10.0.0.1."));
+  ASSERT(!check("*.0.0.1", "10.0.0.1."));
+}
+
+TEST(length) {
+  const char* pattern = "*.example.com, and more";
+
+  /* Neither string needs to be NUL terminated */
+  ASSERT(Curl_cert_hostcheck(pattern, 13, "www.example.comxyz", 15, 0));
+  ASSERT(!Curl_cert_hostcheck(pattern, 14, "www.example.com", 15, 0));
+}
+
+TEST_CASE_BEGIN(hostcheck)
+  TEST_ENTRY(exact)
+  TEST_ENTRY(wildcard)
+  TEST_ENTRY(ip_address)
+  TEST_ENTRY(length)
+  TEST_ENTRY_LAST()
+TEST_CASE_END()
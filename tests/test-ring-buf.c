@@ -23,7 +23,9 @@
 
 #include "ring-buf.h"
 #include "utils.h"
+#include "uvtls.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 TEST(one_block) {
@@ -293,6 +295,150 @@ TEST(head_commit_two_blocks_partial_read) {
   uvtls_ring_buf_destroy(&rb);
 }
 
+TEST(head_commit_after_write) {
+  uvtls_ring_buf_t rb;
+  char in[UVTLS_RING_BUF_BLOCK_SIZE + 99];
+  char out[UVTLS_RING_BUF_BLOCK_SIZE + 99];
+  uvtls_ring_buf_pos_t to_commit;
+  uv_buf_t bufs[2];
+  int nbufs = 2;
+
+  fill_pattern(in, sizeof(in));
+
+  ASSERT(0 == uvtls_ring_buf_init(&rb));
+
+  uvtls_ring_buf_write(&rb, in, 99);
+  to_commit = uvtls_ring_buf_head_blocks(&rb, rb.head, bufs, &nbufs);
+  ASSERT(1 == nbufs);
+  ASSERT(99 == (int) bufs[0].len);
+  copy_bufs(bufs, nbufs, out);
+
+  /* More data is written before the handed out blocks are committed */
+  uvtls_ring_buf_write(&rb, in + 99, UVTLS_RING_BUF_BLOCK_SIZE);
+  ASSERT(sizeof(in) == uvtls_ring_buf_size(&rb));
+  ASSERT(2 == uvtls_ring_buf_head_blocks_count(&rb, to_commit));
+
+  uvtls_ring_buf_head_blocks_commit(&rb, to_commit);
+  ASSERT(UVTLS_RING_BUF_BLOCK_SIZE == uvtls_ring_buf_size(&rb));
+
+  nbufs = 2;
+  to_commit = uvtls_ring_buf_head_blocks(&rb, rb.head, bufs, &nbufs);
+  ASSERT(2 == nbufs);
+  copy_bufs(bufs, nbufs, out + 99);
+
+  uvtls_ring_buf_head_blocks_commit(&rb, to_commit);
+  ASSERT(0 == uvtls_ring_buf_size(&rb));
+
+  ASSERT(memcmp(in, out, sizeof(in)) == 0);
+
+  uvtls_ring_buf_destroy(&rb);
+}
+
+TEST(extend) {
+  uvtls_ring_buf_t rb;
+  uvtls_ring_buf_t ext;
+  char in[2 * UVTLS_RING_BUF_BLOCK_SIZE + 99];
+  char out[2 * UVTLS_RING_BUF_BLOCK_SIZE + 99];
+  uvtls_ring_buf_pos_t to_commit;
+  uv_buf_t bufs[3];
+  int nbufs = 3;
+
+  fill_pattern(in, sizeof(in));
+
+  ASSERT(0 == uvtls_ring_buf_init(&rb));
+
+  uvtls_ring_buf_write(&rb, in, 99);
+  to_commit = uvtls_ring_buf_head_blocks(&rb, rb.head, bufs, &nbufs);
+  ASSERT(1 == nbufs);
+  copy_bufs(bufs, nbufs, out);
+
+  /* The existing data is committed while the ring buffer is extended */
+  ASSERT(0 == uvtls_ring_buf_extend_begin(&rb, &ext));
+  uvtls_ring_buf_write(&ext, in + 99, 2 * UVTLS_RING_BUF_BLOCK_SIZE);
+  uvtls_ring_buf_head_blocks_commit(&rb, to_commit);
+  ASSERT(0 == uvtls_ring_buf_size(&rb));
+
+  uvtls_ring_buf_extend_end(&rb, &ext);
+  ASSERT(2 * UVTLS_RING_BUF_BLOCK_SIZE == uvtls_ring_buf_size(&rb));
+
+  nbufs = 3;
+  to_commit = uvtls_ring_buf_head_blocks(&rb, rb.head, bufs, &nbufs);
+  ASSERT(3 == nbufs);
+  copy_bufs(bufs, nbufs, out + 99);
+
+  uvtls_ring_buf_head_blocks_commit(&rb, to_commit);
+  ASSERT(0 == uvtls_ring_buf_size(&rb));
+
+  ASSERT(memcmp(in, out, sizeof(in)) == 0);
+
+  uvtls_ring_buf_destroy(&rb);
+}
+
+TEST(release) {
+  uvtls_ring_buf_t rb;
+  char in[UVTLS_RING_BUF_BLOCK_SIZE + 99];
+  char out[UVTLS_RING_BUF_BLOCK_SIZE + 99];
+  uvtls_ring_buf_pos_t released_pos;
+  uvtls_ring_buf_pos_t to_commit;
+  uv_buf_t bufs[2];
+  int nbufs = 2;
+
+  fill_pattern(in, sizeof(in));
+
+  ASSERT(0 == uvtls_ring_buf_init(&rb));
+  uvtls_ring_buf_write(&rb, in, sizeof(in));
+  ASSERT(2 == uvtls_ring_buf_blocks_count(&rb));
+  ASSERT(sizeof(in) == uvtls_ring_buf_read(&rb, out, sizeof(out)));
+
+  uvtls_ring_buf_release(&rb);
+  ASSERT(0 == uvtls_ring_buf_blocks_count(&rb));
+  ASSERT(0 == uvtls_ring_buf_read(&rb, out, sizeof(out)));
+  released_pos = rb.tail;
+
+  /* Writing reacquires a block and a position taken while released refers to
+   * the head */
+  uvtls_ring_buf_write(&rb, in, 99);
+  ASSERT(1 == uvtls_ring_buf_blocks_count(&rb));
+  ASSERT(1 == uvtls_ring_buf_head_blocks_count(&rb, released_pos));
+  to_commit = uvtls_ring_buf_head_blocks(&rb, released_pos, bufs, &nbufs);
+  ASSERT(1 == nbufs);
+  ASSERT(99 == bufs[0].len);
+  ASSERT(memcmp(in, bufs[0].base, 99) == 0);
+
+  uvtls_ring_buf_head_blocks_commit(&rb, to_commit);
+  ASSERT(0 == uvtls_ring_buf_size(&rb));
+
+  uvtls_ring_buf_destroy(&rb);
+}
+
+static void* failing_malloc(size_t size) {
+  return NULL;
+}
+
+TEST(release_oom) {
+  uvtls_ring_buf_t rb;
+  char in[99];
+
+  fill_pattern(in, sizeof(in));
+
+  ASSERT(0 == uvtls_ring_buf_init(&rb));
+  uvtls_ring_buf_release(&rb);
+
+  /* A released ring buffer fails to be written if a block can't be
+   * reacquired */
+  ASSERT(0 ==
+         uvtls_replace_allocator(failing_malloc, realloc, calloc, free));
+  ASSERT(UV_ENOMEM == uvtls_ring_buf_write(&rb, in, sizeof(in)));
+  ASSERT(0 == uvtls_ring_buf_size(&rb));
+  ASSERT(0 == uvtls_ring_buf_blocks_count(&rb));
+
+  ASSERT(0 == uvtls_replace_allocator(malloc, realloc, calloc, free));
+  ASSERT(0 == uvtls_ring_buf_write(&rb, in, sizeof(in)));
+  ASSERT(sizeof(in) == uvtls_ring_buf_size(&rb));
+
+  uvtls_ring_buf_destroy(&rb);
+}
+
 TEST(reset) {
   uvtls_ring_buf_t rb;
   char in[UVTLS_RING_BUF_BLOCK_SIZE + 99];
@@ -330,5 +476,9 @@ TEST_CASE_BEGIN(ring_buf)
   TEST_ENTRY(head_commit_two_blocks)
   TEST_ENTRY(head_commit_two_blocks_read_to_next_block)
   TEST_ENTRY(head_commit_two_blocks_partial_read)
+  TEST_ENTRY(head_commit_after_write)
+  TEST_ENTRY(extend)
+  TEST_ENTRY(release)
+  TEST_ENTRY(release_oom)
   TEST_ENTRY_LAST()
 TEST_CASE_END()
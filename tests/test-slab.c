@@ -0,0 +1,140 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+
+#include "slab.h"
+#include "uvtls.h"
+
+#include <stdlib.h>
+
+#define CONNECTIONS_COUNT 4
+
+static int malloc_count;
+
+static void* counting_malloc(size_t size) {
+  malloc_count++;
+  return malloc(size);
+}
+
+static void* counting_realloc(void* ptr, size_t size) {
+  malloc_count++;
+  return realloc(ptr, size);
+}
+
+static void* counting_calloc(size_t count, size_t size) {
+  malloc_count++;
+  return calloc(count, size);
+}
+
+TEST(reuse) {
+  uvtls_slab_t slab;
+  void* chunk1;
+  void* chunk2;
+  void* chunk3;
+
+  uvtls_slab_init(&slab, 64, 1);
+
+  chunk1 = uvtls_slab_alloc(&slab);
+  chunk2 = uvtls_slab_alloc(&slab);
+  ASSERT(chunk1 && chunk2 && chunk1 != chunk2);
+
+  uvtls_slab_free(&slab, chunk1);
+  ASSERT(1 == slab.count);
+
+  /* Beyond the limit chunks go back to the allocator */
+  uvtls_slab_free(&slab, chunk2);
+  ASSERT(1 == slab.count);
+
+  chunk3 = uvtls_slab_alloc(&slab);
+  ASSERT(chunk1 == chunk3);
+  ASSERT(0 == slab.count);
+
+  uvtls_slab_free(&slab, chunk3);
+  uvtls_slab_destroy(&slab);
+  ASSERT(0 == slab.count);
+  ASSERT(NULL == slab.free_list);
+}
+
+static int init_close(uv_loop_t* loop,
+                      uvtls_loop_t* tls_loop,
+                      uvtls_context_t* context) {
+  uv_tcp_t tcp;
+  uvtls_t tls;
+  int count;
+
+  ASSERT(0 == uv_tcp_init(loop, &tcp));
+
+  malloc_count = 0;
+  ASSERT(0 == uvtls_init_ex(&tls, context, (uv_stream_t*) &tcp, tls_loop));
+  count = malloc_count;
+
+  uvtls_close(&tls, NULL);
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  return count;
+}
+
+TEST(connection_allocations) {
+  uv_loop_t loop;
+  uvtls_loop_t tls_loop;
+  uvtls_context_t context;
+  int counts[CONNECTIONS_COUNT];
+  int i;
+
+  ASSERT(0 == uv_loop_init(&loop));
+  ASSERT(0 == uvtls_loop_init(&tls_loop, &loop));
+  ASSERT(0 == uvtls_context_init(&context, UVTLS_CONTEXT_LIB_INIT));
+
+  ASSERT(0 == uvtls_replace_allocator(
+                  counting_malloc, counting_realloc, counting_calloc, free));
+
+  /* Warm up OpenSSL's one-time allocations */
+  init_close(&loop, NULL, &context);
+
+  for (i = 0; i < CONNECTIONS_COUNT; ++i) {
+    counts[i] = init_close(&loop, &tls_loop, &context);
+  }
+
+  /* The session and both ring buffers' blocks are reused from the loop */
+  ASSERT(counts[0] - 3 == counts[1]);
+  for (i = 2; i < CONNECTIONS_COUNT; ++i) {
+    ASSERT(counts[1] == counts[i]);
+  }
+
+  ASSERT(0 == uvtls_replace_allocator(malloc, realloc, calloc, free));
+
+  /* The closed connections' memory is still cached by the loop */
+  ASSERT(uvtls_get_total_memory_usage() > 0);
+
+  uvtls_loop_close(&tls_loop, NULL);
+  uv_run(&loop, UV_RUN_DEFAULT);
+  ASSERT(0 == uvtls_get_total_memory_usage());
+
+  uvtls_context_destroy(&context);
+  ASSERT(0 == uv_loop_close(&loop));
+}
+
+TEST_CASE_BEGIN(slab)
+  TEST_ENTRY(reuse)
+  TEST_ENTRY(connection_allocations)
+  TEST_ENTRY_LAST()
+TEST_CASE_END()
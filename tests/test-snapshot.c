@@ -0,0 +1,160 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+
+#include "atomic.h"
+#include "snapshot.h"
+
+#define READER_THREADS 4
+#define PUBLISH_COUNT 1000
+
+static int freed_count;
+
+static void free_int(void* data) {
+  freed_count++;
+  free(data);
+}
+
+static int* new_int(int value) {
+  int* data = (int*) malloc(sizeof(int));
+  *data = value;
+  return data;
+}
+
+TEST(publish) {
+  uvtls_snapshot_t snapshot;
+  int* data;
+
+  freed_count = 0;
+  ASSERT(0 == uvtls_snapshot_init(&snapshot, free_int));
+
+  ASSERT(NULL == uvtls_snapshot_acquire(&snapshot));
+  uvtls_snapshot_release(&snapshot);
+
+  uvtls_snapshot_publish(&snapshot, new_int(1));
+  data = (int*) uvtls_snapshot_acquire(&snapshot);
+  ASSERT(1 == *data);
+
+  /* The previous data is retired, but not freed, while it's being read */
+  uvtls_snapshot_publish(&snapshot, new_int(2));
+  ASSERT(0 == freed_count);
+  ASSERT(1 == *data);
+  uvtls_snapshot_release(&snapshot);
+
+  uvtls_snapshot_publish(&snapshot, new_int(3));
+  ASSERT(2 == freed_count);
+
+  data = (int*) uvtls_snapshot_acquire(&snapshot);
+  ASSERT(3 == *data);
+  uvtls_snapshot_release(&snapshot);
+
+  uvtls_snapshot_destroy(&snapshot);
+  ASSERT(3 == freed_count);
+}
+
+TEST(steady_readers) {
+  uvtls_snapshot_t snapshot;
+  int* data;
+
+  freed_count = 0;
+  ASSERT(0 == uvtls_snapshot_init(&snapshot, free_int));
+  uvtls_snapshot_publish(&snapshot, new_int(1));
+
+  data = (int*) uvtls_snapshot_acquire(&snapshot);
+  uvtls_snapshot_publish(&snapshot, new_int(2));
+  ASSERT(0 == freed_count);
+  ASSERT(1 == *data);
+
+  /* There's always a reader, but it started after the first data was
+   * retired */
+  uvtls_snapshot_release(&snapshot);
+  data = (int*) uvtls_snapshot_acquire(&snapshot);
+  ASSERT(2 == *data);
+  uvtls_snapshot_publish(&snapshot, new_int(3));
+  ASSERT(1 == freed_count);
+  ASSERT(2 == *data);
+  uvtls_snapshot_release(&snapshot);
+
+  uvtls_snapshot_destroy(&snapshot);
+  ASSERT(3 == freed_count);
+}
+
+typedef struct reader_s reader_t;
+
+struct reader_s {
+  uvtls_snapshot_t* snapshot;
+  long* done;
+  int is_ordered;
+};
+
+static void on_reader(void* arg) {
+  reader_t* reader = (reader_t*) arg;
+  int last = 0;
+  reader->is_ordered = 1;
+  while (!uvtls_atomic_load(reader->done)) {
+    int* data = (int*) uvtls_snapshot_acquire(reader->snapshot);
+    int value = *data;
+    if (value < last) {
+      reader->is_ordered = 0;
+    }
+    last = value;
+    uvtls_snapshot_release(reader->snapshot);
+  }
+}
+
+TEST(publish_concurrent) {
+  uvtls_snapshot_t snapshot;
+  uv_thread_t threads[READER_THREADS];
+  reader_t readers[READER_THREADS];
+  long done = 0;
+  int i;
+
+  freed_count = 0;
+  ASSERT(0 == uvtls_snapshot_init(&snapshot, free_int));
+  uvtls_snapshot_publish(&snapshot, new_int(0));
+
+  for (i = 0; i < READER_THREADS; ++i) {
+    readers[i].snapshot = &snapshot;
+    readers[i].done = &done;
+    ASSERT(0 == uv_thread_create(&threads[i], on_reader, &readers[i]));
+  }
+
+  for (i = 1; i <= PUBLISH_COUNT; ++i) {
+    uvtls_snapshot_publish(&snapshot, new_int(i));
+  }
+
+  uvtls_atomic_add(&done, 1);
+  for (i = 0; i < READER_THREADS; ++i) {
+    ASSERT(0 == uv_thread_join(&threads[i]));
+    ASSERT(readers[i].is_ordered);
+  }
+
+  uvtls_snapshot_destroy(&snapshot);
+  ASSERT(PUBLISH_COUNT + 1 == freed_count);
+}
+
+TEST_CASE_BEGIN(snapshot)
+  TEST_ENTRY(publish)
+  TEST_ENTRY(steady_readers)
+  TEST_ENTRY(publish_concurrent)
+  TEST_ENTRY_LAST()
+TEST_CASE_END()
@@ -0,0 +1,186 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "test.h"
+
+#include "timer-wheel.h"
+
+#define MAX_EXPIRED 8
+
+typedef struct expired_s expired_t;
+
+struct expired_s {
+  uvtls_timer_wheel_entry_t* entries[MAX_EXPIRED];
+  int count;
+};
+
+static void on_expire(uvtls_timer_wheel_entry_t* entry, void* data) {
+  expired_t* expired = (expired_t*) data;
+  FATAL(expired->count < MAX_EXPIRED);
+  expired->entries[expired->count++] = entry;
+}
+
+/* Expire and return the single expired entry, or NULL if there's none */
+static uvtls_timer_wheel_entry_t* expire_one(uvtls_timer_wheel_t* wheel,
+                                             uint64_t now) {
+  expired_t expired;
+  expired.count = 0;
+  uvtls_timer_wheel_expire(wheel, now, on_expire, &expired);
+  FATAL(expired.count <= 1);
+  return expired.count == 1 ? expired.entries[0] : NULL;
+}
+
+TEST(expire) {
+  uvtls_timer_wheel_t wheel;
+  uvtls_timer_wheel_entry_t entry1, entry2;
+
+  uvtls_timer_wheel_init(&wheel, 10, 1000);
+  uvtls_timer_wheel_entry_init(&entry1);
+  uvtls_timer_wheel_entry_init(&entry2);
+
+  uvtls_timer_wheel_add(&wheel, &entry1, 1000, 50);
+  uvtls_timer_wheel_add(&wheel, &entry2, 1000, 100);
+  ASSERT(uvtls_timer_wheel_entry_is_active(&entry1));
+  ASSERT(uvtls_timer_wheel_entry_is_active(&entry2));
+
+  ASSERT(NULL == expire_one(&wheel, 1040));
+  ASSERT(&entry1 == expire_one(&wheel, 1050));
+  ASSERT(!uvtls_timer_wheel_entry_is_active(&entry1));
+  ASSERT(NULL == expire_one(&wheel, 1050));
+
+  ASSERT(&entry2 == expire_one(&wheel, 1200));
+  ASSERT(NULL == expire_one(&wheel, 1200));
+  ASSERT(uvtls_timer_wheel_empty(&wheel));
+}
+
+TEST(remove) {
+  uvtls_timer_wheel_t wheel;
+  uvtls_timer_wheel_entry_t entry;
+
+  uvtls_timer_wheel_init(&wheel, 10, 0);
+  uvtls_timer_wheel_entry_init(&entry);
+
+  uvtls_timer_wheel_add(&wheel, &entry, 0, 50);
+  uvtls_timer_wheel_remove(&wheel, &entry);
+  ASSERT(!uvtls_timer_wheel_entry_is_active(&entry));
+  ASSERT(uvtls_timer_wheel_empty(&wheel));
+
+  /* Removing an inactive entry is a no-op */
+  uvtls_timer_wheel_remove(&wheel, &entry);
+  ASSERT(uvtls_timer_wheel_empty(&wheel));
+
+  ASSERT(NULL == expire_one(&wheel, 100));
+}
+
+TEST(multiple_rotations) {
+  uvtls_timer_wheel_t wheel;
+  uvtls_timer_wheel_entry_t entry;
+  uint64_t now;
+  uint64_t timeout = 3 * UVTLS_TIMER_WHEEL_SLOTS + 5;
+
+  uvtls_timer_wheel_init(&wheel, 1, 0);
+  uvtls_timer_wheel_entry_init(&entry);
+
+  uvtls_timer_wheel_add(&wheel, &entry, 0, timeout);
+
+  for (now = 0; now < timeout; ++now) {
+    ASSERT(NULL == expire_one(&wheel, now));
+  }
+  ASSERT(&entry == expire_one(&wheel, timeout));
+}
+
+TEST(idle_skip) {
+  uvtls_timer_wheel_t wheel;
+  uvtls_timer_wheel_entry_t entry;
+
+  uvtls_timer_wheel_init(&wheel, 1, 0);
+  uvtls_timer_wheel_entry_init(&entry);
+
+  /* Adding to an idle wheel starts from the current time, not the time of
+   * the last expire */
+  uvtls_timer_wheel_add(&wheel, &entry, 1000000, 10);
+  ASSERT(wheel.tick == 1000000);
+  ASSERT(NULL == expire_one(&wheel, 1000009));
+  ASSERT(&entry == expire_one(&wheel, 1000010));
+}
+
+TEST(expire_slot) {
+  uvtls_timer_wheel_t wheel;
+  uvtls_timer_wheel_entry_t entry1, entry2, entry3;
+  expired_t expired;
+
+  uvtls_timer_wheel_init(&wheel, 1, 0);
+  uvtls_timer_wheel_entry_init(&entry1);
+  uvtls_timer_wheel_entry_init(&entry2);
+  uvtls_timer_wheel_entry_init(&entry3);
+
+  /* All in the same slot, the second a rotation later */
+  uvtls_timer_wheel_add(&wheel, &entry1, 0, 10);
+  uvtls_timer_wheel_add(&wheel, &entry2, 0, 10 + UVTLS_TIMER_WHEEL_SLOTS);
+  uvtls_timer_wheel_add(&wheel, &entry3, 0, 10);
+
+  /* Due entries are expired in one call and the later one is kept */
+  expired.count = 0;
+  uvtls_timer_wheel_expire(&wheel, 10, on_expire, &expired);
+  ASSERT(2 == expired.count);
+  ASSERT(&entry1 == expired.entries[0]);
+  ASSERT(&entry3 == expired.entries[1]);
+  ASSERT(uvtls_timer_wheel_entry_is_active(&entry2));
+
+  expired.count = 0;
+  uvtls_timer_wheel_expire(
+      &wheel, 10 + UVTLS_TIMER_WHEEL_SLOTS, on_expire, &expired);
+  ASSERT(1 == expired.count);
+  ASSERT(&entry2 == expired.entries[0]);
+  ASSERT(uvtls_timer_wheel_empty(&wheel));
+}
+
+static void on_expire_remove(uvtls_timer_wheel_entry_t* entry, void* data) {
+  uvtls_timer_wheel_t* wheel = (uvtls_timer_wheel_t*) data;
+  uvtls_timer_wheel_entry_t* other = entry + 1;
+  uvtls_timer_wheel_remove(wheel, other);
+}
+
+TEST(expire_remove) {
+  uvtls_timer_wheel_t wheel;
+  uvtls_timer_wheel_entry_t entries[2];
+
+  uvtls_timer_wheel_init(&wheel, 1, 0);
+  uvtls_timer_wheel_entry_init(&entries[0]);
+  uvtls_timer_wheel_entry_init(&entries[1]);
+
+  /* The callback removes the next entry of the slot being expired */
+  uvtls_timer_wheel_add(&wheel, &entries[0], 0, 10);
+  uvtls_timer_wheel_add(&wheel, &entries[1], 0, 10);
+  uvtls_timer_wheel_expire(&wheel, 10, on_expire_remove, &wheel);
+  ASSERT(!uvtls_timer_wheel_entry_is_active(&entries[1]));
+  ASSERT(uvtls_timer_wheel_empty(&wheel));
+}
+
+TEST_CASE_BEGIN(timer_wheel)
+  TEST_ENTRY(expire)
+  TEST_ENTRY(remove)
+  TEST_ENTRY(multiple_rotations)
+  TEST_ENTRY(idle_skip)
+  TEST_ENTRY(expire_slot)
+  TEST_ENTRY(expire_remove)
+  TEST_ENTRY_LAST()
+TEST_CASE_END()
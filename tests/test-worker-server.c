@@ -0,0 +1,223 @@
+/* Copyright Michael A. Penick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <openssl/ssl.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "certs.h"
+#include "server.h"
+#include "test.h"
+#include "uvtls.h"
+
+#define WORKERS_COUNT 2
+#define CONNECTIONS_COUNT 8
+
+typedef struct connection_s connection_t;
+typedef struct worker_state_s worker_state_t;
+
+struct connection_s {
+  uv_tcp_t tcp;
+  uvtls_t tls;
+  worker_state_t* state;
+  char buf[1024];
+};
+
+struct worker_state_s {
+  int accepted;
+  connection_t* connections[CONNECTIONS_COUNT];
+};
+
+static uv_loop_t loop;
+static uv_async_t async;
+static uvtls_context_t tls_context;
+static uvtls_server_t server;
+static worker_state_t states[WORKERS_COUNT];
+static int was_close_cb_called;
+
+static void on_connection_close(uvtls_t* tls) {
+  int i;
+  connection_t* connection = (connection_t*) tls->data;
+
+  for (i = 0; i < CONNECTIONS_COUNT; ++i) {
+    if (connection->state->connections[i] == connection) {
+      connection->state->connections[i] = NULL;
+      break;
+    }
+  }
+  free(connection);
+}
+
+static void on_alloc(uvtls_t* tls, size_t suggested_size, uv_buf_t* buf) {
+  connection_t* connection = (connection_t*) tls->data;
+  buf->base = connection->buf;
+  buf->len = sizeof(connection->buf);
+}
+
+static void on_read(uvtls_t* tls, ssize_t nread, const uv_buf_t* buf) {
+  if (nread < 0) {
+    uvtls_close(tls, on_connection_close);
+  }
+}
+
+static void on_accept(uvtls_t* tls, int status) {
+  if (status != 0) {
+    uvtls_close(tls, on_connection_close);
+    return;
+  }
+  uvtls_read_start(tls, on_alloc, on_read);
+}
+
+static void on_worker_connection(uvtls_worker_t* worker, int status) {
+  int i;
+  worker_state_t* state = (worker_state_t*) worker->data;
+  connection_t* connection = (connection_t*) malloc(sizeof(connection_t));
+
+  FATAL(status == 0);
+  FATAL(connection != NULL);
+  connection->tls.data = connection;
+  connection->state = state;
+
+  FATAL(0 == uv_tcp_init(&worker->loop, &connection->tcp));
+  FATAL(0 == uvtls_worker_accept(
+                 worker, &connection->tls, (uv_stream_t*) &connection->tcp));
+  FATAL(0 == uvtls_accept(&connection->tls, on_accept));
+
+  for (i = 0; i < CONNECTIONS_COUNT; ++i) {
+    if (!state->connections[i]) {
+      state->connections[i] = connection;
+      break;
+    }
+  }
+  FATAL(i < CONNECTIONS_COUNT);
+  state->accepted++;
+}
+
+static void on_worker_stop(uvtls_worker_t* worker) {
+  int i;
+  worker_state_t* state = (worker_state_t*) worker->data;
+
+  for (i = 0; i < CONNECTIONS_COUNT; ++i) {
+    connection_t* connection = state->connections[i];
+    if (connection && !uvtls_is_closing(&connection->tls)) {
+      uvtls_close(&connection->tls, on_connection_close);
+    }
+  }
+}
+
+static void on_server_close(uvtls_server_t* server) {
+  was_close_cb_called = 1;
+}
+
+static void on_async(uv_async_t* handle) {
+  uvtls_server_close(&server, on_server_close);
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+static void on_run(void* arg) {
+  uv_run(&loop, UV_RUN_DEFAULT);
+}
+
+static void setup(void) {
+  unsigned int i;
+
+  memset(states, 0, sizeof(states));
+  was_close_cb_called = 0;
+
+  FATAL(0 == uv_loop_init(&loop));
+  FATAL(0 == uvtls_context_init(&tls_context, UVTLS_CONTEXT_LIB_INIT));
+  uvtls_context_set_verify_flags(&tls_context, UVTLS_VERIFY_NONE);
+  FATAL(0 == uvtls_context_set_cert(
+                 &tls_context, server_cert, strlen(server_cert)));
+  FATAL(0 == uvtls_context_set_private_key(
+                 &tls_context, server_key, strlen(server_key)));
+
+  FATAL(0 == uvtls_server_init(&server, &loop, &tls_context, WORKERS_COUNT));
+  for (i = 0; i < WORKERS_COUNT; ++i) {
+    server.workers[i].data = &states[i];
+  }
+}
+
+static void teardown(void) {
+  uvtls_context_destroy(&tls_context);
+  ASSERT(0 == uv_loop_close(&loop));
+}
+
+/* Completes a handshake using a blocking OpenSSL client. */
+static int connect_client(void) {
+  int rc;
+  SSL_CTX* ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+  BIO* bio = BIO_new_ssl_connect(ssl_ctx);
+  FATAL(bio != NULL);
+
+  BIO_set_conn_hostname(bio, "127.0.0.1:65443");
+  rc = BIO_do_handshake(bio) > 0 ? 0 : -1;
+
+  BIO_free_all(bio);
+  SSL_CTX_free(ssl_ctx);
+  return rc;
+}
+
+TEST(dispatch) {
+  int i;
+  uv_thread_t thread;
+  struct sockaddr_in addr;
+  uv_ip4_addr("0.0.0.0", SERVER_PORT, &addr);
+
+  setup();
+  ASSERT(0 == uv_async_init(&loop, &async, on_async));
+  ASSERT(0 == uvtls_server_listen(&server,
+                                  (const struct sockaddr*) &addr,
+                                  100,
+                                  on_worker_connection,
+                                  on_worker_stop));
+  ASSERT(0 == uv_thread_create(&thread, on_run, NULL));
+
+  for (i = 0; i < CONNECTIONS_COUNT; ++i) {
+    ASSERT(0 == connect_client());
+  }
+
+  uv_async_send(&async);
+  uv_thread_join(&thread);
+
+  ASSERT(was_close_cb_called);
+  for (i = 0; i < WORKERS_COUNT; ++i) {
+    /* Connections are handed to the workers round-robin */
+    ASSERT(CONNECTIONS_COUNT / WORKERS_COUNT == states[i].accepted);
+  }
+
+  teardown();
+}
+
+TEST(close_without_listen) {
+  setup();
+  uvtls_server_close(&server, on_server_close);
+  uv_run(&loop, UV_RUN_DEFAULT);
+  ASSERT(was_close_cb_called);
+  teardown();
+}
+
+TEST_CASE_BEGIN(worker_server)
+  TEST_ENTRY(dispatch)
+  TEST_ENTRY(close_without_listen)
+  TEST_ENTRY_LAST()
+TEST_CASE_END()